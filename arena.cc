@@ -0,0 +1,110 @@
+#include <new>
+#include <cstdint>
+
+#include "arena.hh"
+
+namespace
+{
+    const std::size_t ChunkSize = 0x10000;
+    const std::size_t Alignment = alignof(std::max_align_t);
+
+    static_assert(ChunkSize % Alignment == 0, "Bad chunk size");
+
+    char* Align(char* p)
+    {
+        return p + (Alignment - reinterpret_cast<std::uintptr_t>(p) % Alignment) % Alignment;
+    }
+}
+
+thread_local Arena* Arena::active = nullptr;
+
+Arena::Arena(): chunks(nullptr), pos(nullptr), end(nullptr)
+{
+}
+
+Arena::~Arena()
+{
+    while(chunks)
+    {
+        Chunk* next = chunks->next;
+        ::operator delete(chunks);
+        chunks = next;
+    }
+}
+
+void* Arena::Allocate(std::size_t size)
+{
+    size = (size + Alignment-1) & ~(Alignment-1);
+    if(size > std::size_t(end - pos))
+    {
+        std::size_t chunksize = size > ChunkSize ? size : ChunkSize;
+        Chunk* c = static_cast<Chunk*>(::operator new(sizeof(Chunk) + Alignment + chunksize));
+        c->size = chunksize;
+
+        char* begin = Align(c->Begin());
+
+        if(size < ChunkSize || !chunks)
+        {
+            c->next = chunks;
+            chunks  = c;
+            pos = begin;
+            end = begin + chunksize;
+        }
+        else
+        {
+            // A big allocation goes behind the current chunk,
+            // which still has room for the small ones.
+            c->next = chunks->next;
+            chunks->next = c;
+            return begin;
+        }
+    }
+    void* result = pos;
+    pos += size;
+    return result;
+}
+
+void Arena::Reset()
+{
+    if(!chunks) return;
+    while(chunks->next)
+    {
+        Chunk* next = chunks->next->next;
+        ::operator delete(chunks->next);
+        chunks->next = next;
+    }
+    pos = Align(chunks->Begin());
+    end = pos + chunks->size;
+}
+
+bool Arena::Owns(const void* p) const
+{
+    const char* c = static_cast<const char*>(p);
+    for(Chunk* chunk = chunks; chunk; chunk = chunk->next)
+        if(c >= chunk->Begin() && c < chunk->Begin() + Alignment + chunk->size)
+            return true;
+    return false;
+}
+
+void* Arena::New(std::size_t size)
+{
+    if(active) return active->Allocate(size);
+    return ::operator new(size);
+}
+
+void Arena::Delete(void* p)
+{
+    if(!p || (active && active->Owns(p))) return;
+    ::operator delete(p);
+}
+
+Arena::Scope::Scope(Arena& a): arena(a), previous(active)
+{
+    active = &arena;
+}
+
+Arena::Scope::~Scope()
+{
+    arena.Reset();
+    active = previous;
+}
@@ -0,0 +1,81 @@
+#ifndef bqt65asmArenaHH
+#define bqt65asmArenaHH
+
+#include <cstddef>
+
+/* A bump allocator for short-lived objects, such as the expression
+ * trees and opcode choices of one statement. Memory is handed out
+ * from large chunks and released all at once by Reset().
+ *
+ * While an Arena::Scope is alive, New() allocates from its arena
+ * (in the current thread). Otherwise New() uses the heap.
+ * Delete() accepts memory from either.
+ */
+class Arena
+{
+public:
+    Arena();
+    ~Arena();
+
+    void* Allocate(std::size_t size);
+
+    /* Releases everything that was allocated. Keeps the first chunk. */
+    void Reset();
+
+    bool Owns(const void* p) const;
+
+    static void* New(std::size_t size);
+    static void Delete(void* p);
+
+    /* Makes the arena active, and resets it when the scope ends.
+     * Everything allocated in the scope must be destroyed by then.
+     */
+    class Scope
+    {
+    public:
+        explicit Scope(Arena& a);
+        ~Scope();
+    private:
+        Arena& arena;
+        Arena* previous;
+
+        Scope(const Scope&) = delete;
+        const Scope& operator= (const Scope&) = delete;
+    };
+
+private:
+    struct Chunk
+    {
+        Chunk* next;
+        std::size_t size;
+        char* Begin() { return reinterpret_cast<char*>(this + 1); }
+    };
+
+    Chunk* chunks; // The most recent first
+    char *pos, *end;
+
+    static thread_local Arena* active;
+
+private:
+    // Copying prohibited
+    Arena(const Arena&) = delete;
+    const Arena& operator= (const Arena&) = delete;
+};
+
+/* For STL containers whose nodes should live in the active arena. */
+template<typename T>
+struct ArenaAllocator
+{
+    typedef T value_type;
+
+    ArenaAllocator() { }
+    template<typename U> ArenaAllocator(const ArenaAllocator<U>&) { }
+
+    T* allocate(std::size_t n) { return static_cast<T*>(Arena::New(n * sizeof(T))); }
+    void deallocate(T* p, std::size_t) { Arena::Delete(p); }
+
+    template<typename U> bool operator==(const ArenaAllocator<U>&) const { return true; }
+    template<typename U> bool operator!=(const ArenaAllocator<U>&) const { return false; }
+};
+
+#endif
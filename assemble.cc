@@ -12,9 +12,9 @@
 #include "object.hh"
 #include "insdata.hh"
 #include "precompile.hh"
-
-static std::map<unsigned, std::string> PrevBranchLabel; // What "-" means (for each length of "-")
-static std::map<unsigned, std::string> NextBranchLabel; // What "+" means (for each length of "+")
+#include "arena.hh"
+#include "mapfile.hh"
+#include "listing.hh"
 
 #define SHOW_CHOICES   0
 #define SHOW_POSSIBLES 0
@@ -24,14 +24,28 @@ namespace
     struct OpcodeChoice
     {
         typedef std::pair<unsigned, struct ins_parameter> paramtype;
-        std::vector<paramtype> parameters;
+        typedef std::vector<paramtype, ArenaAllocator<paramtype> > paramlist;
+        paramlist parameters;
         bool is_certain;
 
+        // Operands that are moved into parameters if this choice is taken
+        ins_parameter *operands[2];
+        bool is_rel8;
+
     public:
-        OpcodeChoice(): parameters(), is_certain(false) { }
+        OpcodeChoice(): parameters(), is_certain(false), operands(), is_rel8(false) { }
         void FlipREL8();
+        void TakeOperands();
     };
 
+    void OpcodeChoice::TakeOperands()
+    {
+        unsigned n = 1;
+        for(ins_parameter* p: operands)
+            if(p) parameters[n++].second = std::move(*p);
+        if(is_rel8) parameters[1].second.prefix = FORCE_REL8;
+    }
+
     void OpcodeChoice::FlipREL8()
     {
         // Must have:
@@ -59,7 +73,7 @@ namespace
             std::sprintf(Buf, "Parameter 2 is not byte (size is %u bytes)", parameters[1].first);
             errors.push_back(Buf);
         }
-        if(!parameters[0].second.exp->IsConst())
+        if(!parameters[0].second.exp.IsConst())
         {
             char Buf[128];
             std::sprintf(Buf, "Parameter 1 is not const");
@@ -88,7 +102,7 @@ namespace
             return;
         }
 
-        unsigned char opcode = parameters[0].second.exp->GetConst();
+        unsigned char opcode = parameters[0].second.exp.GetConst();
 
         // 10 30 bpl bmi
         // 50 70 bvc bvs
@@ -96,7 +110,7 @@ namespace
         // D0 F0 bne beq
         opcode ^= 0x20; // This flips the polarity
 
-        std::vector<paramtype> newparams;
+        paramlist newparams;
         // Insert a reverse-jump-by.
         newparams.push_back(paramtype(1, opcode));
         newparams.push_back(paramtype(1, 0x03));
@@ -113,66 +127,44 @@ namespace
         parameters = std::move(newparams);
     }
 
-    typedef std::vector<OpcodeChoice> ChoiceList;
-
-    std::list<std::string> DefinedBranchLabels;
-
-    void CreateNewPrevBranch(unsigned length)
-    {
-        static unsigned BranchNumber = 0;
-        char Buf[128];
-        std::sprintf(Buf, "$PrevBranch%u$%u", length,++BranchNumber);
-
-        DefinedBranchLabels.push_back(PrevBranchLabel[length] = Buf);
-    }
-    void CreateNewNextBranch(unsigned length)
-    {
-        static unsigned BranchNumber = 0;
-        char Buf[128];
-        std::sprintf(Buf, "$NextBranch%u$%u", length,++BranchNumber);
-
-        DefinedBranchLabels.push_back(NextBranchLabel[length] = Buf);
-    }
-    const std::string CreateNopLabel()
-    {
-        static unsigned BranchNumber = 0;
-        char Buf[128];
-        std::sprintf(Buf, "$NopLabel$%u", ++BranchNumber);
+    typedef std::vector<OpcodeChoice, ArenaAllocator<OpcodeChoice> > ChoiceList;
 
-        DefinedBranchLabels.push_back(Buf);
-        return Buf;
-    }
+    // Expression trees and opcode choices of the statement being assembled
+    thread_local Arena StatementArena;
 
     unsigned ParseConst(ins_parameter& p, const Object& obj)
     {
         unsigned value = 0;
 
-        std::set<std::string> labels;
-        FindExprUsedLabels(p.exp, labels);
+        std::set<SymbolId> ids;
+        FindExprUsedLabels(p.exp, ids);
 
-        for(const std::string& label: labels)
+        // Substituted in name order
+        std::map<std::string, SymbolId> labels;
+        for(SymbolId id: ids)
+            labels.emplace(SymbolName(id), id);
+
+        for(const auto& label: labels)
         {
             SegmentSelection seg;
-            if(obj.FindLabel(label, seg, value))
+            if(obj.FindLabel(label.second, seg, value))
             {
-                std::string before = p.exp->Dump();
-                SubstituteExprLabel(p.exp, label, value);
-                p.exp->Optimize(p.exp);
-                /*fprintf(stderr, "Label substituted(%s)value($%X), result before(%s) after(%s)\n",
-                    label.c_str(), value,
-                    before.c_str(), p.exp->Dump().c_str());*/
+                SubstituteExprLabel(p.exp, label.second, value);
+                p.exp.Optimize();
+                /*fprintf(stderr, "Label substituted(%s)value($%X), result(%s)\n",
+                    label.first.c_str(), value, p.exp.Dump().c_str());*/
             }
-            else
+            else if(!obj.GetReprocessed())
             {
                 fprintf(stderr,
                     "Error: Undefined label \"%s\" in expression - got \"%s\"\n",
-                    label.c_str(), p.Dump().c_str());
+                    label.first.c_str(), p.Dump().c_str());
             }
         }
 
-        if(p.exp->IsConst())
-            value = p.exp->GetConst();
-        else
+        if(p.exp.IsConst())
+            value = p.exp.GetConst();
+        else if(!obj.GetReprocessed())
         {
             fprintf(stderr,
                 "Error: Expression must be const - got \"%s\"\n",
@@ -182,13 +174,286 @@ namespace
         return value;
     }
 
+    void EmitCode(const OpcodeChoice& c, Object& result)
+    {
+        for(unsigned b=0; b<c.parameters.size(); ++b)
+        {
+            long value = 0;
+            SymbolId ref = 0;
+
+            unsigned size              = c.parameters[b].first;
+            const ins_parameter& param = c.parameters[b].second;
+
+            const expression& e = param.exp;
+            const std::size_t root = e.nodes.size()-1;
+
+            if(e.IsConst())
+            {
+                value = e.GetConst();
+            }
+            else if(e.nodes[root].tag == expression::Label)
+            {
+                ref = e.nodes[root].value;
+            }
+            else if(e.nodes[root].tag == expression::Sum)
+            {
+                /* constant should always be last in a sum. */
+
+                /* A sum always has at least 2 terms.
+                 * If it has 0, it's converted to a number.
+                 * if it has 1, it's converter into the term itself (or a negation).
+                 */
+
+                // The terms end before the Term nodes that follow them.
+                const std::size_t last_term  = root-1;
+                const std::size_t last_begin = e.Begin(last_term-1);
+                const std::size_t first_term = last_begin-1;
+
+                SymbolId label = 0;
+                const char *error = NULL;
+                if(e.nodes[root].value != 2)
+                {
+                    error = "must have 2 elements";
+                }
+                else if(!e.IsConst(last_begin, last_term)) // If 2nd isn't const
+                {
+                    error = "2nd elem isn't const";
+                }
+                else if(e.nodes[first_term].value)  // If 1st isn't positive
+                {
+                    error = "1st elem must not be negative";
+                }
+                else if(e.nodes[first_term-1].tag == expression::Label)
+                {
+                    label = e.nodes[first_term-1].value;
+                }
+                else
+                {
+                    error = "1st elem must be a label";
+                }
+                if(error)
+                {
+                    /* Invalid pointer arithmetic */
+                    if(!result.GetReprocessed())
+                        std::fprintf(stderr, "Invalid pointer arithmetic (%s): '%s'\n",
+                            error,
+                            e.Dump().c_str());
+                    continue;
+                }
+
+                ref   = label;
+                value = e.GetConst(last_begin, last_term);
+            }
+            else
+            {
+                if(!result.GetReprocessed())
+                    fprintf(stderr, "Invalid parameter (not a label/const/label+const): '%s'\n",
+                        e.Dump().c_str());
+                continue;
+            }
+
+            char prefix = param.prefix;
+            /*if(ref && !prefix)
+            {
+                // If the symbol is known and resides in .zero segment,
+                // force the LOBYTE prefix.
+                SegmentSelection seg;
+                unsigned dummyvalue=0;
+                std::fprintf(stderr, "Checking if %u-byte reference to '%s' is in ZERO...\n", size, SymbolName(ref).c_str());
+                if(result.FindLabel(ref, seg, dummyvalue) && seg == ZERO && value+dummyvalue < 256)
+                {
+                    std::fprintf(stderr, "Reference to %s (%u) coded as lobyte\n", SymbolName(ref).c_str(), dummyvalue);
+                    prefix = FORCE_LOBYTE;
+                }
+            }*/
+
+            if(!prefix)
+            {
+                // Pick a prefix that represents what we're actually doing here
+                switch(size)
+                {
+                    case 1: prefix = FORCE_LOBYTE; break;
+                    case 2: prefix = FORCE_ABSWORD; break;
+                    case 3: prefix = FORCE_LONG; break;
+                    default:
+                        std::fprintf(stderr, "Internal error - unknown size: %u\n", size);
+                }
+            }
+
+            if(ref)
+            {
+                result.AddExtern(prefix, ref, value);
+                value = 0;
+            }
+            else if(prefix == FORCE_REL8 && !result.GetReprocessed())
+            {
+                std::fprintf(stderr, "Error: Relative target must not be a constant\n");
+                // FIXME: It isn't so bad...
+            }
+
+            switch(prefix)
+            {
+                case FORCE_SEGBYTE:
+                    result.GenerateByte((value >>16) & 0xFF);
+                    break;
+                case FORCE_LONG:
+                    result.GenerateByte((value >> 0) & 0xFF);
+                    result.GenerateByte((value >> 8) & 0xFF);
+                    result.GenerateByte((value >>16) & 0xFF);
+                    break;
+                case FORCE_ABSWORD:
+                    result.GenerateByte((value >> 0) & 0xFF);
+                    result.GenerateByte((value >> 8) & 0xFF);
+                    break;
+                case FORCE_HIBYTE:
+                    result.GenerateByte((value >> 8) & 0xFF);
+                    break;
+                case FORCE_LOBYTE:
+                    result.GenerateByte((value >> 0) & 0xFF);
+                    break;
+                case FORCE_REL8:
+                    result.GenerateByte(0x00);
+                    break;
+            }
+
+#if SHOW_CHOICES
+            std::fprintf(stderr, " %s(%u)", param.Dump().c_str(), size);
+#endif
+        }
+    }
+
+    /* If the choice has a word operand that is a byte in another choice,
+     * tells which param it is and the opcode for the byte.
+     */
+    bool FindZeroPageChoice(const ChoiceList& choices, const OpcodeChoice& c,
+                            unsigned& param, unsigned& opcode)
+    {
+        for(const OpcodeChoice& z: choices)
+        {
+            if(z.is_rel8
+            || z.parameters.size() != c.parameters.size()
+            || z.operands[0] != c.operands[0]
+            || z.operands[1] != c.operands[1]) continue;
+
+            unsigned differ = 0, which = 0;
+            for(unsigned b=1; b<c.parameters.size(); ++b)
+                if(z.parameters[b].first != c.parameters[b].first)
+                    { ++differ; which = b; }
+
+            if(differ == 1 && c.parameters[which].first == 2 && z.parameters[which].first == 1)
+            {
+                param  = which;
+                opcode = z.parameters[0].second.exp.GetConst();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    typedef Listing::Statement Statement;
+
+    /* Appends a statement to the listing, if one is kept.
+     * Returns false if not.
+     */
+    bool Record(Object& obj, Statement::Kind kind, SymbolId label = 0, unsigned value = 0)
+    {
+        if(!obj.KeepsListing()) return false;
+
+        Listing& listing = obj.GetListing();
+        listing.statements.emplace_back(kind, label, value);
+
+        Statement& s = listing.statements.back();
+        s.seg   = obj.GetSegment();
+        s.pos   = obj.GetPos();
+        s.begin = s.end = listing.params.size();
+        return true;
+    }
+
+    /* Adds a param to the statement recorded last. */
+    void RecordParam(Object& obj, unsigned size, const ins_parameter& p)
+    {
+        Listing& listing = obj.GetListing();
+        const unsigned begin = listing.nodes.size();
+        listing.nodes.insert(listing.nodes.end(), p.exp.nodes.begin(), p.exp.nodes.end());
+        listing.params.push_back(Listing::Param{size, p.prefix, begin, (unsigned) listing.nodes.size()});
+        listing.statements.back().end = listing.params.size();
+    }
+
+    ins_parameter GetParam(const Listing& listing, unsigned index)
+    {
+        const Listing::Param& param = listing.params[index];
+
+        ins_parameter p;
+        p.prefix = param.prefix;
+        p.exp.nodes.assign(listing.nodes.begin() + param.begin,
+                           listing.nodes.begin() + param.end);
+        return p;
+    }
+
+    /* Does to the object what the statement says. */
+    void Execute(Statement& s, Object& obj)
+    {
+        const Listing& listing = obj.GetListing();
+        switch(s.kind)
+        {
+            case Statement::Code:
+            {
+                OpcodeChoice c;
+                for(unsigned a=s.begin; a<s.end; ++a)
+                    c.parameters.emplace_back(listing.params[a].size, GetParam(listing, a));
+                if(s.flipped)
+                    c.FlipREL8();
+
+                s.seg = obj.GetSegment();
+                s.pos = obj.GetPos();
+                EmitCode(c, obj);
+                break;
+            }
+            case Statement::Label:       obj.DefineLabel(s.value, s.label, obj.GetPos()); break;
+            case Statement::BranchLabel: obj.DefineLabel(s.label); break;
+            case Statement::NopLabel:    obj.DefineLabel(s.label, obj.GetPos() + s.value); break;
+            case Statement::LabelValue:
+            {
+                // The value may depend on labels that have moved
+                ins_parameter p = GetParam(listing, s.begin);
+                obj.DefineLabel(s.value, s.label, ParseConst(p, obj));
+                break;
+            }
+            case Statement::SetPos:
+            {
+                ins_parameter p = GetParam(listing, s.begin);
+                obj.SetPos(ParseConst(p, obj));
+                break;
+            }
+            case Statement::StartScope:  obj.StartScope(); break;
+            case Statement::EndScope:    obj.EndScope(); break;
+            case Statement::SelectTEXT:  obj.SelectTEXT(); break;
+            case Statement::SelectDATA:  obj.SelectDATA(); break;
+            case Statement::SelectZERO:  obj.SelectZERO(); break;
+            case Statement::SelectBSS:   obj.SelectBSS(); break;
+            case Statement::LinkGroup:   obj.SetLinkageGroup(s.value); break;
+            case Statement::LinkPage:    obj.SetLinkagePage(s.value); break;
+            case Statement::UndefineLabel: obj.UndefineLabel(s.label); break;
+        }
+    }
+
+    /* Records the statement and does it. */
+    void Perform(Object& obj, Statement::Kind kind, SymbolId label = 0, unsigned value = 0)
+    {
+        Statement s(kind, label, value);
+        Record(obj, kind, label, value);
+        Execute(s, obj);
+    }
+
     void ParseIns(ParseData& data, Object& result)
     {
     MoreLabels:
-        std::string tok;
-
         data.SkipSpace();
 
+        // The label or mnemonic is the text from here to "tokend"
+        const ParseData::StateType tokstart = data.SaveState();
+        const char first_char = data.PeekC();
+
         if(IsDelimiter(data.PeekC()))
         {
             data.GetC();
@@ -198,40 +463,40 @@ namespace
         if(data.PeekC() == '+')
         {
             do {
-                tok += data.GetC(); // defines global
+                data.GetC(); // defines global
             } while(data.PeekC() == '+');
             goto GotLabel;
         }
         else if(data.PeekC() == '-')
         {
             do {
-                tok += data.GetC();
+                data.GetC();
             } while(data.PeekC() == '-');
             goto GotLabel;
         }
         else
         {
-            while(data.PeekC() == '&') tok += data.GetC();
+            while(data.PeekC() == '&') data.GetC();
         }
 
         if(data.PeekC() == '*')
         {
-            tok += data.GetC();
+            data.GetC();
             goto GotLabel;
         }
 
         // Label may not begin with ., but instruction may
-        if(tok.empty() && data.PeekC() == '.')
-            tok += data.GetC();
+        if(data.SaveState() == tokstart && data.PeekC() == '.')
+            data.GetC();
 
         for(bool first=true;; first=false)
         {
             char c = data.PeekC();
             if(isalpha(c) || c == '_'
             || (!first && isdigit(c))
-            || (tok[0]=='.' && ispunct(c))
+            || (data.SaveState() != tokstart && first_char=='.' && ispunct(c))
               )
-                tok += data.GetC();
+                data.GetC();
             else
             {
                 break;
@@ -239,32 +504,35 @@ namespace
         }
 
 GotLabel:
+        const std::string_view tok = data.GetText(tokstart, data.SaveState());
         data.SkipSpace();
         if(!tok.empty() && tok[0] == '+') // It's a next-branch-label
         {
             unsigned length = tok.size();
-            result.DefineLabel(NextBranchLabel[length]);
-            CreateNewNextBranch(length);
+            Perform(result, Statement::BranchLabel, result.GetNextBranchLabel(length));
+            result.CreateNewNextBranch(length);
             goto MoreLabels;
         }
         if(!tok.empty() && tok[0] == '-') // It's a prev-branch-label
         {
             unsigned length = tok.size();
-            CreateNewPrevBranch(length);
-            result.DefineLabel(PrevBranchLabel[length]);
+            result.CreateNewPrevBranch(length);
+            Perform(result, Statement::BranchLabel, result.GetPrevBranchLabel(length));
             goto MoreLabels;
         }
 
         data.SkipSpace();
 
-        std::vector<OpcodeChoice> choices;
+        ChoiceList choices;
+        OperandParser operand(data, result);
 
-        const struct ins *insdata = std::lower_bound(ins, ins+InsCount, tok);
-        if(insdata == ins+InsCount || tok != insdata->token)
+        const Mnemonic *insdata = FindMnemonic(tok.data(), tok.size());
+        if(!insdata || insdata->type != Mnemonic::Instruction)
         {
             /* Other mnemonic */
+            const Mnemonic::Type type = insdata ? insdata->type : Mnemonic::Instruction;
 
-            if(tok == ".byt")
+            if(type == Mnemonic::Byt)
             {
                 OpcodeChoice choice;
                 bool first=true, ok=true;
@@ -300,7 +568,7 @@ GotLabel:
                     }
 
                     ins_parameter p;
-                    if(!ParseExpression(data, p) || !p.is_byte(result))
+                    if(!ParseExpression(data, p, result) || !p.is_byte(result))
                     {
                         /* FIXME: syntax error */
                         ok = false;
@@ -314,7 +582,7 @@ GotLabel:
                     choices.emplace_back(std::move(choice));
                 }
             }
-            else if(tok == ".word")
+            else if(type == Mnemonic::Word)
             {
                 OpcodeChoice choice;
                 bool first=true, ok=true;
@@ -331,7 +599,7 @@ GotLabel:
                     }
 
                     ins_parameter p;
-                    if(!ParseExpression(data, p) || p.is_word(result).is_false())
+                    if(!ParseExpression(data, p, result) || p.is_word(result).is_false())
                     {
                         /* FIXME: syntax error */
                         std::fprintf(stderr, "Syntax error at '%s'\n",
@@ -347,7 +615,7 @@ GotLabel:
                     choices.emplace_back(std::move(choice));
                 }
             }
-            else if(tok == ".long")
+            else if(type == Mnemonic::Long)
             {
                 OpcodeChoice choice;
                 bool first=true, ok=true;
@@ -364,7 +632,7 @@ GotLabel:
                     }
 
                     ins_parameter p;
-                    if(!ParseExpression(data, p) || p.is_long(result).is_false())
+                    if(!ParseExpression(data, p, result) || p.is_long(result).is_false())
                     {
                         /* FIXME: syntax error */
                         std::fprintf(stderr, "Syntax error at '%s'\n",
@@ -391,15 +659,22 @@ GotLabel:
                     data.GetC(); data.SkipSpace();
 
                     ins_parameter p;
-                    if(!ParseExpression(data, p))
+                    if(!ParseExpression(data, p, result))
                     {
                         fprintf(stderr, "Expected expression: %s\n", data.GetRest().c_str());
                     }
 
+                    unsigned scopenum = 0;
+                    const SymbolId label = tok == "*" ? 0 : result.LabelScope(tok, scopenum);
+
+                    if(tok == "*" ? Record(result, Statement::SetPos)
+                                  : Record(result, Statement::LabelValue, label, scopenum))
+                        RecordParam(result, 0, p);
+
                     unsigned value = ParseConst(p, result);
                     //fprintf(stderr, "Label '%s' defined as %u\n", tok.c_str(), value);
 
-                    p.exp.reset();
+                    p.exp.clear();
 
                     if(tok == "*") // Handles '*='
                     {
@@ -407,7 +682,7 @@ GotLabel:
                     }
                     else
                     {
-                        result.DefineLabel(tok, value);
+                        result.DefineLabel(scopenum, label, value);
                     }
                 }
                 else
@@ -418,16 +693,20 @@ GotLabel:
                             "Cannot define label '*'. Perhaps you meant '*= <value>'?\n"
                                     );
                     }
-                    result.DefineLabel(tok);
+                    unsigned scopenum;
+                    const SymbolId label = result.LabelScope(tok, scopenum);
+
+                    Record(result, Statement::Label, label, scopenum);
+                    result.DefineLabel(scopenum, label, result.GetPos());
                 }
                 goto MoreLabels;
             }
             else if(!data.EOF())
             {
                 std::fprintf(stderr,
-                    "Error: What is '%s' - previous token: '%s'?\n",
+                    "Error: What is '%s' - previous token: '%.*s'?\n",
                         data.GetRest().c_str(),
-                        tok.c_str());
+                        (int)tok.size(), tok.data());
             }
         }
         else
@@ -435,41 +714,43 @@ GotLabel:
             /* Found mnemonic */
 
             bool something_ok = false;
-            for(unsigned addrmode=0; insdata->opcodes[addrmode*3]; ++addrmode)
+            for(unsigned addrmode=0; addrmode < insdata->nmodes; ++addrmode)
             {
-                const std::string op(insdata->opcodes+addrmode*3, 2);
-                if(op != "--")
+                const Opcode op = insdata->modes[addrmode];
+                if(op.kind != Opcode::None)
                 {
-                    ins_parameter p1, p2;
+                    ins_parameter *pp1 = nullptr, *pp2 = nullptr;
 
                     const ParseData::StateType state = data.SaveState();
 
-                    tristate valid = ParseAddrMode(data, addrmode, p1, p2, result);
+                    tristate valid = operand.Match(addrmode, pp1, pp2);
                     if(!valid.is_false())
                     {
+                        ins_parameter& p1 = *pp1;
+
                         something_ok = true;
 
-                        if(op == "sb") result.StartScope();
-                        else if(op == "eb") result.EndScope();
-                        else if(op == "gt") result.SelectTEXT();
-                        else if(op == "gd") result.SelectDATA();
-                        else if(op == "gz") result.SelectZERO();
-                        else if(op == "gb") result.SelectBSS();
-                        else if(op == "li")
+                        if(op.kind == Opcode::StartBlock) Perform(result, Statement::StartScope);
+                        else if(op.kind == Opcode::EndBlock) Perform(result, Statement::EndScope);
+                        else if(op.kind == Opcode::SelectTEXT) Perform(result, Statement::SelectTEXT);
+                        else if(op.kind == Opcode::SelectDATA) Perform(result, Statement::SelectDATA);
+                        else if(op.kind == Opcode::SelectZERO) Perform(result, Statement::SelectZERO);
+                        else if(op.kind == Opcode::SelectBSS) Perform(result, Statement::SelectBSS);
+                        else if(op.kind == Opcode::Link)
                         {
                             assert(addrmode == 12 || addrmode == 13);
                             if(addrmode == 12) // .link group 1
                             {
-                                result.SetLinkageGroup(ParseConst(p1, result));
-                                p1.exp.reset();
+                                Perform(result, Statement::LinkGroup, 0, ParseConst(p1, result));
+                                p1.exp.clear();
                             }
                             else // .link page $FF
                             {
-                                result.SetLinkagePage(ParseConst(p1, result));
-                                p1.exp.reset();
+                                Perform(result, Statement::LinkPage, 0, ParseConst(p1, result));
+                                p1.exp.clear();
                             }
                         }
-                        else if(op == "np")
+                        else if(op.kind == Opcode::Nop)
                         {
                             assert(addrmode == 14);
 
@@ -479,17 +760,15 @@ GotLabel:
 
                             if(imm16 > 3)
                             {
-                                std::string NopLabel = CreateNopLabel();
-                                result.DefineLabel(NopLabel, result.GetPos()+imm16);
+                                SymbolId NopLabel = result.CreateNopLabel();
+                                Perform(result, Statement::NopLabel, NopLabel, imm16);
 
                                 // jmp
                                 choice.parameters.emplace_back(1, 0x4C); // JMP
 
-                                expression* e = new expr_label(NopLabel);
-                                std::unique_ptr<expression> tmp(e);
-
                                 p1.prefix = FORCE_ABSWORD;
-                                p1.exp.swap(tmp);
+                                p1.exp.clear();
+                                p1.exp.PushLabel(NopLabel);
                                 choice.parameters.emplace_back(2, std::move(p1));
 
                                 imm16 -= 3;
@@ -504,46 +783,46 @@ GotLabel:
                         }
                         else
                         {
-                            // Opcode in hex.
-                            unsigned char opcode = std::strtol(op.c_str(), NULL, 16);
+                            unsigned char opcode = op.byte;
 
                             OpcodeChoice choice;
                             unsigned op1size = GetOperand1Size(addrmode);
                             unsigned op2size = GetOperand2Size(addrmode);
 
-                            if(AddrModes[addrmode].p1 == AddrMode::tRel8) p1.prefix = FORCE_REL8;
+                            choice.is_rel8 = AddrModes[addrmode].p1 == AddrMode::tRel8;
 
+                            // The operands are shared by the choices; only the one
+                            // that is taken gets them.
                             choice.parameters.emplace_back(1, opcode);
-                            if(op1size) choice.parameters.emplace_back(op1size, std::move(p1));
-                            if(op2size) choice.parameters.emplace_back(op2size, std::move(p2));
+                            if(op1size) { choice.parameters.emplace_back(op1size, ins_parameter()); choice.operands[0] = pp1; }
+                            if(op2size) { choice.parameters.emplace_back(op2size, ins_parameter()); choice.operands[1] = pp2; }
 
                             choice.is_certain = valid.is_true();
                             choices.emplace_back(std::move(choice));
                         }
 #if SHOW_POSSIBLES
-                        std::fprintf(stderr, "- %s mode %u (%s) (%u bytes)\n",
+                        std::fprintf(stderr, "- %s mode %u (%02X) (%u bytes)\n",
                             valid.is_true() ? "Is" : "Could be",
-                            addrmode, op.c_str(),
+                            addrmode, op.byte,
                             GetOperandSize(addrmode)
                                     );
-                        if(p1.exp)
+                        if(!p1.exp.empty())
                             std::fprintf(stderr, "  - p1=\"%s\"\n", p1.Dump().c_str());
-                        if(p2.exp)
-                            std::fprintf(stderr, "  - p2=\"%s\"\n", p2.Dump().c_str());
+                        if(!pp2->exp.empty())
+                            std::fprintf(stderr, "  - p2=\"%s\"\n", pp2->Dump().c_str());
 #endif
                     }
 
                     data.LoadState(state);
                 }
-                if(!insdata->opcodes[addrmode*3+2]) break;
             }
 
             if(!something_ok)
             {
                 std::fprintf(stderr,
-                    "Error: '%s' is invalid parameter for '%s' in current context (%u choices).\n",
+                    "Error: '%s' is invalid parameter for '%.*s' in current context (%u choices).\n",
                         data.GetRest().c_str(),
-                        tok.c_str(),
+                        (int)tok.size(), tok.data(),
                         (unsigned) choices.size());
                 return;
             }
@@ -574,6 +853,7 @@ GotLabel:
                 }
             }
         }
+        const bool certain = found;
         if(!found)
         {
             /* If there were no certain choices, try to pick one of the uncertain ones. */
@@ -603,153 +883,26 @@ GotLabel:
 
         OpcodeChoice& c = choices[smallestnum];
 
-        if(result.ShouldFlipHere())
-        {
-            //std::fprintf(stderr, "Flipping...\n");
-            c.FlipREL8();
-        }
+        unsigned zpparam = 0, zpopcode = 0;
+        if(!certain && result.GetFixZeroPage())
+            FindZeroPageChoice(choices, c, zpparam, zpopcode);
 
-#if SHOW_CHOICES
-        std::fprintf(stderr, "Choice %u:", smallestnum);
-#endif
-        for(unsigned b=0; b<c.parameters.size(); ++b)
-        {
-            long value = 0;
-            std::string ref;
-
-            unsigned size              = c.parameters[b].first;
-            const ins_parameter& param = c.parameters[b].second;
+        c.TakeOperands();
 
-            const auto& e = param.exp;
-
-            if(e->IsConst())
-            {
-                value = e->GetConst();
-            }
-            else if(const expr_label* l = dynamic_cast<const expr_label*> (e.get()))
-            {
-                ref = l->GetName();
-            }
-            else if(const sum_group* s = dynamic_cast<const sum_group*> (e.get()))
-            {
-                /* constant should always be last in a sum group. */
-
-                /* sum_group always has at least 2 elements.
-                 * If it has 0, it's converted to expr_number.
-                 * if it has 1, it's converter into the element itself (or expr_negate).
-                 */
-
-                auto first = s->contents.begin(), last = std::prev(s->contents.end());
-
-                std::string label;
-                const char *error = NULL;
-                if(s->contents.size() != 2)
-                {
-                    error = "must have 2 elements";
-                }
-                else if(!last->first->IsConst()) // If 2nd isn't const
-                {
-                    error = "2nd elem isn't const";
-                }
-                else if(first->second)          // If 1st isn't positive
-                {
-                    error = "1st elem must not be negative";
-                }
-                else if(const expr_label* lbl = dynamic_cast<const expr_label *> (first->first.get()))
-                {
-                    label = lbl->GetName();
-                }
-                else
-                {
-                    error = "1st elem must be a label";
-                }
-                if(error)
-                {
-                    /* Invalid pointer arithmetic */
-                    std::fprintf(stderr, "Invalid pointer arithmetic (%s): '%s'\n",
-                        error,
-                        e->Dump().c_str());
-                    continue;
-                }
-
-                ref   = std::move(label);
-                value = last->first->GetConst();
-            }
-            else
-            {
-                fprintf(stderr, "Invalid parameter (not a label/const/label+const): '%s'\n",
-                    e->Dump().c_str());
-                continue;
-            }
-
-            char prefix = param.prefix;
-            /*if(!ref.empty() && !prefix)
-            {
-                // If the symbol is known and resides in .zero segment,
-                // force the LOBYTE prefix.
-                SegmentSelection seg;
-                unsigned dummyvalue=0;
-                std::fprintf(stderr, "Checking if %u-byte reference to '%s' is in ZERO...\n", size, ref.c_str());
-                if(result.FindLabel(ref, seg, dummyvalue) && seg == ZERO && value+dummyvalue < 256)
-                {
-                    std::fprintf(stderr, "Reference to %s (%u) coded as lobyte\n", ref.c_str(), dummyvalue);
-                    prefix = FORCE_LOBYTE;
-                }
-            }*/
-
-            if(!prefix)
-            {
-                // Pick a prefix that represents what we're actually doing here
-                switch(size)
-                {
-                    case 1: prefix = FORCE_LOBYTE; break;
-                    case 2: prefix = FORCE_ABSWORD; break;
-                    case 3: prefix = FORCE_LONG; break;
-                    default:
-                        std::fprintf(stderr, "Internal error - unknown size: %u\n", size);
-                }
-            }
-
-            if(!ref.empty())
-            {
-                result.AddExtern(prefix, ref, value);
-                value = 0;
-            }
-            else if(prefix == FORCE_REL8)
-            {
-                std::fprintf(stderr, "Error: Relative target must not be a constant\n");
-                // FIXME: It isn't so bad...
-            }
+        if(Record(result, Statement::Code))
+        {
+            for(unsigned b=0; b<c.parameters.size(); ++b)
+                RecordParam(result, c.parameters[b].first, c.parameters[b].second);
 
-            switch(prefix)
-            {
-                case FORCE_SEGBYTE:
-                    result.GenerateByte((value >>16) & 0xFF);
-                    break;
-                case FORCE_LONG:
-                    result.GenerateByte((value >> 0) & 0xFF);
-                    result.GenerateByte((value >> 8) & 0xFF);
-                    result.GenerateByte((value >>16) & 0xFF);
-                    break;
-                case FORCE_ABSWORD:
-                    result.GenerateByte((value >> 0) & 0xFF);
-                    result.GenerateByte((value >> 8) & 0xFF);
-                    break;
-                case FORCE_HIBYTE:
-                    result.GenerateByte((value >> 8) & 0xFF);
-                    break;
-                case FORCE_LOBYTE:
-                    result.GenerateByte((value >> 0) & 0xFF);
-                    break;
-                case FORCE_REL8:
-                    result.GenerateByte(0x00);
-                    break;
-            }
+            Statement& s = result.GetListing().statements.back();
+            s.zpparam  = zpparam;
+            s.zpopcode = zpopcode;
+        }
 
 #if SHOW_CHOICES
-            std::fprintf(stderr, " %s(%u)", param.Dump().c_str(), size);
+        std::fprintf(stderr, "Choice %u:", smallestnum);
 #endif
-        }
+        EmitCode(c, result);
 #if SHOW_CHOICES
         if(c.is_certain)
             std::fprintf(stderr, " (certain)");
@@ -759,12 +912,12 @@ GotLabel:
         // *FIXME* choices not properly deallocated
     }
 
-    void ParseLine(Object& result, const std::string& s)
+    void ParseLine(Object& result, std::string_view s)
     {
         // Break into statements, assemble each by each
-        for(unsigned a=0; a<s.size(); )
+        for(std::size_t a=0; a<s.size(); )
         {
-            unsigned b=a;
+            std::size_t b=a;
             bool quote = false;
             while(b < s.size())
             {
@@ -776,9 +929,9 @@ GotLabel:
 
             if(b > a)
             {
-                const std::string tmp = s.substr(a, b-a);
-                //std::fprintf(stderr, "Parsing '%s'\n", tmp.c_str());
-                ParseData data(tmp);
+                //std::fprintf(stderr, "Parsing '%.*s'\n", (int)(b-a), s.data()+a);
+                ParseData data(s.substr(a, b-a));
+                Arena::Scope scope(StatementArena);
                 ParseIns(data, result);
             }
             a = b+1;
@@ -786,18 +939,32 @@ GotLabel:
     }
 }
 
-const std::string& GetPrevBranchLabel(unsigned length)
+void BeginAssembly(Object& obj)
 {
-    std::string& l = PrevBranchLabel[length];
-    if(l.empty()) CreateNewPrevBranch(length);
-    return l;
+    Perform(obj, Statement::StartScope);
+    Perform(obj, Statement::SelectTEXT);
 }
 
-const std::string& GetNextBranchLabel(unsigned length)
+void EndAssembly(Object& obj)
 {
-    std::string& l = NextBranchLabel[length];
-    if(l.empty()) CreateNewNextBranch(length);
-    return l;
+    Perform(obj, Statement::EndScope);
+    if(obj.KeepsListing())
+        for(SymbolId label: obj.GetBranchLabels())
+            Record(obj, Statement::UndefineLabel, label);
+    obj.UndefineBranchLabels();
+}
+
+void AssembleLines(std::string_view text, Object& obj)
+{
+    for(std::size_t a = 0; a < text.size(); )
+    {
+        std::size_t b = text.find('\n', a);
+        if(b == text.npos) b = text.size();
+
+        if(text[a] != '#') // Probably something generated by gcc
+            ParseLine(obj, text.substr(a, b-a));
+        a = b+1;
+    }
 }
 
 void AssemblePrecompiled(std::FILE *fp, Object& obj)
@@ -807,30 +974,54 @@ void AssemblePrecompiled(std::FILE *fp, Object& obj)
         return;
     }
 
-    obj.StartScope();
-    obj.SelectTEXT();
+    const MappedFile text(fp);
+    AssemblePrecompiled(text.View(), obj);
+}
 
-    for(;;)
+void AssemblePrecompiled(std::string_view text, Object& obj)
+{
+    BeginAssembly(obj);
+    AssembleLines(text, obj);
+    EndAssembly(obj);
+}
+
+bool Reassemble(Object& obj)
+{
+    Listing& listing = obj.GetListing();
+
+    bool changed = false;
+    for(Statement& s: listing.statements)
     {
-        char Buf[65536];
-        if(!std::fgets(Buf, sizeof Buf, fp)) break;
+        if(s.kind != Statement::Code) continue;
 
-        if(Buf[0] == '#')
+        if(!s.flipped && obj.ShouldFlip(s.seg, s.pos))
+            s.flipped = changed = true;
+
+        if(s.zpparam)
         {
-            // Probably something generated by gcc
-            continue;
+            Listing::Param* params = &listing.params[s.begin];
+
+            unsigned offset = 0;
+            for(unsigned a=0; a<s.zpparam; ++a)
+                offset += params[a].size;
+
+            if(obj.IsZeroPage(s.seg, s.pos + offset))
+            {
+                listing.nodes[params[0].begin].value = s.zpopcode;
+                params[s.zpparam].size = 1;
+                s.zpparam = 0;
+                changed = true;
+            }
         }
-        ParseLine(obj, Buf);
     }
+    if(!changed) return false;
 
-    obj.EndScope();
-
-    for(std::list<std::string>::const_iterator
-        i = DefinedBranchLabels.begin();
-        i != DefinedBranchLabels.end();
-        ++i)
+    obj.ClearMost();
+    obj.SetReprocessed(true);
+    for(Statement& s: listing.statements)
     {
-        obj.UndefineLabel(*i);
+        Arena::Scope scope(StatementArena);
+        Execute(s, obj);
     }
-    DefinedBranchLabels.clear();
+    return true;
 }
@@ -3,6 +3,7 @@
 
 #include "object.hh"
 #include <string>
+#include <string_view>
 
 namespace
 {
@@ -29,9 +30,21 @@ namespace
     };
 }
 
-const std::string& GetPrevBranchLabel(unsigned length); // What "-" means for each length of "-"
-const std::string& GetNextBranchLabel(unsigned length); // What "+" means for each length of "+"
-
 void AssemblePrecompiled(std::FILE *fp, Object& obj);
+void AssemblePrecompiled(std::string_view text, Object& obj);
+
+/* For assembling text that arrives in pieces.
+ * Each piece must end at a line boundary.
+ */
+void BeginAssembly(Object& obj);
+void AssembleLines(std::string_view text, Object& obj);
+void EndAssembly(Object& obj);
+
+/* After the segments have been closed: makes long the short jumps
+ * that were found out of range (--jumps) and makes short the operands
+ * that were found to be in zero page (--zeropage), and assembles the
+ * listing again. Returns false if nothing changed.
+ */
+bool Reassemble(Object& obj);
 
 #endif
@@ -0,0 +1,32 @@
+#ifndef bqt65asmByteSpanHH
+#define bqt65asmByteSpanHH
+
+#include <vector>
+#include <cstddef>
+
+/* Bytes that are stored somewhere else, such as in a segment.
+ * The span stays valid only as long as the storage is not modified.
+ * To keep the bytes, copy them into a vector.
+ */
+class ByteSpan
+{
+public:
+    ByteSpan(): ptr(nullptr), len(0) { }
+    ByteSpan(const unsigned char* p, std::size_t n): ptr(p), len(n) { }
+    ByteSpan(const std::vector<unsigned char>& v): ptr(v.data()), len(v.size()) { }
+
+    const unsigned char* data() const { return ptr; }
+    std::size_t size() const { return len; }
+    bool empty() const { return !len; }
+
+    const unsigned char* begin() const { return ptr; }
+    const unsigned char* end() const { return ptr + len; }
+
+    unsigned char operator[] (std::size_t n) const { return ptr[n]; }
+
+private:
+    const unsigned char* ptr;
+    std::size_t len;
+};
+
+#endif
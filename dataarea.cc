@@ -1,245 +1,279 @@
+#include <cstring>
+#include <bitset>
+#include <algorithm>
+#ifdef __AVX2__
+# include <immintrin.h>
+#endif
+
 #include "dataarea.hh"
 
 namespace
 {
-    static const unsigned char Empty = 0;
-}
+    // The bits from "begin" to "end" (at most 64)
+    std::uint64_t BitRange(unsigned begin, unsigned end)
+    {
+        std::uint64_t bits = ~std::uint64_t(0) << begin;
+        if(end < 64) bits &= ~(~std::uint64_t(0) << end);
+        return bits;
+    }
 
-void DataArea::PrepareVec(vec& v, unsigned offset)
-{
-    if(offset >= v.size())
+    unsigned LowestBit(std::uint64_t bits)
+    {
+#ifdef __GNUC__
+        return __builtin_ctzll(bits);
+#else
+        unsigned n = 0;
+        while(!(bits & 1)) { bits >>= 1; ++n; }
+        return n;
+#endif
+    }
+
+    unsigned CountBits(std::uint64_t bits)
+    {
+#ifdef __GNUC__
+        return __builtin_popcountll(bits);
+#else
+        return std::bitset<64>(bits).count();
+#endif
+    }
+
+    // The number of set bits in "n" words
+    unsigned CountWords(const std::uint64_t* words, unsigned n)
     {
-        unsigned newsize = offset+1;
-        if(v.capacity() < newsize)
+        unsigned result = 0, w = 0;
+#ifdef __AVX2__
+        // Count the nibbles of 32 bytes at a time by table lookup
+        const __m256i table = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                               0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+        const __m256i nibble = _mm256_set1_epi8(0x0F), zero = _mm256_setzero_si256();
+        __m256i sums = zero;
+        for(; w+4 <= n; w += 4)
         {
-            const unsigned step = 2048;
-            unsigned newcapacity = (newsize + step) &~ (step-1);
-            v.reserve(newcapacity);
+            __m256i v  = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + w));
+            __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, nibble));
+            __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+            sums = _mm256_add_epi64(sums, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), zero));
         }
-        v.resize(newsize);
+        alignas(32) std::uint64_t lanes[4];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), sums);
+        result = unsigned(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+#endif
+        for(; w < n; ++w) result += CountBits(words[w]);
+        return result;
     }
-}
 
-DataArea::map::iterator DataArea::GetRef(unsigned offset)
-{
-    map::iterator i = blobs.upper_bound(offset);
-    if(i == blobs.begin()) i = blobs.end(); else --i;
+    // The index of the first of "n" words that isn't "skip", or n
+    unsigned FindWord(const std::uint64_t* words, unsigned n, std::uint64_t skip)
+    {
+        unsigned w = 0;
+#ifdef __AVX2__
+        const __m256i s = _mm256_set1_epi64x((long long)skip);
+        for(; w+4 <= n; w += 4)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + w));
+            if(_mm256_movemask_epi8(_mm256_cmpeq_epi64(v, s)) != -1) break;
+        }
+#endif
+        while(w < n && words[w] == skip) ++w;
+        return w;
+    }
 
-    if(i != blobs.end())
+    // The number of set bits from "begin" to "end" in a page's bitmap
+    unsigned CountRange(const std::uint64_t* used, unsigned begin, unsigned end)
     {
-        unsigned prev_top = i->first + i->second.size();
-        if(prev_top >= offset)
+        if(begin >= end) return 0;
+        const unsigned first = begin / 64, last = (end-1) / 64;
+        if(first == last)
+            return CountBits(used[first] & BitRange(begin % 64, end - first*64));
+        return CountBits(used[first] & BitRange(begin % 64, 64))
+             + CountWords(used + first + 1, last - first - 1)
+             + CountBits(used[last] & BitRange(0, end - last*64));
+    }
+
+    // The first bit from "begin" on in a page's bitmap that
+    // is set (or clear, if !set), or PageSize if there is none
+    unsigned FindBit(const std::uint64_t* used, unsigned words, unsigned begin, bool set)
+    {
+        const std::uint64_t flip = set ? 0 : ~std::uint64_t(0);
+
+        unsigned word = begin / 64;
+        std::uint64_t bits = (used[word] ^ flip) & BitRange(begin % 64, 64);
+        if(!bits)
         {
-            return i;
+            word += 1 + FindWord(used + word + 1, words - word - 1, flip);
+            if(word == words) return words * 64;
+            bits = used[word] ^ flip;
         }
+        return word*64 + LowestBit(bits);
     }
+}
 
-    return blobs.insert(std::make_pair(offset, vec())).first;
+const unsigned char DataArea::EmptyPage[DataArea::PageSize] = { };
+
+DataArea::DataArea(const DataArea& b)
+    : pages(b.pages), base(b.base), top(b.top), lastnum(0), last(nullptr)
+{
 }
 
-void DataArea::WriteByte(unsigned pos, unsigned char byte)
+DataArea& DataArea::operator= (const DataArea& b)
 {
-/*
-    fprintf(stderr, "GetRef($%X,$%02X) ", pos,byte);
-*/
-    map::iterator i = GetRef(pos);
-    vec& vector   = i->second;
-    unsigned base = i->first;
-/*
-    fprintf(stderr, "-> %u bytes at $%X\n", vector.size(), base);
-*/
-    unsigned vecpos = pos - base;
-    PrepareVec(vector, vecpos);
-    vector[vecpos] = byte;
-
-    Optimize(i);
+    pages = b.pages;
+    base  = b.base;
+    top   = b.top;
+    last  = nullptr;
+    return *this;
 }
 
-void DataArea::WriteLump(unsigned pos, const std::vector<unsigned char>& lump)
+DataArea::Page& DataArea::GetPage(unsigned num)
 {
-    if(lump.empty()) return;
+    if(last && lastnum == num) return *last;
 
-    /* This is slow! Please invent a better algorithm some day. */
-    for(unsigned a=0; a<lump.size(); ++a)
-        WriteByte(pos+a, lump[a]);
+    // A new page is zero-initialized
+    last    = &pages[num];
+    lastnum = num;
+    return *last;
 }
 
-unsigned char DataArea::GetByte(unsigned pos) const
+void DataArea::Extend(unsigned begin, unsigned end)
+{
+    if(base == top)
+    {
+        base = begin;
+        top  = end;
+        return;
+    }
+    if(begin < base) base = begin;
+    if(end > top) top = end;
+}
+
+void DataArea::WriteByte(unsigned pos, unsigned char byte)
 {
-    map::const_iterator i = blobs.upper_bound(pos);
-    if(i == blobs.begin()) i = blobs.end(); else --i;
+    Page& page = GetPage(pos >> PageBits);
+    const unsigned offs = pos & (PageSize-1);
 
-    if(i != blobs.end())
+    page.bytes[offs] = byte;
+    page.used[offs / 64] |= std::uint64_t(1) << (offs % 64);
+
+    Extend(pos, pos+1);
+}
+
+void DataArea::WriteLump(unsigned pos, ByteSpan lump)
+{
+    if(lump.empty()) return;
+
+    for(unsigned done = 0; done < lump.size(); )
     {
-        unsigned prev_top = i->first + i->second.size();
-        if(prev_top > pos)
+        const unsigned at    = pos + done;
+        const unsigned offs  = at & (PageSize-1);
+        const unsigned count = std::min<std::size_t>(PageSize - offs, lump.size() - done);
+
+        Page& page = GetPage(at >> PageBits);
+        std::memcpy(page.bytes + offs, lump.data() + done, count);
+
+        for(unsigned a = offs; a < offs+count; )
         {
-            unsigned base = i->first;
-            return i->second[pos - base];
+            const unsigned word = a / 64, end = std::min(offs+count, (word+1) * 64);
+            page.used[word] |= BitRange(a % 64, end - word*64);
+            a = end;
         }
+        done += count;
     }
-    /* Nothing found. */
-    return Empty;
-}
 
-unsigned DataArea::GetBase() const
-{
-    map::const_iterator i = blobs.begin();
-    if(i == blobs.end()) return 0;
-    return i->first;
+    Extend(pos, pos + lump.size());
 }
 
-unsigned DataArea::GetTop() const
+unsigned char DataArea::GetByte(unsigned pos) const
 {
-    map::const_iterator i = blobs.end();
-    if(i == blobs.begin()) return 0;
-    --i;
-    return i->first + i->second.size();
+    PageMap::const_iterator i = pages.find(pos >> PageBits);
+    if(i == pages.end()) return 0;
+    return i->second.bytes[pos & (PageSize-1)];
 }
 
-const std::vector<unsigned char> DataArea::GetContent() const
+unsigned DataArea::NextUsed(unsigned pos) const
 {
-    std::vector<unsigned char> result(GetSize(), Empty);
-    const unsigned base = GetBase();
-    for(map::const_iterator i = blobs.begin(); i != blobs.end(); ++i)
+    unsigned offs = pos & (PageSize-1);
+    for(PageMap::const_iterator
+        i = pages.lower_bound(pos >> PageBits); i != pages.end(); ++i)
     {
-        unsigned pos = i->first - base;
-        std::copy(i->second.begin(), i->second.end(), result.begin()+pos);
+        if(i->first != pos >> PageBits) offs = 0;
+
+        const unsigned bit = FindBit(i->second.used, PageWords, offs, true);
+        if(bit < PageSize) return (i->first << PageBits) + bit;
     }
-    return result;
+    return top;
 }
 
-const std::vector<unsigned char> DataArea::GetContent(unsigned begin, unsigned size) const
+unsigned DataArea::NextUnused(unsigned pos) const
 {
-    std::vector<unsigned char> result(size, Empty);
-
-    for(map::const_iterator i = blobs.begin(); i != blobs.end(); ++i)
+    for(;;)
     {
-        /* Source */
-        unsigned begin_offset = i->first;
-        /* Size of block */
-        unsigned count  = i->second.size();
-        /* Where would this go to in the target */
-        unsigned target = begin_offset - begin;
-
-/*
-        fprintf(stderr, "Blob at $%X is %u bytes\n", i->first, i->second.size());
-*/
-
-        /* If we don't want the first bytes of this block */
-        if(begin > begin_offset)
-        {
-            /* Skip some bytes from the beginning of this block. */
-            unsigned decrease = begin - begin_offset;
-            /* If the length of skip is bigger than this block, there's nothing to do */
-            if(decrease >= count) continue;
-            /* Less bytes left */
-            count -= decrease;
-            /* Offset is now even */
-            begin_offset = begin;
-            /* Target is now even */
-            target = 0;
-        }
-        /* If this goes past what we want, do nothing */
-        if(target >= size)
-        {
-            continue;
-        }
+        PageMap::const_iterator i = pages.find(pos >> PageBits);
+        if(i == pages.end()) return pos;
 
-        /* Ensure we don't copy too much */
-        if(count > size-target)
-        {
-            count = size-target;
-        }
+        const unsigned bit = FindBit(i->second.used, PageWords, pos & (PageSize-1), false);
+        if(bit < PageSize) return (i->first << PageBits) + bit;
 
-        unsigned pos = begin_offset - i->first;
+        // The rest of the page is written; continue on the next one.
+        pos = (i->first + 1) << PageBits;
+        if(!pos) return pos;
+    }
+}
 
-/*
-        fprintf(stderr,
-            "GetContent($%X,%u): Copying %u bytes from %u (base $%X) to %u (base $%X)\n",
-                begin,size,
-                count,
-                pos, i->first,
-                target, begin);
-*/
+const std::vector<unsigned char> DataArea::GetContent() const
+{
+    return GetContent(GetBase(), GetSize());
+}
 
-        std::copy(i->second.begin() + pos,
-                  i->second.begin() + pos + count,
-                  result.begin() + target);
-    }
+const std::vector<unsigned char> DataArea::GetContent(unsigned begin, unsigned size) const
+{
+    std::vector<unsigned char> result;
+    result.reserve(size);
+    VisitContent(begin, size, [&](unsigned, ByteSpan view)
+    {
+        result.insert(result.end(), view.begin(), view.end());
+    });
     return result;
 }
 
+ByteSpan DataArea::GetView(unsigned begin, unsigned size) const
+{
+    const unsigned offs  = begin & (PageSize-1);
+    const unsigned count = std::min(size, PageSize - offs);
+
+    PageMap::const_iterator i = pages.find(begin >> PageBits);
+    if(i == pages.end()) return ByteSpan(EmptyPage + offs, count);
+    return ByteSpan(i->second.bytes + offs, count);
+}
+
 unsigned DataArea::FindNextBlob(unsigned where, unsigned& length) const
 {
-    map::const_iterator i = blobs.lower_bound(where);
-    if(i == blobs.end()) { length = 0; return 0; }
-    length = i->second.size();
-    return i->first;
+    // If "where" is within a blob that began earlier, skip that one.
+    unsigned pos = where;
+    if(pos > 0 && GetUtilization(pos-1, 1))
+        pos = NextUnused(pos);
+
+    if(pages.empty() || pos >= top) { length = 0; return 0; }
+
+    pos    = NextUsed(pos);
+    length = NextUnused(pos) - pos;
+    return pos;
 }
 
 unsigned DataArea::GetUtilization(unsigned begin, unsigned size) const
 {
     unsigned result = 0;
 
-    /* Algorithm copied from GetContent(..., ...) */
-
-    for(map::const_iterator i = blobs.begin(); i != blobs.end(); ++i)
+    const std::uint64_t end = std::uint64_t(begin) + size;
+    for(PageMap::const_iterator
+        i = pages.lower_bound(begin >> PageBits); i != pages.end(); ++i)
     {
-        /* Source */
-        unsigned begin_offset = i->first;
-        /* Size of block */
-        unsigned count  = i->second.size();
-        /* Where would this go to in the target */
-        unsigned target = begin_offset - begin;
-
-        /* If we don't want the first bytes of this block */
-        if(begin > begin_offset)
-        {
-            /* Skip some bytes from the beginning of this block. */
-            unsigned decrease = begin - begin_offset;
-            /* If the length of skip is bigger than this block, there's nothing to do */
-            if(decrease >= count) continue;
-            /* Less bytes left */
-            count -= decrease;
-            /* Offset is now even */
-            begin_offset = begin;
-            /* Target is now even */
-            target = 0;
-        }
-        /* If this goes past what we want, do nothing */
-        if(target >= size)
-        {
-            continue;
-        }
+        const std::uint64_t pagebegin = std::uint64_t(i->first) << PageBits;
+        if(pagebegin >= end) break;
 
-        /* Ensure we don't copy too much */
-        if(count > size-target)
-        {
-            count = size-target;
-        }
+        const unsigned from = std::max<std::uint64_t>(pagebegin, begin) - pagebegin;
+        const unsigned to   = std::min<std::uint64_t>(pagebegin + PageSize, end) - pagebegin;
 
-        result += count;
+        result += CountRange(i->second.used, from, to);
     }
     return result;
 }
-
-void DataArea::Optimize(map::iterator i)
-{
-    /* This function joins consequent blocks. */
-
-    if(i != blobs.end())
-    {
-        /* Check if the next block follows this block immediately. */
-        map::iterator j = i; ++j;
-        while(j != blobs.end() && j->first == i->first + i->second.size())
-        {
-            i->second.insert(i->second.end(),
-                             j->second.begin(), j->second.end());
-            map::iterator k = j; ++k;
-            blobs.erase(j);
-            j = k;
-            /* Check if the next block follows too */
-        }
-    }
-}
@@ -3,34 +3,81 @@
 
 #include <map>
 #include <vector>
+#include <cstdint>
 
+#include "bytespan.hh"
+
+/* Memory that is written here and there. It is stored in pages,
+ * each of which remembers which of its bytes have been written.
+ * A run of written bytes is a blob.
+ */
 class DataArea
 {
-    typedef std::vector<unsigned char> vec;
-    typedef std::map<unsigned, vec> map;
-    map blobs;
+    static const unsigned PageBits = 12;
+    static const unsigned PageSize = 1u << PageBits;
+    static const unsigned PageWords = PageSize / 64;
+
+    struct Page
+    {
+        unsigned char bytes[PageSize]; // Zero where not written
+        std::uint64_t used[PageWords]; // One bit for each byte
+    };
+    typedef std::map<unsigned, Page> PageMap; // By page number
+    PageMap pages;
+
+    static const unsigned char EmptyPage[PageSize]; // For views of unwritten bytes
+
+    unsigned base, top; // The written bytes are within these
+
+    // The page written last, since writes tend to continue there
+    unsigned lastnum;
+    Page* last;
 private:
-    map::iterator GetRef(unsigned offset);
-    static void PrepareVec(vec&, unsigned offset);
+    Page& GetPage(unsigned num);
+    void Extend(unsigned begin, unsigned end);
 
-    void Optimize(map::iterator i);
+    // First written/unwritten byte from "pos" on
+    unsigned NextUsed(unsigned pos) const;
+    unsigned NextUnused(unsigned pos) const;
 public:
-    DataArea(): blobs() { }
+    DataArea(): pages(), base(0), top(0), lastnum(0), last(nullptr) { }
+    DataArea(const DataArea& b);
+    DataArea& operator= (const DataArea& b);
 
     void WriteByte(unsigned pos, unsigned char byte);
-    void WriteLump(unsigned pos, const std::vector<unsigned char>& lump);
+    void WriteLump(unsigned pos, ByteSpan lump);
 
     unsigned char GetByte(unsigned pos) const;
 
-    unsigned GetBase() const;
-    unsigned GetTop() const;
+    unsigned GetBase() const { return base; }
+    unsigned GetTop() const { return top; }
     unsigned GetSize() const { return GetTop() - GetBase(); }
 
+    /* Returns the first blob that begins at "where" or after it. */
     unsigned FindNextBlob(unsigned where, unsigned& length) const;
 
     /* Returns the number of bytes that actually exist within the given range. */
     unsigned GetUtilization(unsigned begin, unsigned size) const;
 
+    /* Returns the bytes from "begin" on, as many of the "size" bytes
+     * as are stored contiguously (at least one). Unwritten bytes are zero.
+     */
+    ByteSpan GetView(unsigned begin, unsigned size) const;
+
+    /* Calls func(address, span) for consecutive views of the range. */
+    template<typename F>
+    void VisitContent(unsigned begin, unsigned size, F&& func) const
+    {
+        while(size > 0)
+        {
+            ByteSpan view = GetView(begin, size);
+            func(begin, view);
+            begin += view.size();
+            size  -= view.size();
+        }
+    }
+
+    /* These make a copy. */
     const std::vector<unsigned char> GetContent() const;
 
     const std::vector<unsigned char> GetContent(unsigned begin, unsigned size) const;
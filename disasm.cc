@@ -245,12 +245,11 @@ static void LoadO65globals(const O65& o, SegmentSelection seg)
 {
     std::multimap<unsigned, std::string>& glob = Globals[seg];
 
-    std::vector<std::string> syms = o.GetSymbolList(seg);
+    std::vector<SymbolId> syms = o.GetSymbolList(seg);
     for(unsigned a=0; a<syms.size(); ++a)
     {
-        const std::string& name = syms[a];
-        unsigned addr = o.GetSymAddress(seg, name);
-        glob.insert(make_pair(addr, name));
+        unsigned addr = o.GetSymAddress(seg, syms[a]);
+        glob.insert(make_pair(addr, SymbolName(syms[a])));
     }
 }
 static void DumpO65globals(const O65& o, SegmentSelection seg)
@@ -274,7 +273,7 @@ static void O65dumpSeg(const O65& o65, SegmentSelection seg, const char* asmhead
     Relocs.sort();
 
     DumpO65globals(o65, seg);
-    DisAsm(o65.GetBase(seg), &*o65.GetSeg(seg).begin(), o65.GetSegSize(seg), seg);
+    DisAsm(o65.GetBase(seg), o65.GetSeg(seg).data(), o65.GetSegSize(seg), seg);
 }
 
 static int HandleO65()
@@ -282,7 +281,9 @@ static int HandleO65()
     O65 o65;
     o65.Load(stdin);
 
-    RelocVarList = o65.GetExternList();
+    RelocVarList.clear();
+    for(SymbolId ext: o65.GetExternList())
+        RelocVarList.push_back(SymbolName(ext));
     for(unsigned a=0; a<RelocVarList.size(); ++a)
         printf(".extern %s\n", RelocVarList[a].c_str());
 
@@ -1,217 +1,376 @@
+#include <cstdio>
+#include <algorithm>
+
 #include "expr.hh"
 
-void expression::Optimize(std::unique_ptr<expression>& self_ptr)
+namespace
 {
-    if(self_ptr.get() != this) return;
-    if(IsConst() && !dynamic_cast<class expr_number*> (this) )
-    {
-        self_ptr = std::unique_ptr<expression>(new expr_number(GetConst()));
-    }
-}
+    typedef expression::Node Node;
 
-void expr_bitnot::Optimize(std::unique_ptr<expression>& self_ptr)
-{
-    expr_unary::Optimize(self_ptr);
-    if(self_ptr.get() != this) return;
-    if(expr_bitnot* tmp = dynamic_cast<expr_bitnot*> (sub.get()))
+    struct TermRange
     {
-        self_ptr = std::move(tmp->sub);
-    }
-}
+        std::size_t begin, end; // The operand, without its Term node
+        bool negative;
+    };
+    typedef std::vector<TermRange, ArenaAllocator<TermRange> > TermList;
 
-void expr_negate::Optimize(std::unique_ptr<expression>& self_ptr)
-{
-    expr_unary::Optimize(self_ptr);
-    if(self_ptr.get() != this) return;
-    if(sum_group* s = dynamic_cast<sum_group*> (sub.get()))
+    long Arity(const Node& n)
     {
-        s->Negate();
-        self_ptr = std::move(sub);
-        return;
+        switch(n.tag)
+        {
+            case expression::Number:
+            case expression::Label:  return 0;
+            case expression::Negate:
+            case expression::BitNot:
+            case expression::Term:   return 1;
+            case expression::Sum:    return n.value;
+            default:                 return 2;
+        }
     }
-    if(expr_negate* tmp = dynamic_cast<expr_negate*> (sub.get()))
+
+    std::size_t SubBegin(const Node* n, std::size_t last)
     {
-        self_ptr = std::move(tmp->sub);
+        std::size_t i = last+1;
+        long need = 1;
+        do { --i; need += Arity(n[i]) - 1; } while(need > 0);
+        return i;
     }
-}
 
-void SubstituteExprLabel(std::unique_ptr<expression>& e, const std::string& name, long value)
-{
-    if(expr_label* l = dynamic_cast<expr_label*> (e.get()))
+    /* Appends the terms of the Sum node at n[sum], in order. */
+    void GetTerms(const Node* n, std::size_t sum, bool negate, TermList& terms)
     {
-        if(l->GetName() == name)
+        const std::size_t first = terms.size();
+        std::size_t end = sum;
+        for(long k = n[sum].value; k > 0; --k)
         {
-            e = std::unique_ptr<expression>(new expr_number(value));
+            const std::size_t term  = end-1;
+            const std::size_t begin = SubBegin(n, term-1);
+            terms.push_back(TermRange{begin, term, (n[term].value != 0) != negate});
+            end = begin;
         }
+        std::reverse(terms.begin() + first, terms.end());
     }
-    else if(expr_unary* u = dynamic_cast<expr_unary*> (e.get()))
-    {
-        SubstituteExprLabel(u->sub, name, value);
-    }
-    else if(expr_binary* b = dynamic_cast<expr_binary*> (e.get()))
-    {
-        SubstituteExprLabel(b->left, name, value);
-        SubstituteExprLabel(b->right, name, value);
-    }
-    else if(sum_group* s = dynamic_cast<sum_group*> (e.get()))
+
+    long Apply(expression::Tag tag, long left, long right)
     {
-        for(auto& child: s->contents)
+        switch(tag)
         {
-            SubstituteExprLabel(child.first, name, value);
+            case expression::Mul:    return left * right;
+            case expression::Div:    return left / right;
+            case expression::Shl:    return left << right;
+            case expression::Shr:    return left >> right;
+            case expression::BitAnd: return left & right;
+            case expression::BitOr:  return left | right;
+            case expression::BitXor: return left ^ right;
+            default:                 return 0;
         }
     }
-}
 
-void FindExprUsedLabels(const std::unique_ptr<expression>& e, std::set<std::string>& labels)
-{
-    if(const expr_label* l = dynamic_cast<const expr_label*> (e.get()))
+    const char* OperatorName(expression::Tag tag)
     {
-        labels.insert(l->GetName());
-    }
-    else if(const expr_unary* u = dynamic_cast<const expr_unary*> (e.get()))
-    {
-        FindExprUsedLabels(u->sub, labels);
+        switch(tag)
+        {
+            case expression::Mul:    return "*";
+            case expression::Div:    return "/";
+            case expression::Shl:    return " shl ";
+            case expression::Shr:    return " shr ";
+            case expression::BitAnd: return " and";
+            case expression::BitOr:  return " or ";
+            case expression::BitXor: return " xor ";
+            default:                 return "";
+        }
     }
-    else if(const expr_binary* b = dynamic_cast<const expr_binary*> (e.get()))
+
+    void OptimizeSum(expression::NodeList& out,
+                     std::vector<std::size_t, ArenaAllocator<std::size_t> >& starts,
+                     long count)
     {
-        FindExprUsedLabels(b->left, labels);
-        FindExprUsedLabels(b->right, labels);
+        const std::size_t first = starts[starts.size() - count];
+
+        TermList queue;
+        for(long k = 0; k < count; ++k)
+        {
+            const std::size_t begin = starts[starts.size() - count + k];
+            const std::size_t term  = k+1 < count ? starts[starts.size() - count + k+1] - 1
+                                                  : out.size() - 1;
+            queue.push_back(TermRange{begin, term, out[term].value != 0});
+        }
+
+        // Constants are summed together and moved last, negations are
+        // turned into subtractions, and sums within the sum are merged.
+        TermList kept;
+        long const_sum = 0;
+        for(std::size_t i = 0; i < queue.size(); ++i)
+        {
+            TermRange t = queue[i];
+            for(;;)
+            {
+                const Node& root = out[t.end-1];
+                if(root.tag == expression::Number)
+                    const_sum += t.negative ? -root.value : root.value;
+                else if(root.tag == expression::Negate)
+                {
+                    --t.end;
+                    t.negative = !t.negative;
+                    continue; // Reanalyze the same term
+                }
+                else if(root.tag == expression::Sum)
+                    GetTerms(&out[0], t.end-1, t.negative, queue);
+                else
+                    kept.push_back(t);
+                break;
+            }
+        }
+
+        expression::NodeList result;
+        if(kept.empty())
+            result.push_back(Node{expression::Number, const_sum});
+        else if(kept.size() == 1 && !const_sum)
+        {
+            // A sum of one element is the element itself.
+            result.insert(result.end(), &out[kept[0].begin], &out[0] + kept[0].end);
+            if(kept[0].negative)
+                result.push_back(Node{expression::Negate, 0});
+        }
+        else
+        {
+            for(const TermRange& t: kept)
+            {
+                result.insert(result.end(), &out[t.begin], &out[0] + t.end);
+                result.push_back(Node{expression::Term, t.negative});
+            }
+            long n = kept.size();
+            if(const_sum)
+            {
+                result.push_back(Node{expression::Number, const_sum});
+                result.push_back(Node{expression::Term, 0});
+                ++n;
+            }
+            result.push_back(Node{expression::Sum, n});
+        }
+
+        out.resize(first);
+        out.insert(out.end(), result.begin(), result.end());
+        starts.resize(starts.size() - count);
+        starts.push_back(first);
     }
-    else if(const sum_group* s = dynamic_cast<const sum_group*> (e.get()))
+
+    std::pair<SymbolId, long> IsLabelSum(const expression& e, std::size_t begin, std::size_t end)
     {
-        for(const auto& child: s->contents)
+        const Node& root = e.nodes[end-1];
+        if(root.tag == expression::Sum)
         {
-            FindExprUsedLabels(child.first, labels);
+            TermList terms;
+            GetTerms(&e.nodes[0], end-1, false, terms);
+
+            std::pair<SymbolId, long> result{ 0, 0 };
+            for(const TermRange& t: terms)
+            {
+                if(e.IsConst(t.begin, t.end))
+                    { long val = e.GetConst(t.begin, t.end); if(t.negative) val=-val; result.second += val; }
+                else if(t.negative || result.first)
+                    return {}; // Failed
+                else
+                {
+                    auto p = IsLabelSum(e, t.begin, t.end);
+                    if(!p.first) return {}; // Failed
+                    result.first  = p.first;
+                    result.second += p.second;
+                }
+            }
+            return result;
         }
+        else if(root.tag == expression::Label)
+            return { SymbolId(root.value), 0l };
+        else if(e.IsConst(begin, end))
+            return { 0, e.GetConst(begin, end) };
+        return {};
     }
 }
 
-sum_group::sum_group(std::unique_ptr<expression>&& l, std::unique_ptr<expression>&& r, bool is_negative)
+std::size_t expression::Begin(std::size_t last) const
 {
-     contents.emplace_back(std::move(l), false);
-     contents.emplace_back(std::move(r), is_negative);
+    return SubBegin(&nodes[0], last);
 }
 
-bool sum_group::IsConst() const
-{
-     for(const auto& child: contents)
-          if(!child.first->IsConst())
-              return false;
-     return true;
-}
-long sum_group::GetConst() const
+void expression::FoldConst(std::size_t begin)
 {
-     long result = 0;
-     for(const auto& child: contents)
-          if(child.second)
-               result -= child.first->GetConst();
-          else
-               result += child.first->GetConst();
-     //std::fprintf(stderr, "Const value: $%lX of '%s'\n", result, Dump().c_str());
-     return result;
+    if(nodes.size() - begin > 1 && IsConst(begin, nodes.size()))
+    {
+        long value = GetConst(begin, nodes.size());
+        nodes.resize(begin);
+        PushNumber(value);
+    }
 }
 
-const std::string sum_group::Dump() const
+bool expression::IsConst(std::size_t begin, std::size_t end) const
 {
-     std::string result = "(";
-     for(const auto& child: contents)
-     {
-          result += child.second ? '-' : '+';
-          result += child.first->Dump();
-     }
-     result += ')';
-     return result;
+    for(std::size_t a = begin; a < end; ++a)
+        if(nodes[a].tag == Label)
+            return false;
+    return true;
 }
 
-void sum_group::Optimize(std::unique_ptr<expression>& self_ptr)
+long expression::GetConst(std::size_t begin, std::size_t end) const
 {
-    long const_sum = 0;
-    for(list_t::iterator i = contents.begin(); i != contents.end(); )
+    if(end - begin == 1) return nodes[begin].tag == Number ? nodes[begin].value : 0;
+
+    std::vector<long, ArenaAllocator<long> > stack;
+    for(std::size_t a = begin; a < end; ++a)
     {
-        std::unique_ptr<expression>& e = i->first;
-        e->Optimize(e);
-        if(e->IsConst())
-        {
-            //std::fprintf(stderr, "Found const (%ld)%s\n", e->GetConst(), i->second?" (negated)":"");
-            if(i->second)
-                const_sum -= e->GetConst();
-            else
-                const_sum += e->GetConst();
-            i = contents.erase(i);
-            continue;
-        }
-        if(expr_negate* n = dynamic_cast<expr_negate*> (e.get()))
-        {
-            *i = elem_t(std::move(n->sub), !i->second);
-            // Reanalyze same item
-            continue;
-        }
-        if(sum_group* s = dynamic_cast<sum_group*> (e.get()))
+        const Node& n = nodes[a];
+        switch(n.tag)
         {
-            if(i->second) s->Negate();
-            contents.splice(contents.end(), std::move(s->contents));
-            i = contents.erase(i);
-            continue;
+            case Number: stack.push_back(n.value); break;
+            case Label:  stack.push_back(0); break;
+            case Negate: stack.back() = -stack.back(); break;
+            case BitNot: stack.back() = ~stack.back(); break;
+            case Term:   if(n.value) stack.back() = -stack.back(); break;
+            case Sum:
+            {
+                long result = 0;
+                for(long k = 0; k < n.value; ++k) { result += stack.back(); stack.pop_back(); }
+                stack.push_back(result);
+                break;
+            }
+            default:
+            {
+                long right = stack.back(); stack.pop_back();
+                stack.back() = Apply(n.tag, stack.back(), right);
+            }
         }
-        ++i;
-    }
-    if(contents.empty())
-    {
-        //std::fprintf(stderr, "Replaced with const sum=%ld\n", const_sum);
-        self_ptr = std::unique_ptr<expression>(new expr_number(const_sum));
-        return;
     }
-    if(const_sum)
-    {
-        //std::fprintf(stderr, "Re-added const sum=%ld\n", const_sum);
-        contents.emplace_back(new expr_number(const_sum), false);
-    }
-    if(contents.size() == 1)
+    return stack.back();
+}
+
+const std::string expression::Dump(std::size_t begin, std::size_t end) const
+{
+    std::vector<std::string> stack;
+    for(std::size_t a = begin; a < end; ++a)
     {
-        // Replace self with the first element.
-        auto& front = contents.front();
-        auto ptr = std::move(front.first);
-        if(front.second)
+        const Node& n = nodes[a];
+        switch(n.tag)
         {
-            // Negate it if necessary.
-            ptr = std::unique_ptr<expression>(new expr_negate(std::move(ptr)));
+            case Number:
+            {
+                char Buf[512];
+                if(n.value < 0)
+                    std::sprintf(Buf, "$-%lX", -n.value);
+                else
+                    std::sprintf(Buf, "$%lX", n.value);
+                stack.push_back(Buf);
+                break;
+            }
+            case Label:
+                stack.push_back(SymbolName(n.value));
+                break;
+            case Negate:
+            case BitNot:
+                stack.back() = (n.tag == Negate ? "-(" : "not(") + stack.back() + ")";
+                break;
+            case Term:
+                stack.back().insert(stack.back().begin(), n.value ? '-' : '+');
+                break;
+            case Sum:
+            {
+                std::string result = "(";
+                for(std::size_t k = stack.size() - n.value; k < stack.size(); ++k)
+                    result += stack[k];
+                result += ')';
+                stack.resize(stack.size() - n.value);
+                stack.push_back(std::move(result));
+                break;
+            }
+            default:
+            {
+                std::string right = std::move(stack.back()); stack.pop_back();
+                stack.back() = "(" + stack.back() + OperatorName(n.tag) + right + ")";
+            }
         }
-        self_ptr = std::move(ptr);
     }
+    return stack.empty() ? std::string() : stack.back();
 }
 
-void sum_group::Negate()
+void expression::Optimize()
 {
-    for(auto& child: contents)
-        child.second = !child.second;
-}
+    NodeList out;
+    out.reserve(nodes.size());
 
-std::pair<std::string, long> IsLabelSumExpression(const std::unique_ptr<expression>& e)
-{
-    if(sum_group* s = dynamic_cast<sum_group*> (e.get()))
+    // Where each operand that is still waiting for its operator begins in "out"
+    std::vector<std::size_t, ArenaAllocator<std::size_t> > starts;
+
+    for(const Node& n: nodes)
     {
-        std::pair<std::string, long> result{ {}, {} };
-        for(const auto& e: s->contents)
+        switch(n.tag)
         {
-            if(e.first->IsConst())
-                { long val = e.first->GetConst(); if(e.second) val=-val; result.second += val; }
-            else if(e.second || !result.first.empty())
-                return {}; // Failed
-            else
+            case Number:
+            case Label:
+                starts.push_back(out.size());
+                out.push_back(n);
+                break;
+            case Negate:
+            case BitNot:
+            {
+                Node& sub = out.back();
+                if(sub.tag == Number)
+                    sub.value = n.tag == Negate ? -sub.value : ~sub.value;
+                else if(sub.tag == n.tag)
+                    out.pop_back(); // -(-x) and not(not(x)) are x
+                else if(n.tag == Negate && sub.tag == Sum)
+                {
+                    // -(a+b) is (-a-b)
+                    std::size_t end = out.size()-1;
+                    for(long k = sub.value; k > 0; --k)
+                    {
+                        Node& term = out[end-1];
+                        term.value = !term.value;
+                        end = SubBegin(&out[0], end-2);
+                    }
+                }
+                else
+                    out.push_back(n);
+                break;
+            }
+            case Term:
+                out.push_back(n);
+                break;
+            case Sum:
+                OptimizeSum(out, starts, n.value);
+                break;
+            default:
             {
-                auto p = IsLabelSumExpression(e.first);
-                if(p.first.empty()) return {}; // Failed
-                result.first  = p.first;
-                result.second += p.second;
+                std::size_t right = starts.back(); starts.pop_back();
+                std::size_t left  = starts.back();
+                if(right == left+1 && out[left].tag == Number
+                && out.size() == right+1 && out[right].tag == Number)
+                {
+                    out[left].value = Apply(n.tag, out[left].value, out[right].value);
+                    out.pop_back();
+                }
+                else
+                    out.push_back(n);
             }
         }
-        return result;
     }
-    else if(expr_label* l = dynamic_cast<expr_label*> (e.get()))
-    {
-        return {l->GetName(), 0l};
-    }
-    else if(e.get()->IsConst())
-        return {{}, e.get()->GetConst()};
-    return {};
+    nodes = std::move(out);
+}
+
+void SubstituteExprLabel(expression& e, SymbolId label, long value)
+{
+    for(auto& n: e.nodes)
+        if(n.tag == expression::Label && SymbolId(n.value) == label)
+            n = expression::Node{expression::Number, value};
+}
+
+void FindExprUsedLabels(const expression& e, std::set<SymbolId>& labels)
+{
+    for(const auto& n: e.nodes)
+        if(n.tag == expression::Label)
+            labels.insert(n.value);
+}
+
+std::pair<SymbolId, long> IsLabelSumExpression(const expression& e)
+{
+    if(e.empty()) return {};
+    return IsLabelSum(e, 0, e.nodes.size());
 }
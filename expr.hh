@@ -1,154 +1,81 @@
 #ifndef bqt65asmExprHH
 #define bqt65asmExprHH
 
-#include <cstdio>
+#include <cstddef>
 #include <string>
 #include <utility>
-#include <list>
+#include <vector>
 #include <set>
-#include <memory>
 
+#include "arena.hh"
+#include "symbol.hh"
+
+/* An expression is stored in postfix order: the operands of each
+ * node come right before it in the array.
+ *
+ * The terms of a sum are each followed by a Term node that tells
+ * whether the term is subtracted, and then the Sum node that tells
+ * how many terms there were. For example, a-(b*2) is:
+ *
+ *   Label a, Term +, Label b, Number 2, Mul, Term -, Sum 2
+ */
 class expression
 {
 public:
-    virtual ~expression() { }
-    virtual bool IsConst() const = 0;
-    virtual long GetConst() const { return 0; }
-
-    virtual const std::string Dump() const = 0;
-    virtual void Optimize(std::unique_ptr<expression>& self_ptr);
-};
-class expr_number: public expression
-{
-protected:
-    long value;
-public:
-    expr_number(long v): value(v) { }
-
-    virtual bool IsConst() const { return true; }
-    virtual long GetConst() const { return value; }
-
-    virtual const std::string Dump() const
+    enum Tag: unsigned char
     {
-        char Buf[512];
-        if(value < 0)
-            std::sprintf(Buf, "$-%lX", -value);
-        else
-            std::sprintf(Buf, "$%lX", value);
-        return Buf;
-    }
-};
-class expr_label: public expression
-{
-protected:
-    std::string name;
-public:
-    expr_label(const std::string& s): name(s) { }
-
-    virtual bool IsConst() const { return false; }
-
-    virtual const std::string Dump() const { return name; }
-    const std::string& GetName() const { return name; }
-};
-class expr_unary: public expression
-{
-public:
-    std::unique_ptr<expression> sub;
-public:
-    expr_unary(std::unique_ptr<expression>&& s): sub(std::move(s)) { }
-    virtual bool IsConst() const { return sub->IsConst(); }
-
-    virtual void Optimize(std::unique_ptr<expression>& self_ptr)
+        Number, Label,                             // No operands
+        Negate, BitNot,                            // One operand
+        Mul, Div, Shl, Shr, BitAnd, BitOr, BitXor, // Two operands
+        Term,                                      // Ends a term of a sum
+        Sum
+    };
+    struct Node
     {
-         sub->Optimize(sub);
-         expression::Optimize(self_ptr);
-    }
-private:
-    expr_unary(const expr_unary &b);
-    void operator= (const expr_unary &b);
-};
-class expr_binary: public expression
-{
-public:
-    std::unique_ptr<expression> left;
-    std::unique_ptr<expression> right;
-public:
-    expr_binary(std::unique_ptr<expression>&& l, std::unique_ptr<expression>&& r): left(std::move(l)), right(std::move(r)) { }
-    virtual bool IsConst() const { return left->IsConst() && right->IsConst(); }
+        Tag  tag;
+        long value; // Number: the value. Label: SymbolId.
+                    // Term: nonzero if negative. Sum: number of terms.
+    };
+    typedef std::vector<Node, ArenaAllocator<Node> > NodeList;
 
-    virtual void Optimize(std::unique_ptr<expression>& self_ptr)
-    {
-         left->Optimize(left);
-         right->Optimize(right);
-         expression::Optimize(self_ptr);
-    }
+    NodeList nodes;
 
-private:
-    expr_binary(const expr_binary &b);
-    void operator= (const expr_binary &b);
-};
-
-#define unary_class(classname, op, stringop) \
-    class classname: public expr_unary \
-    { \
-    public: \
-        classname(std::unique_ptr<expression>&& s): expr_unary(std::move(s)) { } \
-        virtual long GetConst() const { return op sub->GetConst(); } \
-    \
-        virtual const std::string Dump() const \
-        { return std::string(stringop) + "(" + sub->Dump() + ")"; } \
-        \
-        virtual void Optimize(std::unique_ptr<expression>& self_ptr); \
-    };
+public:
+    expression(): nodes() { }
 
-#define binary_class(classname, op, stringop) \
-    class classname: public expr_binary \
-    { \
-    public: \
-        classname(std::unique_ptr<expression>&& l, std::unique_ptr<expression>&& r): expr_binary(std::move(l), std::move(r)) { } \
-        virtual long GetConst() const { return left->GetConst() op right->GetConst(); } \
-    \
-        virtual const std::string Dump() const \
-        { return std::string("(") + left->Dump() + stringop + right->Dump() + ")"; } \
-    };
+    bool empty() const { return nodes.empty(); }
+    void clear() { nodes.clear(); }
 
-unary_class(expr_bitnot, ~, "not")
-unary_class(expr_negate, -, "-")
+    void PushNumber(long value) { nodes.push_back(Node{Number, value}); }
+    void PushLabel(SymbolId id) { nodes.push_back(Node{Label, long(id)}); }
+    void Push(Tag tag, long value = 0) { nodes.push_back(Node{tag, value}); }
 
-binary_class(expr_mul,    *, "*")
-binary_class(expr_div,    /, "/")
-binary_class(expr_shl,   <<, " shl ")
-binary_class(expr_shr,   >>, " shr ")
-binary_class(expr_bitand, &, " and")
-binary_class(expr_bitor,  |, " or ")
-binary_class(expr_bitxor, ^, " xor ")
+    /* Replaces the nodes from "begin" onwards with their value, if it is const. */
+    void FoldConst(std::size_t begin);
 
-class sum_group: public expression
-{
-public:
-    typedef std::pair<std::unique_ptr<expression>, bool> elem_t;
-    typedef std::list<elem_t> list_t;
-    list_t contents;
-public:
-    sum_group(std::unique_ptr<expression>&& l, std::unique_ptr<expression>&& r, bool is_negative);
+    /* Index of the first node of the subexpression that ends at "last". */
+    std::size_t Begin(std::size_t last) const;
 
-    virtual bool IsConst() const;
-    virtual long GetConst() const;
+    /* These work on the subexpression in [begin, end),
+     * or on the whole expression if not given.
+     */
+    bool IsConst(std::size_t begin, std::size_t end) const;
+    long GetConst(std::size_t begin, std::size_t end) const;
+    const std::string Dump(std::size_t begin, std::size_t end) const;
 
-    virtual const std::string Dump() const;
-    virtual void Optimize(std::unique_ptr<expression>& self_ptr);
-private:
-    friend class expr_negate;
-    void Negate();
+    bool IsConst() const { return IsConst(0, nodes.size()); }
+    long GetConst() const { return GetConst(0, nodes.size()); }
+    const std::string Dump() const { return Dump(0, nodes.size()); }
 
-private:
-    sum_group(const sum_group &b);
-    void operator= (const sum_group &b);
+    void Optimize();
 };
 
-void SubstituteExprLabel(std::unique_ptr<expression>&, const std::string& name, long value);
-void FindExprUsedLabels(const std::unique_ptr<expression>&, std::set<std::string>& labels);
+void SubstituteExprLabel(expression&, SymbolId label, long value);
+void FindExprUsedLabels(const expression&, std::set<SymbolId>& labels);
 
-std::pair<std::string, long> IsLabelSumExpression(const std::unique_ptr<expression>&);
+/* If the expression is label+const or const, returns them.
+ * Otherwise returns {0,0}.
+ */
+std::pair<SymbolId, long> IsLabelSumExpression(const expression&);
 
 #endif
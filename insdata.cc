@@ -1,3 +1,5 @@
+#include <cstring>
+
 #include "insdata.hh"
 #include "assemble.hh"
 
@@ -23,11 +25,16 @@ const struct AddrMode AddrModes[] =
   { /* 14 .nop imm16  */    0, "",   "",   AddrMode::tWord, AddrMode::tNone }
 };
 const unsigned AddrModeCount = sizeof(AddrModes) / sizeof(AddrModes[0]);
+static_assert(sizeof(AddrModes) / sizeof(AddrModes[0]) == MaxAddrModes, "MaxAddrModes is wrong");
 
-const struct ins ins[] =
+struct ins
 {
-    // IMPORTANT: Alphabetical sorting!
+    const char *token;
+    const char *opcodes;
+};
 
+constexpr struct ins ins[] =
+{
   { ".(",    "sb" }, // start block, no params
   { ".)",    "eb" }, // end block, no params
   { ".bss",  "gb" }, // Select seG BSS
@@ -145,7 +152,118 @@ const struct ins ins[] =
   { "txs",  "9A'--'--'--'--'--'--'--'--'--'--'--"},
   { "tya",  "98'--'--'--'--'--'--'--'--'--'--'--"},
 };
-const unsigned InsCount = sizeof(ins) / sizeof(ins[0]);
+constexpr unsigned InsCount = sizeof(ins) / sizeof(ins[0]);
+
+namespace
+{
+    /* Directives that take a list of values instead of an addressing mode */
+    constexpr struct { const char *token; Mnemonic::Type type; } datadirectives[] =
+    {
+      { ".byt",  Mnemonic::Byt },
+      { ".word", Mnemonic::Word },
+      { ".long", Mnemonic::Long }
+    };
+    constexpr unsigned NumMnemonics = InsCount + sizeof(datadirectives) / sizeof(datadirectives[0]);
+
+    /* The tables above are converted at compile time into an array of
+     * Mnemonics, and a perfect hash from the token to the array index.
+     */
+    constexpr unsigned HashSize = 1024;
+    constexpr unsigned char NoMnemonic = 0xFF;
+    static_assert(NumMnemonics < NoMnemonic, "Too many mnemonics");
+
+    constexpr unsigned Hash(const char* s, std::size_t length, unsigned seed)
+    {
+        unsigned h = seed;
+        for(std::size_t a=0; a<length; ++a)
+            h = (h ^ (unsigned char)s[a]) * 0x01000193u;
+        h ^= h >> 15;
+        return h % HashSize;
+    }
+
+    constexpr unsigned char Length(const char* s)
+    {
+        unsigned char n = 0;
+        while(s[n]) ++n;
+        return n;
+    }
+
+    constexpr unsigned HexDigit(char c)
+    {
+        return c >= 'A' ? c-'A'+10 : c-'0';
+    }
+
+    constexpr Opcode DecodeOpcode(const char* s)
+    {
+        switch(s[0])
+        {
+            case '-': return { Opcode::None, 0 };
+            case 's': return { Opcode::StartBlock, 0 };
+            case 'e': return { Opcode::EndBlock, 0 };
+            case 'l': return { Opcode::Link, 0 };
+            case 'n': return { Opcode::Nop, 0 };
+            case 'g':
+                switch(s[1])
+                {
+                    case 't': return { Opcode::SelectTEXT, 0 };
+                    case 'd': return { Opcode::SelectDATA, 0 };
+                    case 'z': return { Opcode::SelectZERO, 0 };
+                    case 'b': return { Opcode::SelectBSS, 0 };
+                }
+        }
+        return { Opcode::Byte, (unsigned char)(HexDigit(s[0])*16 + HexDigit(s[1])) };
+    }
+
+    struct MnemonicTables
+    {
+        Mnemonic mnemonics[NumMnemonics];
+        unsigned char slots[HashSize];
+        unsigned seed;
+    };
+
+    constexpr MnemonicTables BuildMnemonicTables()
+    {
+        MnemonicTables t{};
+
+        for(unsigned a=0; a<InsCount; ++a)
+        {
+            Mnemonic& m = t.mnemonics[a];
+            m.type   = Mnemonic::Instruction;
+            m.token  = ins[a].token;
+            m.length = Length(m.token);
+            for(const char* s = ins[a].opcodes; ; s += 3)
+            {
+                m.modes[m.nmodes++] = DecodeOpcode(s);
+                if(!s[2]) break;
+            }
+        }
+        for(unsigned a=InsCount; a<NumMnemonics; ++a)
+        {
+            Mnemonic& m = t.mnemonics[a];
+            m.type   = datadirectives[a-InsCount].type;
+            m.token  = datadirectives[a-InsCount].token;
+            m.length = Length(m.token);
+        }
+
+        // Find a seed with which no two tokens collide
+        for(t.seed = 1; ; ++t.seed)
+        {
+            for(unsigned a=0; a<HashSize; ++a) t.slots[a] = NoMnemonic;
+
+            bool ok = true;
+            for(unsigned a=0; a<NumMnemonics && ok; ++a)
+            {
+                unsigned char& slot = t.slots[Hash(t.mnemonics[a].token, t.mnemonics[a].length, t.seed)];
+                ok = slot == NoMnemonic;
+                slot = a;
+            }
+            if(ok) break;
+        }
+        return t;
+    }
+
+    constexpr MnemonicTables Tables = BuildMnemonicTables();
+}
 
 unsigned GetOperand1Size(unsigned modenum)
 {
@@ -178,12 +296,19 @@ unsigned GetOperandSize(unsigned modenum)
     return GetOperand1Size(modenum) + GetOperand2Size(modenum);
 }
 
-bool IsReservedWord(const std::string& s)
+const Mnemonic* FindMnemonic(const char* token, std::size_t length)
+{
+    unsigned char index = Tables.slots[Hash(token, length, Tables.seed)];
+    if(index == NoMnemonic) return nullptr;
+
+    const Mnemonic& m = Tables.mnemonics[index];
+    if(m.length != length || std::memcmp(m.token, token, length)) return nullptr;
+    return &m;
+}
+
+bool IsReservedWord(std::string_view s)
 {
-    const struct ins *insdata = std::lower_bound(ins, ins+InsCount, s);
-    return (insdata < ins+InsCount && s == insdata->token)
-         || s == ".byt"
-         || s == ".word";
+    return FindMnemonic(s.data(), s.size()) != nullptr;
 }
 
 #if 0
@@ -1,11 +1,15 @@
+#ifndef bqt65asmInsdataHH
+#define bqt65asmInsdataHH
+
 /* snescom 65c816 instruction database for snescom and deasm */
 
 #include <string>
+#include <string_view>
 
 unsigned GetOperand1Size(unsigned modenum);
 unsigned GetOperand2Size(unsigned modenum);
 unsigned GetOperandSize(unsigned modenum);
-bool IsReservedWord(const std::string& s);
+bool IsReservedWord(std::string_view s);
 
 struct AddrMode
 {
@@ -17,11 +21,38 @@ struct AddrMode
 extern const struct AddrMode AddrModes[];
 extern const unsigned AddrModeCount;
 
-struct ins
+/* An entry of the opcode matrix: what a mnemonic does in an addressing mode */
+struct Opcode
+{
+    enum Kind: unsigned char
+    {
+        None,       // Addressing mode not supported
+        Byte,       // An instruction; "byte" is the opcode
+        StartBlock, EndBlock,
+        SelectTEXT, SelectDATA, SelectZERO, SelectBSS,
+        Link,       // .link (modes 12 and 13)
+        Nop         // .nop (mode 14)
+    } kind;
+    unsigned char byte;
+};
+
+const unsigned MaxAddrModes = 15;
+
+struct Mnemonic
 {
+    enum Type: unsigned char
+    {
+        Instruction, // Also the directives that have addressing modes
+        Byt, Word, Long
+    } type;
+    unsigned char length;
     const char *token;
-    const char *opcodes;
-    bool operator< (const std::string &s) const { return s > token; }
+
+    unsigned char nmodes;
+    Opcode modes[MaxAddrModes];
 };
-extern const struct ins ins[];
-extern const unsigned InsCount;
+
+/* Returns NULL if the token is not a mnemonic or a directive. */
+const Mnemonic* FindMnemonic(const char* token, std::size_t length);
+
+#endif
@@ -2,8 +2,6 @@
 #include <vector>
 #include <cstring>
 
-#include <unistd.h> // For ftruncate
-
 using namespace std;
 
 #include "o65linker.hh"
@@ -16,9 +14,6 @@ using namespace std;
 
 #include <getopt.h>
 
-bool already_reprocessed = true; /* required by object.cc, not really used */
-bool assembly_errors = false;
-
 extern unsigned ROMmap_npages; // from romaddr.cc, number of 0x4000-byte pages
 static unsigned MapperNo = 2;
 
@@ -113,18 +108,29 @@ static void MapNESintoROM(DataArea& area, const Object& obj)
         unsigned write_to    = b.first;
         unsigned base        = b.second.first;
         unsigned write_count = b.second.second;
-        auto lump = obj.GetContent(base, write_count);
-        if(std::any_of(lump.begin(), lump.end(), [&](unsigned n){return n!=0;}))
+        bool nonzero = false;
+        for(unsigned done = 0; done < write_count && !nonzero; )
+        {
+            ByteSpan view = obj.GetView(base + done, write_count - done);
+            nonzero = std::any_of(view.begin(), view.end(), [&](unsigned n){return n!=0;});
+            done += view.size();
+        }
+        if(nonzero)
         {
             std::fprintf(stderr, "  base=$%X, size=$%X, write_to=$%X, write_count=$%X\n",
                 base, size, write_to, write_count);
 
-            area.WriteLump(write_to, lump);
+            for(unsigned done = 0; done < write_count; )
+            {
+                ByteSpan view = obj.GetView(base + done, write_count - done);
+                area.WriteLump(write_to + done, view);
+                done += view.size();
+            }
         }
     }
 }
 
-static void FixupNES(Object& obj, std::FILE* stream)
+static void FixupNES(Object& obj, OutputBuffer& out)
 {
     bool Mirroring  = true;
     bool Mirroring2 = false;
@@ -149,8 +155,8 @@ static void FixupNES(Object& obj, std::FILE* stream)
          0,0,0,0,
          0,0,0,0};
 
-    fseek(stream, 0, SEEK_SET);
-    fwrite(NESheader, 1, 16, stream);
+    out.Seek(0);
+    out.PutS(NESheader, 16);
 
     DataArea rom_obj;
     obj.SelectTEXT();
@@ -161,12 +167,12 @@ static void FixupNES(Object& obj, std::FILE* stream)
     unsigned filesize = rom_obj.GetTop();
     unsigned RomSize = ROMmap_npages * GetPageSize();
     if(filesize < RomSize) filesize = RomSize;
-    std::vector<unsigned char> ROMdata = rom_obj.GetContent(0, filesize);
-
-    fseek(stream, 16, SEEK_SET);
-    fwrite(&ROMdata[0], 1, ROMdata.size(), stream);
+    rom_obj.VisitContent(0, filesize, [&](unsigned, ByteSpan view)
+    {
+        out.PutS(view);
+    });
 
-    ftruncate(fileno(stream), ROMdata.size()+16);
+    out.Resize(filesize+16);
 }
 
 static void Import(O65linker& linker, Object& obj, SegmentSelection seg)
@@ -174,7 +180,7 @@ static void Import(O65linker& linker, Object& obj, SegmentSelection seg)
     std::vector<unsigned> o65addrs = linker.GetAddrList(seg);
     for(unsigned a=0; a<o65addrs.size(); ++a)
     {
-        const vector<unsigned char>& code = linker.GetSeg(seg, a);
+        ByteSpan code = linker.GetSeg(seg, a);
         if(code.empty()) continue;
 
         char Buf[64];
@@ -187,7 +193,7 @@ static void Import(O65linker& linker, Object& obj, SegmentSelection seg)
     }
 }
 
-static void WriteOut(O65linker& linker, std::FILE* stream)
+static void WriteOut(O65linker& linker, OutputBuffer& out)
 {
     Object obj;
 
@@ -202,17 +208,17 @@ static void WriteOut(O65linker& linker, std::FILE* stream)
     switch(format)
     {
         case IPSformat:
-            obj.WriteIPS(stream);
+            obj.WriteIPS(out);
             break;
         case O65format:
-            obj.WriteO65(stream);
+            obj.WriteO65(out);
             break;
         case RAWformat:
-            obj.WriteRAW(stream, ROMmap_npages*GetPageSize());
+            obj.WriteRAW(out, ROMmap_npages*GetPageSize());
             break;
         case NESformat:
-            obj.WriteRAW(stream, ROMmap_npages*GetPageSize(), 16);
-            FixupNES(obj, stream);
+            obj.WriteRAW(out, ROMmap_npages*GetPageSize(), 16);
+            FixupNES(obj, out);
             break;
     }
     obj.Dump();
@@ -222,7 +228,6 @@ int main(int argc, char** argv)
 {
     std::vector<std::string> files;
 
-    std::FILE *output = NULL;
     std::string outfn;
 
     for(;;)
@@ -277,20 +282,9 @@ int main(int argc, char** argv)
 
             case 'o':
             {
+                // The file is written only once everything is done
                 outfn = optarg;
-                if(outfn != "-")
-                {
-                    if(output)
-                    {
-                        std::fclose(output);
-                    }
-                    output = std::fopen(outfn.c_str(), "wb");
-                    if(!output)
-                    {
-                        std::perror(outfn.c_str());
-                        goto ErrorExit;
-                    }
-                }
+                if(outfn == "-") outfn.clear();
                 break;
             }
             case 'f':
@@ -325,12 +319,6 @@ int main(int argc, char** argv)
     if(files.empty())
     {
         std::fprintf(stderr, "Error: Link what? See %s --help\n", argv[0]);
-    ErrorExit:
-        if(output)
-        {
-            std::fclose(output);
-            std::remove(outfn.c_str());
-        }
         return -1;
     }
 
@@ -356,6 +344,12 @@ int main(int argc, char** argv)
         {
             O65 tmp;
             tmp.Load(fp);
+            if(tmp.Error())
+            {
+                std::fprintf(stderr, "Error: %s is damaged, skipping it\n", files[a].c_str());
+                std::fclose(fp);
+                continue;
+            }
 
             const vector<pair<unsigned char, string> >&
                 customheaders = tmp.GetCustomHeaders();
@@ -410,7 +404,7 @@ int main(int argc, char** argv)
                 }
             }
 
-            linker.AddObject(tmp, files[a], Linkage);
+            linker.AddObject(std::move(tmp), files[a], Linkage);
         }
         std::fclose(fp);
     }
@@ -466,10 +460,15 @@ int main(int argc, char** argv)
     freespace_data.OrganizeO65linker(linker, BSS);
     freespace_data.DumpPageMap(0);
 
+    linker.LocateAll();
     linker.Link();
 
-    WriteOut(linker, output ? output : stdout);
-    if(output) std::fclose(output);
+    OutputBuffer out;
+    WriteOut(linker, out);
+    if(outfn.empty())
+        out.WriteTo(stdout);
+    else if(!out.WriteFile(outfn))
+        return 1;
 
     return 0;
 }
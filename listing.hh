@@ -0,0 +1,68 @@
+#ifndef bqt65asmListingHH
+#define bqt65asmListingHH
+
+#include <vector>
+
+#include "expr.hh"
+#include "symbol.hh"
+#include "o65.hh"
+
+/* What the assembler did to an object, statement by statement.
+ * With --jumps, the source is parsed only once. When some short jumps
+ * are found out of range, they are made long and the listing is
+ * assembled again, until no more jumps need fixing. With --zeropage,
+ * the word operands found to point into zero page are made bytes
+ * in the same way.
+ */
+struct Listing
+{
+    struct Param
+    {
+        unsigned size;
+        char prefix;
+        unsigned begin, end; // The expression, in "nodes"
+    };
+
+    struct Statement
+    {
+        enum Kind: unsigned char
+        {
+            Code,          // Emits the params
+            Label,         // Defines "label" here, in scope number "value"
+            BranchLabel,   // Defines "label" here, in the current scope
+            NopLabel,      // Defines "label" at "value" bytes from here
+            LabelValue,    // Defines "label" as the value of the param, in scope "value"
+            SetPos,        // Moves to the value of the param
+            StartScope, EndScope,
+            SelectTEXT, SelectDATA, SelectZERO, SelectBSS,
+            LinkGroup,     // Sets the linkage group to "value"
+            LinkPage,      // Sets the linkage page to "value"
+            UndefineLabel  // Forgets "label"
+        };
+
+        Kind kind;
+        bool flipped;          // Code: a short jump that was made long
+        SegmentSelection seg;  // Where it was last assembled
+        unsigned pos;
+        SymbolId label;
+        unsigned value;
+        unsigned begin, end;   // The params, in "params"
+
+        // Code: the param that could be a byte, and the opcode for that
+        unsigned zpparam, zpopcode;
+
+        explicit Statement(Kind k, SymbolId l = 0, unsigned v = 0)
+            : kind(k), flipped(false), seg(CODE), pos(0), label(l), value(v), begin(0), end(0),
+              zpparam(0), zpopcode(0) { }
+    };
+
+    std::vector<Statement> statements;
+    std::vector<Param> params;
+    std::vector<expression::Node> nodes;
+
+    Listing(): statements(), params(), nodes() { }
+
+    void clear() { statements.clear(); params.clear(); nodes.clear(); }
+};
+
+#endif
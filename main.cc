@@ -1,6 +1,11 @@
 #include <cstdio>
+#include <cstdlib>
 #include <vector>
 #include <string>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 #include <unistd.h> // For unlink
 
@@ -10,9 +15,6 @@
 
 #include <getopt.h>
 
-bool already_reprocessed = true; // affects jump length counting
-bool assembly_errors = false;
-
 namespace
 {
     enum OutputFormat
@@ -32,14 +34,133 @@ namespace
             std::fprintf(stderr, "Error: Unknown output format `%s'\n", s.c_str());
         }
     }
+
+    const char* GetOutputExtension()
+    {
+        switch(format)
+        {
+            case IPSformat: return ".ips";
+            case RAWformat: return ".raw";
+            case O65format: break;
+        }
+        return ".o65";
+    }
+
+    /* Returns stdin for "-", or NULL if the file can't be opened. */
+    std::FILE* OpenInput(const std::string& filename)
+    {
+        if(filename == "-" || filename.empty()) return stdin;
+
+        std::FILE *fp = std::fopen(filename.c_str(), "rt");
+        if(!fp) std::perror(filename.c_str());
+        return fp;
+    }
+
+    /* The name messages use for the input. */
+    std::string InputName(const std::string& filename)
+    {
+        if(filename == "-" || filename.empty()) return "<stdin>";
+        return filename;
+    }
+
+    /* Assembles the files into obj.
+     * Returns false if there is nothing to be written.
+     */
+    bool AssembleFiles(const std::vector<std::string>& files, Object& obj)
+    {
+        for(unsigned a=0; a<files.size(); ++a)
+        {
+            std::FILE *fp = OpenInput(files[a]);
+            if(!fp)
+            {
+                obj.SetError();
+                continue;
+            }
+
+            PrecompileAndAssemble(fp, obj, InputName(files[a]));
+
+            if(fp != stdin)
+                std::fclose(fp);
+        }
+
+        if(obj.Error()) return false;
+
+        obj.CloseSegments();
+
+        // Each round fixes more jumps and operands, until nothing changes.
+        while(!obj.Error() && Reassemble(obj))
+            obj.CloseSegments();
+
+        return true;
+    }
+
+    void WriteObject(Object& obj, OutputBuffer& out)
+    {
+        switch(format)
+        {
+            case IPSformat:
+                obj.WriteIPS(out);
+                break;
+            case O65format:
+                obj.WriteO65(out);
+                break;
+            case RAWformat:
+                obj.WriteRAW(out);
+                break;
+        }
+    }
+
+    std::mutex DumpLock;
+
+    /* Batch mode: the object file in outdir for the given source. */
+    std::string OutputName(const std::string& filename, const std::string& outdir)
+    {
+        std::string outfn = filename.substr(filename.rfind('/') + 1);
+        outfn = outfn.substr(0, outfn.rfind('.')) + GetOutputExtension();
+        if(outdir[outdir.size()-1] != '/') outfn = '/' + outfn;
+        return outdir + outfn;
+    }
+
+    /* Batch mode: each file becomes an object of its own in outdir. */
+    bool AssembleToDir(const std::string& filename, const std::string& outdir,
+                       bool fix_jumps, bool fix_zeropage)
+    {
+        Object obj;
+        obj.SetFixJumps(fix_jumps);
+        obj.SetFixZeroPage(fix_zeropage);
+
+        const std::string outfn = OutputName(filename, outdir);
+
+        if(AssembleFiles({filename}, obj))
+        {
+            OutputBuffer out;
+            WriteObject(obj, out);
+
+            if(!obj.Error() && !out.WriteFile(outfn))
+                obj.SetError();
+
+            std::lock_guard<std::mutex> lock(DumpLock);
+            obj.Dump();
+        }
+
+        // Don't leave an object from an earlier build behind
+        if(obj.Error())
+            unlink(outfn.c_str());
+
+        return !obj.Error();
+    }
 }
 
 int main(int argc, char**argv)
 {
     bool assemble = true;
+    bool fix_jumps = false;
+    bool fix_zeropage = false;
+    bool fork_method = false;
+    unsigned jobs = 1;
+    std::string outdir;
     std::vector<std::string> files;
 
-    std::FILE *output = NULL;
     std::string outfn;
 
     for(;;)
@@ -53,13 +174,16 @@ int main(int argc, char**argv)
             {"preprocess",0,0,'E'},
             {"compile",   0,0,'c'},
             {"jumps",     0,0,'J'},
-            {"submethod", 0,0,501},
+            {"zeropage",  0,0,'Z'},
+            {"submethod", 1,0,501},
+            {"jobs",      1,0,'j'},
+            {"outdir",    1,0,502},
             {"outformat", 0,0,'f'},
             {"out_ips",   0,0,'I'},
             {"warn",      0,0,'W'},
             {0,0,0,0}
         };
-        int c = getopt_long(argc,argv, "hVo:EcJf:IW:", long_options, &option_index);
+        int c = getopt_long(argc,argv, "hVo:EcJZj:f:IW:", long_options, &option_index);
         if(c==-1) break;
         switch(c)
         {
@@ -77,23 +201,45 @@ int main(int argc, char**argv)
                 fix_jumps = true;
                 break;
             }
+            case 'Z':
+            {
+                fix_zeropage = true;
+                break;
+            }
             case 501: //submethod
             {
                 const std::string method = optarg;
-                if(method == "temp" || method == "temps")
+                fork_method = false;
+                if(method == "builtin" || method == "internal")
+                    UseBuiltin();
+                else if(method == "temp" || method == "temps")
                     UseTemps();
                 else if(method == "thread" || method == "threads")
                     UseThreads();
                 else if(method == "pipe" || method == "pipes"
                      || method == "fork" || method == "forks")
+                {
                     UseFork();
+                    fork_method = true;
+                }
                 else
                 {
-                    std::fprintf(stderr, "Error: --method requires 'pipe', 'thread' or 'temp'\n");
+                    std::fprintf(stderr, "Error: --submethod requires 'builtin', 'pipe', 'thread' or 'temp'\n");
                     return -1;
                 }
                 break;
             }
+            case 'j':
+            {
+                jobs = std::strtol(optarg, 0, 10);
+                if(jobs < 1) jobs = 1;
+                break;
+            }
+            case 502: //outdir
+            {
+                outdir = optarg;
+                break;
+            }
 
             case 'I': SetOutputFormat("ips"); break;
 
@@ -110,8 +256,12 @@ int main(int argc, char**argv)
                     " -E                    Preprocess only\n"
                     " -c                    Ignored for gcc-compatibility\n"
                     " --jumps, -J           Automatically correct short jumps\n"
+                    " --zeropage, -Z        Use zero page addressing for labels defined later\n"
                     " --version             Displays version information\n"
-                    " --submethod <method>  Select subprocess method: temp,thread,pipe\n"
+                    " --submethod <method>  Select preprocessing method: thread,builtin,temp,pipe\n"
+                    "                         (default: thread; temp and pipe run gcc -E)\n"
+                    " --outdir <dir>        Assemble each file into an object of its own in <dir>\n"
+                    " -j, --jobs <n>        With --outdir, assemble up to <n> files at a time\n"
                     " -f, --outformat <fmt> Select output format: ips,raw,o65 (default: o65)\n"
                     "                         -I is short for -fips\n"
                     " -W <type>             Enable warnings\n"
@@ -123,20 +273,9 @@ int main(int argc, char**argv)
                 break;
             case 'o':
             {
+                // The file is written only once everything is done
                 outfn = optarg;
-                if(outfn != "-")
-                {
-                    if(output)
-                    {
-                        std::fclose(output);
-                    }
-                    output = std::fopen(outfn.c_str(), "wb");
-                    if(!output)
-                    {
-                        std::perror(outfn.c_str());
-                        goto ErrorExit;
-                    }
-                }
+                if(outfn == "-") outfn.clear();
                 break;
             }
             case 'f':
@@ -161,101 +300,106 @@ int main(int argc, char**argv)
     {
         std::fprintf(stderr, "Error: Assemble what? See %s --help\n", argv[0]);
     ErrorExit:
-        if(output)
-        {
-            std::fclose(output);
-            std::remove(outfn.c_str());
-        }
         return -1;
     }
 
-    Object obj;
-
-    /*
-     *   TODO:
-     *        - Read input
-     *        - Write object
-     *        - Verbose errors
-     *        - Verbose errors
-     *        - Verbose errors
-     *        - Verbose errors
-     *        - Verbose errors
-     */
-
-Reprocess:
-    obj.ClearMost();
-
-    for(unsigned a=0; a<files.size(); ++a)
+    if(!outdir.empty())
     {
-        std::FILE *fp = NULL;
-
-        const std::string& filename = files[a];
-        if(filename != "-" && !filename.empty())
+        if(!outfn.empty() || !assemble)
         {
-            fp = std::fopen(filename.c_str(), "rt");
-            if(!fp)
+            std::fprintf(stderr, "Error: --outdir can't be used with -o or -E\n");
+            goto ErrorExit;
+        }
+        for(unsigned a=0; a<files.size(); ++a)
+            if(files[a] == "-" || files[a].empty())
             {
-                std::perror(filename.c_str());
-                continue;
+                std::fprintf(stderr, "Error: --outdir can't be used with stdin-input!\n");
+                goto ErrorExit;
             }
-        }
-        else
+
+        // Two sources with the same name would overwrite each other's object.
+        std::map<std::string, unsigned> outputs;
+        for(unsigned a=0; a<files.size(); ++a)
         {
-            if(fix_jumps)
+            auto i = outputs.emplace(OutputName(files[a], outdir), a);
+            if(!i.second)
             {
-                std::fprintf(stderr, "Error: --jumps can't be used with stdin-input!\n");
-                assembly_errors=true;
+                std::fprintf(stderr, "Error: %s and %s would both be assembled into %s\n",
+                    files[i.first->second].c_str(), files[a].c_str(), i.first->first.c_str());
+                goto ErrorExit;
             }
         }
 
-        if(assemble)
-            PrecompileAndAssemble(fp ? fp : stdin, obj);
-        else
-            Precompile(fp ? fp : stdin, output ? output : stdout);
+        if(jobs > 1 && fork_method)
+        {
+            // Forking from a process that runs threads isn't safe.
+            std::fprintf(stderr, "Warning: --submethod pipe can't be used with -j, using temp instead\n");
+            UseTemps();
+        }
+        if(jobs > files.size()) jobs = files.size();
+
+        std::atomic<unsigned> next(0);
+        std::atomic<bool> errors(false);
+        auto worker = [&]()
+        {
+            for(unsigned a; (a = next++) < files.size(); )
+                if(!AssembleToDir(files[a], outdir, fix_jumps, fix_zeropage))
+                    errors = true;
+        };
 
-        if(fp)
-            std::fclose(fp);
+        std::vector<std::thread> workers;
+        for(unsigned a=1; a<jobs; ++a)
+            workers.emplace_back(worker);
+        worker();
+        for(auto& t: workers)
+            t.join();
+
+        return errors ? 1 : 0;
     }
 
-    if(assemble && !assembly_errors)
+    if(!assemble)
     {
-        obj.CloseSegments();
-
-        if(obj.NeedsFlipping())
+        std::FILE *output = outfn.empty() ? stdout : std::fopen(outfn.c_str(), "wb");
+        if(!output)
         {
-            if(already_reprocessed)
-            {
-                std::fprintf(stderr, "Error: Three-pass jump fixing not supported, sorry\n");
-                assembly_errors = true;
-                goto ErrorExit;
-            }
-            already_reprocessed = true;
-            goto Reprocess;
+            std::perror(outfn.c_str());
+            return -1;
         }
+        for(unsigned a=0; a<files.size(); ++a)
+        {
+            std::FILE *fp = OpenInput(files[a]);
+            if(!fp) continue;
 
-        std::FILE* stream = output ? output : stdout;
+            Precompile(fp, output, InputName(files[a]));
 
-        switch(format)
-        {
-            case IPSformat:
-                obj.WriteIPS(stream);
-                break;
-            case O65format:
-                obj.WriteO65(stream);
-                break;
-            case RAWformat:
-                obj.WriteRAW(stream);
-                break;
+            if(fp != stdin)
+                std::fclose(fp);
         }
-        obj.Dump();
+        if(output != stdout) std::fclose(output);
+        return 0;
     }
 
-    if(output) std::fclose(output);
-
-    if(assembly_errors && !outfn.empty())
     {
-        unlink(outfn.c_str());
-    }
+        Object obj;
+        obj.SetFixJumps(fix_jumps);
+        obj.SetFixZeroPage(fix_zeropage);
 
-    return assembly_errors ? 1 : 0;
+        if(AssembleFiles(files, obj))
+        {
+            OutputBuffer out;
+            WriteObject(obj, out);
+            if(outfn.empty())
+                out.WriteTo(stdout);
+            else if(!obj.Error() && !out.WriteFile(outfn))
+                obj.SetError();
+            obj.Dump();
+        }
+
+        if(obj.Error() && !outfn.empty())
+        {
+            unlink(outfn.c_str());
+        }
+
+        return obj.Error() ? 1 : 0;
+    }
 }
@@ -0,0 +1,44 @@
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mapfile.hh"
+
+MappedFile::MappedFile(std::FILE* fp)
+    : begin(""), length(0), map(nullptr), maplength(0), buffer()
+{
+    if(!fp) return;
+
+#ifndef WIN32
+    struct stat st;
+    long offset = std::ftell(fp);
+    if(offset >= 0 && fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode)
+    && st.st_size > offset)
+    {
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if(p != MAP_FAILED)
+        {
+            map       = p;
+            maplength = st.st_size;
+            begin     = static_cast<const char*>(p) + offset;
+            length    = maplength - offset;
+            std::fseek(fp, 0, SEEK_END);
+            return;
+        }
+    }
+#endif
+
+    char Buf[65536];
+    for(std::size_t n; (n = std::fread(Buf, 1, sizeof Buf, fp)) > 0; )
+        buffer.append(Buf, n);
+    begin  = buffer.data();
+    length = buffer.size();
+}
+
+MappedFile::~MappedFile()
+{
+#ifndef WIN32
+    if(map) munmap(map, maplength);
+#endif
+}
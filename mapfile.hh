@@ -0,0 +1,36 @@
+#ifndef bqt65asmMapFileHH
+#define bqt65asmMapFileHH
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+/* The rest of a file, from its current position onwards.
+ * A regular file is memory-mapped; anything else (a pipe, stdin)
+ * is read into memory. Either way, the file is left at its end.
+ */
+class MappedFile
+{
+public:
+    explicit MappedFile(std::FILE* fp);
+    ~MappedFile();
+
+    const char* data() const { return begin; }
+    std::size_t size() const { return length; }
+    std::string_view View() const { return std::string_view(begin, length); }
+
+private:
+    const char* begin;
+    std::size_t length;
+
+    void* map;            // The mapping, if mapped
+    std::size_t maplength;
+    std::string buffer;   // The contents, if not mapped
+
+private:
+    // Copying prohibited
+    MappedFile(const MappedFile&) = delete;
+    const MappedFile& operator= (const MappedFile&) = delete;
+};
+
+#endif
@@ -12,8 +12,12 @@
 #include <map>
 #include <set>
 #include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
 
 #include "o65.hh"
+#include "mapfile.hh"
 
 using std::fprintf;
 #ifndef stderr
@@ -24,109 +28,181 @@ using std::stderr;
 
 namespace
 {
-    unsigned LoadWord(FILE *fp)
+    /* Reads a file that has been loaded into memory.
+     * Reading past the end gives EOF, as with stdio.
+     */
+    class Reader
     {
-        unsigned temp = fgetc(fp);
+    public:
+        Reader(const char* data, std::size_t size)
+            : begin((const unsigned char*)data), pos(begin), end(begin + size) { }
+
+        int Get() { return pos < end ? *pos++ : EOF; }
+        const unsigned char* Take(std::size_t n)
+        {
+            const unsigned char* result = pos;
+            Skip(n);
+            return result;
+        }
+        void Skip(std::size_t n) { pos += std::min(n, Left()); }
+
+        void Seek(std::size_t offs) { pos = begin + std::min(offs, Size()); }
+        std::size_t Tell() const { return pos - begin; }
+        std::size_t Size() const { return end - begin; }
+        std::size_t Left() const { return end - pos; }
+
+    private:
+        const unsigned char *begin, *pos, *end;
+    };
+
+    unsigned LoadWord(Reader& in)
+    {
+        unsigned temp = in.Get();
         if(temp == (unsigned)EOF)return temp;
-        return temp | (fgetc(fp) << 8);
+        unsigned temp2 = in.Get();
+        if(temp2 == (unsigned)EOF)return temp2;
+        return temp | (temp2 << 8);
     }
-    unsigned LoadDWord(FILE *fp)
+    unsigned LoadDWord(Reader& in)
     {
-        unsigned temp = LoadWord(fp);
+        unsigned temp = LoadWord(in);
         if(temp == (unsigned)EOF) return temp;
-        unsigned temp2 = LoadWord(fp);
+        unsigned temp2 = LoadWord(in);
         if(temp2 == (unsigned)EOF) return temp2;
         return temp | (temp2 << 16);
     }
-    unsigned LoadSWord(FILE *fp, bool use32=false)
+    unsigned LoadSWord(Reader& in, bool use32=false)
     {
-        return use32 ? LoadDWord(fp) : LoadWord(fp);
+        return use32 ? LoadDWord(in) : LoadWord(in);
     }
-    unsigned long LoadVar(FILE* fp) // cc65
+    unsigned long LoadVar(Reader& in) // cc65
     {
         unsigned long V=0, Shift=0, C;
-        do V |= ((unsigned long)(C = std::fgetc(fp)) & 0x7F) << (Shift++)*7; while(C & 0x80);
+        do V |= ((unsigned long)(C = in.Get()) & 0x7F) << (Shift++)*7; while(C & 0x80);
         return V;
     }
-    long LoadSDWord(FILE *fp) { return (int)LoadSWord(fp,true); }
-    std::string LoadRaw(FILE* fp, std::size_t size)
+    long LoadSDWord(Reader& in) { return (int)LoadSWord(in,true); }
+    std::string LoadRaw(Reader& in, std::size_t size)
     {
-        std::string data(size, '\0');
-        for(std::size_t a=0; a<size; ++a) data[a] = fgetc(fp);
-        return data;
+        size = std::min(size, in.Left());
+        return std::string((const char*)in.Take(size), size);
     }
-    std::string LoadZString(FILE* fp)
+    std::string LoadZString(Reader& in)
     {
         std::string varname;
-        while(int c = fgetc(fp)) { if(c==EOF)break; varname += (char) c; }
+        while(int c = in.Get()) { if(c==EOF)break; varname += (char) c; }
         return varname;
     }
-    void LoadRawTo(FILE* fp, std::size_t size, unsigned char* target)
+    void LoadRawTo(Reader& in, std::size_t size, unsigned char* target)
     {
-        std::fread(target, size, 1, fp);
+        size = std::min(size, in.Left());
+        std::copy_n(in.Take(size), size, target);
     }
 }
 
+namespace
+{
+    /* How far each segment is being moved, by SegmentSelection */
+    struct SegmentMoves
+    {
+        unsigned diff[6];
+
+        unsigned Get(unsigned seg) const { return seg < 6 ? diff[seg] : 0; }
+    };
+}
+
+/* The symbols that an object refers to, by symbol number */
 class O65::Defs
 {
-    std::map<std::string, unsigned> symno;
-    std::map<unsigned, std::string> nosym;
-    std::set<unsigned> undefines;
-    std::map<unsigned, unsigned> defines;
+    struct Symbol
+    {
+        SymbolId name;
+        bool     defined;
+        unsigned value;
+    };
+    std::vector<Symbol> symbols;
+    std::unordered_map<SymbolId, unsigned> symno;
+
+    // One bit for each symbol that is still undefined
+    std::vector<std::uint64_t> undefines;
+    unsigned num_undefined;
 public:
-    Defs(): symno(), nosym(), undefines(), defines()
+    Defs(): symbols(), symno(), undefines(), num_undefined(0)
     {
     }
 
-    unsigned AddUndefined(const std::string& name)
+    unsigned AddUndefined(SymbolId name)
     {
-        unsigned a = symno.size();
-        undefines.insert(a);
+        unsigned a = symbols.size();
+        symbols.push_back(Symbol{name, false, 0});
         symno[name] = a;
-        nosym[a] = name;
+        if(a % 64 == 0) undefines.push_back(0);
+        undefines[a / 64] |= std::uint64_t(1) << (a % 64);
+        ++num_undefined;
         return a;
     }
-    unsigned GetSymno(const std::string& name) const
+    unsigned GetSymno(SymbolId name) const
     {
-        std::map<std::string, unsigned>::const_iterator i = symno.find(name);
+        std::unordered_map<SymbolId, unsigned>::const_iterator i = symno.find(name);
         if(i == symno.end()) return ~0U;
         return i->second;
     }
     bool IsDefined(unsigned a) const
     {
-        return defines.find(a) != defines.end();
+        return symbols[a].defined;
     }
     unsigned GetValue(unsigned a) const
     {
-        return defines.find(a)->second;
+        return symbols[a].value;
     }
     void Define(unsigned a, unsigned value)
     {
-        undefines.erase(a);
-        defines[a] = value;
-    }
-    const std::vector<std::string> GetExternList() const
-    {
-        std::vector<std::string> result;
-        result.reserve(undefines.size());
-        for(std::set<unsigned>::const_iterator
-            i = undefines.begin(); i != undefines.end(); ++i)
+        if(!symbols[a].defined)
         {
-            const std::string& name = nosym.find(*i)->second;
-            result.push_back(name);
+            undefines[a / 64] &= ~(std::uint64_t(1) << (a % 64));
+            --num_undefined;
         }
+        symbols[a].defined = true;
+        symbols[a].value   = value;
+    }
+    unsigned CountUndefined() const
+    {
+        return num_undefined;
+    }
+
+    /* Calls func(symno) for each undefined symbol, in symno order */
+    template<typename F>
+    void ForEachUndefined(F&& func) const
+    {
+        for(unsigned word = 0; word < undefines.size(); ++word)
+            for(std::uint64_t bits = undefines[word]; bits; bits &= bits - 1)
+            {
+#ifdef __GNUC__
+                const unsigned bit = __builtin_ctzll(bits);
+#else
+                unsigned bit = 0;
+                while(!(bits >> bit & 1)) ++bit;
+#endif
+                func(word * 64 + bit);
+            }
+    }
+
+    const std::vector<SymbolId> GetExternList() const
+    {
+        std::vector<SymbolId> result;
+        result.reserve(num_undefined);
+        ForEachUndefined([&](unsigned a) { result.push_back(symbols[a].name); });
         return result;
     }
     void DumpUndefines() const
     {
-        for(std::set<unsigned>::const_iterator
-            i = undefines.begin(); i != undefines.end(); ++i)
+        ForEachUndefined([&](unsigned a)
         {
-            const std::string& name = nosym.find(*i)->second;
+            const std::string& name = SymbolName(symbols[a].name);
 
             fprintf(stderr, "Symbol %s is still not defined\n",
                 name.c_str());
-        }
+        });
     }
 };
 
@@ -139,20 +215,38 @@ public:
     unsigned base;
 
     //! absolute addresses of all publics
-    typedef std::map<std::string, unsigned> publicmap_t;
+    typedef std::unordered_map<SymbolId, unsigned> publicmap_t;
     publicmap_t publics;
 
 public:
     typedef Relocdata<unsigned> RT; RT R;
+
+private:
+    /* The relocations of R, sorted by symbol number and then by
+     * address, so that LocateSym only visits those of its symbol.
+     * Rebuilt when relocations have been added since.
+     */
+    enum RelocKind { R16, R16lo, R16hi, R24, R24seg };
+    struct SymReloc
+    {
+        unsigned  symno;
+        RelocKind kind;
+        unsigned  index; // In that list of R
+    };
+    std::vector<SymReloc> symrelocs;
+    std::size_t indexed_relocs;
 public:
-    Segment(): space(), base(0), publics(), R()
+    Segment(): space(), base(0), publics(), R(), symrelocs(), indexed_relocs(0)
     {
     }
 private:
     friend class O65;
-    void Locate(SegmentSelection seg, unsigned diff, bool is_me);
+    void Locate(const SegmentMoves& moves, SegmentSelection me);
     void LocateSym(unsigned symno, unsigned newaddress);
-    void LoadRelocations(FILE* fp);
+    void LoadRelocations(Reader& in);
+
+    unsigned RelocAddress(RelocKind kind, unsigned index) const;
+    void IndexRelocations();
 };
 
 O65::O65()
@@ -175,30 +269,36 @@ O65::~O65()
     delete defs;
 }
 
-O65::O65(const O65& b)
-    : customheaders(),
-      defs(new Defs(*b.defs)),
-      code(b.code ? new Segment(*b.code) : NULL),
-      data(b.data ? new Segment(*b.data) : NULL),
-      zero(b.zero ? new Segment(*b.zero) : NULL),
-      bss(b.bss ? new Segment(*b.bss) : NULL),
+O65::O65(O65&& b) noexcept
+    : customheaders(std::move(b.customheaders)),
+      defs(b.defs),
+      code(b.code),
+      data(b.data),
+      zero(b.zero),
+      bss(b.bss),
       error(b.error)
 {
+    b.defs = NULL;
+    b.code = b.data = b.zero = b.bss = NULL;
 }
-const O65& O65::operator= (const O65& b)
+O65& O65::operator= (O65&& b) noexcept
 {
-    if(&b == this) return *this;
-    delete code; code = b.code ? new Segment(*b.code) : NULL;
-    delete data; data = b.data ? new Segment(*b.data) : NULL;
-    delete zero; zero = b.zero ? new Segment(*b.zero) : NULL;
-    delete bss; bss = b.bss ? new Segment(*b.bss) : NULL;
-    delete defs; defs = new Defs(*b.defs);
+    // The old contents of this object are deleted along with b.
+    std::swap(customheaders, b.customheaders);
+    std::swap(defs, b.defs);
+    std::swap(code, b.code);
+    std::swap(data, b.data);
+    std::swap(zero, b.zero);
+    std::swap(bss,  b.bss);
+    std::swap(error, b.error);
     return *this;
 }
 
 void O65::Load(FILE* fp)
 {
     rewind(fp);
+    MappedFile file(fp);
+    Reader in(file.data(), file.size());
 
     if(this->code) delete this->code;
     if(this->data) delete this->data;
@@ -210,34 +310,41 @@ void O65::Load(FILE* fp)
     this->bss = new Segment;
 
     // Read header
-    switch(LoadDWord(fp))
+    switch(LoadDWord(in))
     {
         case 0x616E7A55: // cc65 object file
         {
-            LoadWord(fp); // version
-            unsigned flags = LoadWord(fp);
-            unsigned OptionOffs   = LoadDWord(fp);
-            /*unsigned OptionSize=*/LoadDWord(fp);
-            unsigned FileOffs     = LoadDWord(fp);
-            /*unsigned FileSize=*/  LoadDWord(fp);
-            unsigned SegOffs      = LoadDWord(fp);
-            /*unsigned SegSize=*/   LoadDWord(fp);
-            unsigned ImportOffs   = LoadDWord(fp);
-            /*unsigned ImportSize=*/LoadDWord(fp);
-            unsigned ExportOffs   = LoadDWord(fp);
-            /*unsigned ExportSize=*/LoadDWord(fp);
-            unsigned DbgSymOffs   = LoadDWord(fp);
-            /*unsigned DbgSymSize=*/LoadDWord(fp);
-            unsigned LineInfoOffs = LoadDWord(fp);
-            /*unsigned LineInfoSize=*/LoadDWord(fp);
-            unsigned StrPoolOffs  = LoadDWord(fp);
-            /*unsigned StrPoolSize=*/LoadDWord(fp);
-            unsigned AssertOffs   = LoadDWord(fp);
-            /*unsigned AssertSize=*/LoadDWord(fp);
-            unsigned ScopeOffs    = LoadDWord(fp);
-            /*unsigned ScopeSize=*/ LoadDWord(fp);
-            unsigned SpanOffs     = LoadDWord(fp);
-            /*unsigned SpanSize=*/  LoadDWord(fp);
+            LoadWord(in); // version
+            unsigned flags = LoadWord(in);
+            unsigned OptionOffs   = LoadDWord(in);
+            /*unsigned OptionSize=*/LoadDWord(in);
+            unsigned FileOffs     = LoadDWord(in);
+            /*unsigned FileSize=*/  LoadDWord(in);
+            unsigned SegOffs      = LoadDWord(in);
+            /*unsigned SegSize=*/   LoadDWord(in);
+            unsigned ImportOffs   = LoadDWord(in);
+            /*unsigned ImportSize=*/LoadDWord(in);
+            unsigned ExportOffs   = LoadDWord(in);
+            /*unsigned ExportSize=*/LoadDWord(in);
+            unsigned DbgSymOffs   = LoadDWord(in);
+            /*unsigned DbgSymSize=*/LoadDWord(in);
+            unsigned LineInfoOffs = LoadDWord(in);
+            /*unsigned LineInfoSize=*/LoadDWord(in);
+            unsigned StrPoolOffs  = LoadDWord(in);
+            /*unsigned StrPoolSize=*/LoadDWord(in);
+            unsigned AssertOffs   = LoadDWord(in);
+            /*unsigned AssertSize=*/LoadDWord(in);
+            unsigned ScopeOffs    = LoadDWord(in);
+            /*unsigned ScopeSize=*/ LoadDWord(in);
+            unsigned SpanOffs     = LoadDWord(in);
+            /*unsigned SpanSize=*/  LoadDWord(in);
+
+            if(std::max({SegOffs, ImportOffs, ExportOffs, DbgSymOffs, StrPoolOffs}) >= in.Size())
+            {
+                fprintf(stderr, "O65: The cc65 object file is truncated\n");
+                SetError();
+                break;
+            }
 
             enum exprtype : unsigned char {
                EXPR_NULL=0, EXPR_LITERAL=0x81, EXPR_SYMBOL=0x82, EXPR_SECTION=0x83, EXPR_BANK=0x87,
@@ -257,14 +364,14 @@ void O65::Load(FILE* fp)
                 long ival=0;       // literal signed value
                 unsigned index=0;  // Reference to imports[] or reference to sections[]
                 std::unique_ptr<ExprNode> left, right;
-                void Load(FILE* fp)
+                void Load(Reader& in)
                 {
-                    op = (exprtype) std::fgetc(fp); if(op == EXPR_NULL) return; // null node
-                    if(op == EXPR_LITERAL)     ival = LoadSDWord(fp);
-                    else if(op == EXPR_SYMBOL) index  = LoadVar(fp); // References imports[]
-                    else if(op == EXPR_SECTION || op == EXPR_BANK) { index = LoadVar(fp); } // References sections[]
-                    else if(!(op & 0x80)) { left = std::make_unique<ExprNode>(); left->Load(fp);
-                                            right = std::make_unique<ExprNode>(); right->Load(fp); }
+                    op = (exprtype) in.Get(); if(op == EXPR_NULL) return; // null node
+                    if(op == EXPR_LITERAL)     ival = LoadSDWord(in);
+                    else if(op == EXPR_SYMBOL) index  = LoadVar(in); // References imports[]
+                    else if(op == EXPR_SECTION || op == EXPR_BANK) { index = LoadVar(in); } // References sections[]
+                    else if(!(op & 0x80)) { left = std::make_unique<ExprNode>(); left->Load(in);
+                                            right = std::make_unique<ExprNode>(); right->Load(in); }
                 }
                 std::string Dump() const
                 {
@@ -339,7 +446,7 @@ void O65::Load(FILE* fp)
                     ExprNode      expr;
                 };
                 std::vector<Section>     sections;
-                std::vector<std::string> imports;
+                std::vector<SymbolId>    imports;
                 std::vector<Public>      publics;
             } context;
             struct ParsedExpr
@@ -383,59 +490,59 @@ void O65::Load(FILE* fp)
 
             // Load string pool
             std::vector<std::string> str;
-            std::fseek(fp, StrPoolOffs, SEEK_SET);
-            for(unsigned count=LoadVar(fp); count--; str.emplace_back(LoadRaw(fp,LoadVar(fp)))) {}
+            in.Seek(StrPoolOffs);
+            for(unsigned count=LoadVar(in); count--; str.emplace_back(LoadRaw(in,LoadVar(in)))) {}
             // Load externs (imports)
-            std::fseek(fp, ImportOffs, SEEK_SET);
-            for(unsigned count=LoadVar(fp); count--; )
+            in.Seek(ImportOffs);
+            for(unsigned count=LoadVar(in); count--; )
             {
-                /*unsigned char AddrSize =*/ std::fgetc(fp); // unused. 1 means zp, 2 absolute
-                const auto&   name     = str[LoadVar(fp)];
-                for(unsigned c=LoadVar(fp); c--; LoadVar(fp)); // Skip line info list 1
-                for(unsigned c=LoadVar(fp); c--; LoadVar(fp)); // Skip line info list 2
+                /*unsigned char AddrSize =*/ in.Get(); // unused. 1 means zp, 2 absolute
+                SymbolId      name     = InternSymbol(str[LoadVar(in)]);
+                for(unsigned c=LoadVar(in); c--; LoadVar(in)); // Skip line info list 1
+                for(unsigned c=LoadVar(in); c--; LoadVar(in)); // Skip line info list 2
                 context.imports.push_back(name);
                 defs->AddUndefined(name);
             }
             // Load debug symbols
             //if(flags & 1) // OBJ_FLAGS_DBGINFO
             {
-                std::fseek(fp, DbgSymOffs, SEEK_SET);
-                for(unsigned count=LoadVar(fp); count--; )
+                in.Seek(DbgSymOffs);
+                for(unsigned count=LoadVar(in); count--; )
                 {
                     Context::Public pub;
                     pub.debug = true;
-                    pub.sym_type           = LoadVar(fp);
-                    pub.AddrSize           = std::fgetc(fp);
-                    /*unsigned long owner =*/ LoadVar(fp);
-                    pub.name               = str[LoadVar(fp)];
+                    pub.sym_type           = LoadVar(in);
+                    pub.AddrSize           = in.Get();
+                    /*unsigned long owner =*/ LoadVar(in);
+                    pub.name               = str[LoadVar(in)];
                     if(pub.sym_type & 0x10)
                     {
-                        pub.expr.Load(fp);
+                        pub.expr.Load(in);
                     }
                     else
                     {
                         pub.expr.op   = EXPR_LITERAL;
-                        pub.expr.ival = LoadDWord(fp);
+                        pub.expr.ival = LoadDWord(in);
                     }
-                    if(pub.sym_type & 0x08) pub.size = LoadVar(fp); // Load size if available
-                    if(pub.sym_type & 0x100) pub.ImportId = LoadVar(fp);
-                    if(pub.sym_type &  0x80) pub.ExportId = LoadVar(fp);
-                    for(unsigned c=LoadVar(fp); c--; LoadVar(fp)); // Skip line info list 1
-                    for(unsigned c=LoadVar(fp); c--; LoadVar(fp)); // Skip line info list 2
+                    if(pub.sym_type & 0x08) pub.size = LoadVar(in); // Load size if available
+                    if(pub.sym_type & 0x100) pub.ImportId = LoadVar(in);
+                    if(pub.sym_type &  0x80) pub.ExportId = LoadVar(in);
+                    for(unsigned c=LoadVar(in); c--; LoadVar(in)); // Skip line info list 1
+                    for(unsigned c=LoadVar(in); c--; LoadVar(in)); // Skip line info list 2
                     context.publics.push_back(std::move(pub));
                 }
             }
             // Load segments
-            std::fseek(fp, SegOffs, SEEK_SET);
-            for(unsigned count=LoadVar(fp); count--; )
+            in.Seek(SegOffs);
+            for(unsigned count=LoadVar(in); count--; )
             {
-                unsigned long DataSize = LoadDWord(fp);
-                unsigned long NextSeg  = std::ftell(fp) + DataSize;
-                std::string SegmentName = str[LoadVar(fp)];
-                unsigned      Flags    = LoadVar(fp);
-                /*unsigned long Size =*/ LoadVar(fp);
-                /*unsigned long Align =*/LoadVar(fp);
-                unsigned char AddrSize = std::fgetc(fp);
+                unsigned long DataSize = LoadDWord(in);
+                unsigned long NextSeg  = in.Tell() + DataSize;
+                std::string SegmentName = str[LoadVar(in)];
+                unsigned      Flags    = LoadVar(in);
+                /*unsigned long Size =*/ LoadVar(in);
+                /*unsigned long Align =*/LoadVar(in);
+                unsigned char AddrSize = in.Get();
 
                 SegmentSelection segsel = DATA;
                 if(Flags)
@@ -463,23 +570,29 @@ void O65::Load(FILE* fp)
                     unsigned(context.sections.size()), Size,Align,AddrSize,
                     SegmentName.c_str(),Flags,unsigned(segsel),seg_start);*/
                 unsigned frag_start = seg_start;
-                for(unsigned NumFrags = LoadVar(fp); NumFrags--; )
+                for(unsigned NumFrags = LoadVar(in); NumFrags--; )
                 {
-                    //std::fprintf(stderr, "Frag at filepos %X\n", std::ftell(fp));
-                    unsigned char FragType = std::fgetc(fp);
+                    //std::fprintf(stderr, "Frag at filepos %X\n", in.Tell());
+                    unsigned char FragType = in.Get();
                     unsigned char Bytes    = FragType & 7;
                     switch(FragType & 0x38)
                     {
                         case 0x00: // FRAG_LITERAL - Literal data
                         case 0x20: // FRAG_FILL  - Fill bytes
                         {
-                            unsigned Size = LoadVar(fp);
+                            unsigned Size = LoadVar(in);
                             //fprintf(stderr, "Fragment type $%02X bytes=%d at %04X\n", FragType,Size, frag_start);
 
+                            if((FragType & 0x38) == 0x00 && Size > in.Left())
+                            {
+                                fprintf(stderr, "Fragment size %u doesn't fit in the file\n", Size);
+                                SetError();
+                                Size = in.Left();
+                            }
                             seg->space.resize(frag_start + Size);
                             if((FragType & 0x38) == 0x00) // Don't read if FRAG_FILL
                             {
-                                LoadRawTo(fp, Size, &seg->space[frag_start]);
+                                LoadRawTo(in, Size, &seg->space[frag_start]);
                             }
                             frag_start += Size;
                             break;
@@ -488,7 +601,7 @@ void O65::Load(FILE* fp)
                         case 0x10: // FRAG_SEXPR - Signed expression
                         {
                             Context::Section::Expr ex;
-                            ex.expr.Load(fp);
+                            ex.expr.Load(in);
                             ex.pc    = frag_start;
                             ex.bytes = Bytes;
                             //fprintf(stderr, "Fragment type $%02X bytes=%d at %04X expr=%s\n", FragType,Bytes, frag_start, ex.expr.Dump().c_str());
@@ -501,34 +614,34 @@ void O65::Load(FILE* fp)
                         default:
                             fprintf(stderr, "Unknown fragment type $%02X\n", FragType&0x38);
                     }
-                    for(unsigned c=LoadVar(fp); c--; LoadVar(fp)); // Skip line info list
+                    for(unsigned c=LoadVar(in); c--; LoadVar(in)); // Skip line info list
                 }
                 context.sections.emplace_back(std::move(section));
-                std::fseek(fp, NextSeg, SEEK_SET);
+                in.Seek(NextSeg);
             }
             // Load publics (exports)
-            std::fseek(fp, ExportOffs, SEEK_SET);
-            for(unsigned count=LoadVar(fp); count--; )
+            in.Seek(ExportOffs);
+            for(unsigned count=LoadVar(in); count--; )
             {
                 Context::Public pub;
-                pub.sym_type           = LoadVar(fp);
-                pub.AddrSize           = std::fgetc(fp);
-                /*std::string Condes =*/ LoadRaw(fp, pub.sym_type&7);
-                pub.name               = str[LoadVar(fp)];
+                pub.sym_type           = LoadVar(in);
+                pub.AddrSize           = in.Get();
+                /*std::string Condes =*/ LoadRaw(in, pub.sym_type&7);
+                pub.name               = str[LoadVar(in)];
 
                 if(pub.sym_type & 0x10) // expression
                 {
-                    pub.expr.Load(fp);
+                    pub.expr.Load(in);
                 }
                 else // const
                 {
                     pub.expr.op   = EXPR_LITERAL;
-                    pub.expr.ival = LoadDWord(fp);
+                    pub.expr.ival = LoadDWord(in);
                 }
-                if(pub.sym_type & 0x08) pub.size = LoadVar(fp); // Load size if available
+                if(pub.sym_type & 0x08) pub.size = LoadVar(in); // Load size if available
 
-                for(unsigned c=LoadVar(fp); c--; LoadVar(fp)); // Skip line info list 1
-                for(unsigned c=LoadVar(fp); c--; LoadVar(fp)); // Skip line info list 2
+                for(unsigned c=LoadVar(in); c--; LoadVar(in)); // Skip line info list 1
+                for(unsigned c=LoadVar(in); c--; LoadVar(in)); // Skip line info list 2
                 context.publics.push_back(std::move(pub));
             }
 
@@ -546,7 +659,7 @@ void O65::Load(FILE* fp)
                     seg = context.sections[pars.secref].segsel;
                 }
                 // Constant value
-                DeclareGlobal(seg, pub.name, pars.val);
+                DeclareGlobal(seg, InternSymbol(pub.name), pars.val);
             }
             // Convert the expressions in sections into relocations
             for(auto& section: context.sections)
@@ -603,92 +716,110 @@ void O65::Load(FILE* fp)
         case 0x366F0001: // o65 file
         {
             // Skip rest of header
-            LoadWord(fp) /*== 0x3500*/;
+            LoadWord(in) /*== 0x3500*/;
             // Skip mode
-            unsigned mode = LoadWord(fp);
-
-            /* FIXME: No validity checks here */
+            unsigned mode = LoadWord(in);
 
             bool use32 = mode & 0x2000;
 
-            this->code->base = LoadSWord(fp, use32);
-            this->code->space.resize(LoadSWord(fp, use32));
+            // Four segments and the stack size
+            if(in.Left() < 9 * (use32 ? 4u : 2u))
+            {
+                fprintf(stderr, "O65: The header is truncated\n");
+                SetError();
+                break;
+            }
+
+            this->code->base = LoadSWord(in, use32);
+            unsigned code_len = LoadSWord(in, use32);
 
-            this->data->base = LoadSWord(fp, use32);
-            this->data->space.resize(LoadSWord(fp, use32));
+            this->data->base = LoadSWord(in, use32);
+            unsigned data_len = LoadSWord(in, use32);
 
-            this->bss->base = LoadSWord(fp, use32);
-            this->bss->space.resize(LoadSWord(fp, use32));
+            // The contents of text and data must be in the file
+            if(code_len > in.Left() || data_len > in.Left() - code_len)
+            {
+                fprintf(stderr, "O65: Segment sizes %X+%X don't fit in the file\n",
+                    code_len, data_len);
+                SetError();
+                break;
+            }
+            this->code->space.resize(code_len);
+            this->data->space.resize(data_len);
+
+            this->bss->base = LoadSWord(in, use32);
+            this->bss->space.resize(LoadSWord(in, use32));
 
-            this->zero->base = LoadSWord(fp, use32);
-            this->zero->space.resize(LoadSWord(fp, use32));
+            this->zero->base = LoadSWord(in, use32);
+            this->zero->space.resize(LoadSWord(in, use32));
 
-            LoadSWord(fp, use32); // Skip stack_len
+            LoadSWord(in, use32); // Skip stack_len
 
-            //fprintf(stderr, "@%X: stack len\n", ftell(fp));
+            //fprintf(stderr, "@%X: stack len\n", ftell(in));
 
             // Skip some headers
             for(;;)
             {
-                unsigned len = fgetc(fp);
+                unsigned len = in.Get();
                 if(!len || len == (unsigned)EOF)break;
 
                 len &= 0xFF;
 
-                unsigned char type = fgetc(fp);
+                unsigned char type = in.Get();
                 if(len >= 2) len -= 2; else len = 0;
 
-                std::string data = LoadRaw(fp, len);
+                std::string data = LoadRaw(in, len);
                 //fprintf(stderr, "Custom header %u: '%.*s'\n", type, len, data.data());
                 customheaders.emplace_back(type, data);
             }
 
-            LoadRawTo(fp, this->code->space.size(), &this->code->space[0]);
-            LoadRawTo(fp, this->data->space.size(), &this->data->space[0]);
+            LoadRawTo(in, this->code->space.size(), &this->code->space[0]);
+            LoadRawTo(in, this->data->space.size(), &this->data->space[0]);
             // zero and bss Segments don't exist in o65 format.
 
             // load external symbols
 
-            unsigned num_und = LoadSWord(fp, use32);
+            unsigned num_und = LoadSWord(in, use32);
 
-            //fprintf(stderr, "@%X: %u externs..\n", ftell(fp), num_und);
+            //fprintf(stderr, "@%X: %u externs..\n", ftell(in), num_und);
 
             for(unsigned a=0; a<num_und; ++a)
-                defs->AddUndefined( LoadZString(fp) );
+                defs->AddUndefined( InternSymbol(LoadZString(in)) );
 
-            //fprintf(stderr, "@%X: code relocs..\n", ftell(fp));
+            //fprintf(stderr, "@%X: code relocs..\n", ftell(in));
 
-            code->LoadRelocations(fp);
+            code->LoadRelocations(in);
 
-            //fprintf(stderr, "@%X: data relocs..\n", ftell(fp));
+            //fprintf(stderr, "@%X: data relocs..\n", ftell(in));
 
-            data->LoadRelocations(fp);
+            data->LoadRelocations(in);
             // relocations don't exist for zero/bss in o65 format.
 
-            unsigned num_global = LoadSWord(fp, use32);
+            unsigned num_global = LoadSWord(in, use32);
 
-            //fprintf(stderr, "@%X: %u globals\n", ftell(fp), num_global);
+            //fprintf(stderr, "@%X: %u globals\n", ftell(in), num_global);
 
             for(unsigned a=0; a<num_global; ++a)
             {
-                std::string varname = LoadZString(fp);
+                std::string varname = LoadZString(in);
 
-                SegmentSelection seg = (SegmentSelection)fgetc(fp);
+                SegmentSelection seg = (SegmentSelection)in.Get();
 
-                unsigned value = LoadSWord(fp, use32);
+                unsigned value = LoadSWord(in, use32);
 
-                DeclareGlobal(seg, varname, value);
+                DeclareGlobal(seg, InternSymbol(varname), value);
             }
 
             break;
         }
         default:
-            // TODO: Report invalid format
+            fprintf(stderr, "O65: Unknown object file format\n");
+            SetError();
             break;
     }
 }
 
-void O65::DeclareGlobal(SegmentSelection seg, const std::string& name, unsigned address)
+void O65::DeclareGlobal(SegmentSelection seg, SymbolId name, unsigned address)
 {
     if(Segment**s = GetSegRef(seg))
     {
@@ -701,12 +832,27 @@ void O65::Locate(SegmentSelection seg, unsigned newaddress)
     Segment**s = GetSegRef(seg);
     if(!s) return;
 
-    unsigned diff = newaddress - (*s)->base;
+    SegmentMoves moves = { };
+    moves.diff[seg] = newaddress - (*s)->base;
 
-    if(code) code->Locate(seg, diff, seg==CODE);
-    if(data) data->Locate(seg, diff, seg==DATA);
-    if(zero) zero->Locate(seg, diff, seg==ZERO);
-    if(bss)   bss->Locate(seg, diff, seg==BSS);
+    if(code) code->Locate(moves, CODE);
+    if(data) data->Locate(moves, DATA);
+    if(zero) zero->Locate(moves, ZERO);
+    if(bss)   bss->Locate(moves, BSS);
+}
+
+void O65::LocateAll(unsigned codeaddr, unsigned dataaddr, unsigned zeroaddr, unsigned bssaddr)
+{
+    SegmentMoves moves = { };
+    moves.diff[CODE] = codeaddr - (*GetSegRef(CODE))->base;
+    moves.diff[DATA] = dataaddr - (*GetSegRef(DATA))->base;
+    moves.diff[ZERO] = zeroaddr - (*GetSegRef(ZERO))->base;
+    moves.diff[BSS]  =  bssaddr - (*GetSegRef(BSS))->base;
+
+    code->Locate(moves, CODE);
+    data->Locate(moves, DATA);
+    zero->Locate(moves, ZERO);
+    bss->Locate(moves, BSS);
 }
 
 unsigned O65::GetBase(SegmentSelection seg) const
@@ -717,13 +863,13 @@ unsigned O65::GetBase(SegmentSelection seg) const
     return (*s)->base;
 }
 
-void O65::LinkSym(const std::string& name, unsigned value)
+void O65::LinkSym(SymbolId name, unsigned value)
 {
     unsigned symno = defs->GetSymno(name);
     if(symno == ~0U)
     {
         fprintf(stderr, "O65: Attempt to define unknown symbol '%s' as %X\n",
-            name.c_str(), value);
+            SymbolName(name).c_str(), value);
         return;
     }
     if(defs->IsDefined(symno))
@@ -731,7 +877,7 @@ void O65::LinkSym(const std::string& name, unsigned value)
         unsigned oldvalue = defs->GetValue(symno);
 
         fprintf(stderr, "O65: Attempt to redefine symbol '%s' as %X, old value %X\n",
-            name.c_str(),
+            SymbolName(name).c_str(),
             value,
             oldvalue
                );
@@ -744,22 +890,24 @@ void O65::LinkSym(const std::string& name, unsigned value)
     defs->Define(symno, value);
 }
 
-void O65::Segment::Locate(SegmentSelection seg, unsigned diff, bool is_me)
+void O65::Segment::Locate(const SegmentMoves& moves, SegmentSelection me)
 {
-    if(is_me)
+    const unsigned mydiff = moves.Get(me);
+    if(mydiff)
     {
         /* Relocate publics */
-        std::map<std::string, unsigned>::iterator i;
+        publicmap_t::iterator i;
         for(i = publics.begin(); i != publics.end(); ++i)
         {
-            i->second += diff;
+            i->second += mydiff;
         }
     }
 
-    /* Fix all references to symbols in the given seg */
+    /* Fix all references to symbols in the moved segments */
     for(unsigned a=0; a<R.R16.Fixups.size(); ++a)
     {
-        if(R.R16.Fixups[a].first != seg) continue;
+        const unsigned diff = moves.Get(R.R16.Fixups[a].first);
+        if(!diff) continue;
         unsigned addr = R.R16.Fixups[a].second - base;
         unsigned oldvalue = space[addr] | (space[addr+1] << 8);
         unsigned newvalue = oldvalue + diff;
@@ -772,7 +920,8 @@ void O65::Segment::Locate(SegmentSelection seg, unsigned diff, bool is_me)
     }
     for(unsigned a=0; a<R.R16lo.Fixups.size(); ++a)
     {
-        if(R.R16lo.Fixups[a].first != seg) continue;
+        const unsigned diff = moves.Get(R.R16lo.Fixups[a].first);
+        if(!diff) continue;
         unsigned addr = R.R16lo.Fixups[a].second - base;
         unsigned oldvalue = space[addr];
         unsigned newvalue = oldvalue + diff;
@@ -783,7 +932,8 @@ void O65::Segment::Locate(SegmentSelection seg, unsigned diff, bool is_me)
     }
     for(unsigned a=0; a<R.R16hi.Fixups.size(); ++a)
     {
-        if(R.R16hi.Fixups[a].first != seg) continue;
+        const unsigned diff = moves.Get(R.R16hi.Fixups[a].first);
+        if(!diff) continue;
         unsigned addr = R.R16hi.Fixups[a].second.first - base;
         unsigned oldvalue = (space[addr] << 8) | R.R16hi.Fixups[a].second.second;
         unsigned newvalue = oldvalue + diff;
@@ -794,7 +944,8 @@ void O65::Segment::Locate(SegmentSelection seg, unsigned diff, bool is_me)
     }
     for(unsigned a=0; a<R.R24.Fixups.size(); ++a)
     {
-        if(R.R24.Fixups[a].first != seg) continue;
+        const unsigned diff = moves.Get(R.R24.Fixups[a].first);
+        if(!diff) continue;
         unsigned addr = R.R24.Fixups[a].second - base;
         unsigned oldvalue = space[addr] | (space[addr+1] << 8) | (space[addr+2] << 16);
         unsigned newvalue = oldvalue + diff;
@@ -808,7 +959,8 @@ void O65::Segment::Locate(SegmentSelection seg, unsigned diff, bool is_me)
     }
     for(unsigned a=0; a<R.R24seg.Fixups.size(); ++a)
     {
-        if(R.R24seg.Fixups[a].first != seg) continue;
+        const unsigned diff = moves.Get(R.R24seg.Fixups[a].first);
+        if(!diff) continue;
         unsigned addr = R.R24seg.Fixups[a].second.first - base;
         unsigned oldvalue = (space[addr] << 16) | R.R24seg.Fixups[a].second.second;
         unsigned newvalue = oldvalue + diff;
@@ -824,93 +976,138 @@ void O65::Segment::Locate(SegmentSelection seg, unsigned diff, bool is_me)
 
     // This updates the position of each reloc & fixup.
 
-    if(is_me)
+    if(mydiff)
     {
-        for(unsigned a=0; a<R.R16.Relocs.size(); ++a)       R.R16.Relocs[a].first += diff;
-        for(unsigned a=0; a<R.R24.Relocs.size(); ++a)       R.R24.Relocs[a].first += diff;
-        for(unsigned a=0; a<R.R16lo.Relocs.size(); ++a)   R.R16lo.Relocs[a].first += diff;
-        for(unsigned a=0; a<R.R16hi.Relocs.size(); ++a)   R.R16hi.Relocs[a].first.first += diff;
-        for(unsigned a=0; a<R.R24seg.Relocs.size(); ++a) R.R24seg.Relocs[a].first.first += diff;
-
-        for(unsigned a=0; a<R.R16.Fixups.size(); ++a)       R.R16.Fixups[a].second += diff;
-        for(unsigned a=0; a<R.R24.Fixups.size(); ++a)       R.R24.Fixups[a].second += diff;
-        for(unsigned a=0; a<R.R16lo.Fixups.size(); ++a)   R.R16lo.Fixups[a].second += diff;
-        for(unsigned a=0; a<R.R16hi.Fixups.size(); ++a)   R.R16hi.Fixups[a].second.first += diff;
-        for(unsigned a=0; a<R.R24seg.Fixups.size(); ++a) R.R24seg.Fixups[a].second.first += diff;
-
-        base += diff;
+        for(unsigned a=0; a<R.R16.Relocs.size(); ++a)       R.R16.Relocs[a].first += mydiff;
+        for(unsigned a=0; a<R.R24.Relocs.size(); ++a)       R.R24.Relocs[a].first += mydiff;
+        for(unsigned a=0; a<R.R16lo.Relocs.size(); ++a)   R.R16lo.Relocs[a].first += mydiff;
+        for(unsigned a=0; a<R.R16hi.Relocs.size(); ++a)   R.R16hi.Relocs[a].first.first += mydiff;
+        for(unsigned a=0; a<R.R24seg.Relocs.size(); ++a) R.R24seg.Relocs[a].first.first += mydiff;
+
+        for(unsigned a=0; a<R.R16.Fixups.size(); ++a)       R.R16.Fixups[a].second += mydiff;
+        for(unsigned a=0; a<R.R24.Fixups.size(); ++a)       R.R24.Fixups[a].second += mydiff;
+        for(unsigned a=0; a<R.R16lo.Fixups.size(); ++a)   R.R16lo.Fixups[a].second += mydiff;
+        for(unsigned a=0; a<R.R16hi.Fixups.size(); ++a)   R.R16hi.Fixups[a].second.first += mydiff;
+        for(unsigned a=0; a<R.R24seg.Fixups.size(); ++a) R.R24seg.Fixups[a].second.first += mydiff;
+
+        base += mydiff;
     }
 }
 
+unsigned O65::Segment::RelocAddress(RelocKind kind, unsigned index) const
+{
+    switch(kind)
+    {
+        case R16:    return R.R16.Relocs[index].first;
+        case R16lo:  return R.R16lo.Relocs[index].first;
+        case R16hi:  return R.R16hi.Relocs[index].first.first;
+        case R24:    return R.R24.Relocs[index].first;
+        case R24seg: return R.R24seg.Relocs[index].first.first;
+    }
+    return 0;
+}
+
+void O65::Segment::IndexRelocations()
+{
+    const std::size_t total = R.R16.Relocs.size() + R.R16lo.Relocs.size()
+                            + R.R16hi.Relocs.size() + R.R24.Relocs.size()
+                            + R.R24seg.Relocs.size();
+    if(total == indexed_relocs) return;
+
+    symrelocs.clear();
+    symrelocs.reserve(total);
+    for(unsigned a=0; a<R.R16.Relocs.size(); ++a)    symrelocs.push_back({R.R16.Relocs[a].second, R16, a});
+    for(unsigned a=0; a<R.R16lo.Relocs.size(); ++a)  symrelocs.push_back({R.R16lo.Relocs[a].second, R16lo, a});
+    for(unsigned a=0; a<R.R16hi.Relocs.size(); ++a)  symrelocs.push_back({R.R16hi.Relocs[a].second, R16hi, a});
+    for(unsigned a=0; a<R.R24.Relocs.size(); ++a)    symrelocs.push_back({R.R24.Relocs[a].second, R24, a});
+    for(unsigned a=0; a<R.R24seg.Relocs.size(); ++a) symrelocs.push_back({R.R24seg.Relocs[a].second, R24seg, a});
+
+    // Locate() moves all addresses of the segment alike,
+    // so this order stays valid.
+    std::stable_sort(symrelocs.begin(), symrelocs.end(),
+        [this](const SymReloc& a, const SymReloc& b)
+        {
+            if(a.symno != b.symno) return a.symno < b.symno;
+            return RelocAddress(a.kind, a.index) - base
+                 < RelocAddress(b.kind, b.index) - base;
+        });
+    indexed_relocs = total;
+}
+
 void O65::Segment::LocateSym(unsigned symno, unsigned value)
 {
     /* Locate an external symbol */
+    IndexRelocations();
+
+    std::vector<SymReloc>::const_iterator
+        i = std::lower_bound(symrelocs.begin(), symrelocs.end(), symno,
+            [](const SymReloc& r, unsigned n) { return r.symno < n; });
 
     /* Fix all references to it */
-    for(unsigned a=0; a<R.R16.Relocs.size(); ++a)
+    for(; i != symrelocs.end() && i->symno == symno; ++i)
     {
-        if(R.R16.Relocs[a].second != symno) continue;
-        unsigned addr = R.R16.Relocs[a].first - base;
-        unsigned oldvalue = space[addr] | (space[addr+1] << 8);
-        unsigned newvalue = oldvalue + value;
+        const unsigned addr = RelocAddress(i->kind, i->index) - base;
+        switch(i->kind)
+        {
+            case R16:
+            {
+                unsigned oldvalue = space[addr] | (space[addr+1] << 8);
+                unsigned newvalue = oldvalue + value;
 #if DEBUG_FIXUPS
-        fprintf(stderr, "Replaced $%04X with $%04X for sym %u (value $%X)\n", oldvalue,newvalue&65535, symno, newvalue);
+                fprintf(stderr, "Replaced $%04X with $%04X for sym %u (value $%X)\n", oldvalue,newvalue&65535, symno, newvalue);
 #endif
-        space[addr] = newvalue&255;
-        space[addr+1] = (newvalue>>8) & 255;
-    }
-    for(unsigned a=0; a<R.R16lo.Relocs.size(); ++a)
-    {
-        if(R.R16lo.Relocs[a].second != symno) continue;
-        unsigned addr = R.R16lo.Relocs[a].first - base;
-        unsigned oldvalue = space[addr];
-        unsigned newvalue = oldvalue + value;
+                space[addr] = newvalue&255;
+                space[addr+1] = (newvalue>>8) & 255;
+                break;
+            }
+            case R16lo:
+            {
+                unsigned oldvalue = space[addr];
+                unsigned newvalue = oldvalue + value;
 #if DEBUG_FIXUPS
-        fprintf(stderr, "Replaced $%02X with $%02X for sym %u (value $%X)\n", oldvalue,newvalue&255, symno, newvalue);
+                fprintf(stderr, "Replaced $%02X with $%02X for sym %u (value $%X)\n", oldvalue,newvalue&255, symno, newvalue);
 #endif
-        space[addr] = newvalue & 255;
-    }
-    for(unsigned a=0; a<R.R16hi.Relocs.size(); ++a)
-    {
-        if(R.R16hi.Relocs[a].second != symno) continue;
-        unsigned addr = R.R16hi.Relocs[a].first.first - base;
-        unsigned oldvalue = (space[addr] << 8) | R.R16hi.Relocs[a].first.second;
-        unsigned newvalue = oldvalue + value;
+                space[addr] = newvalue & 255;
+                break;
+            }
+            case R16hi:
+            {
+                unsigned oldvalue = (space[addr] << 8) | R.R16hi.Relocs[i->index].first.second;
+                unsigned newvalue = oldvalue + value;
 #if DEBUG_FIXUPS
-        fprintf(stderr, "Replaced $%02X with $%02X for sym %u (value $%X)\n",
-            space[addr],(newvalue>>8)&255, symno, newvalue);
+                fprintf(stderr, "Replaced $%02X with $%02X for sym %u (value $%X)\n",
+                    space[addr],(newvalue>>8)&255, symno, newvalue);
 #endif
-        space[addr] = (newvalue>>8) & 255;
-    }
-    for(unsigned a=0; a<R.R24.Relocs.size(); ++a)
-    {
-        if(R.R24.Relocs[a].second != symno) continue;
-        unsigned addr = R.R24.Relocs[a].first - base;
-        unsigned oldvalue = space[addr] | (space[addr+1] << 8) | (space[addr+2] << 16);
-        unsigned newvalue = oldvalue + value;
-
+                space[addr] = (newvalue>>8) & 255;
+                break;
+            }
+            case R24:
+            {
+                unsigned oldvalue = space[addr] | (space[addr+1] << 8) | (space[addr+2] << 16);
+                unsigned newvalue = oldvalue + value;
 #if DEBUG_FIXUPS
-        fprintf(stderr, "Replaced $%06X with $%06X for sym %u (value $%X)\n", oldvalue,newvalue, symno, newvalue);
+                fprintf(stderr, "Replaced $%06X with $%06X for sym %u (value $%X)\n", oldvalue,newvalue, symno, newvalue);
 #endif
-        space[addr] = newvalue&255;
-        space[addr+1] = (newvalue>>8) & 255;
-        space[addr+2] = (newvalue>>16) & 255;
-    }
-    for(unsigned a=0; a<R.R24seg.Relocs.size(); ++a)
-    {
-        if(R.R24seg.Relocs[a].second != symno) continue;
-        unsigned addr = R.R24seg.Relocs[a].first.first - base;
-        unsigned oldvalue = (space[addr] << 16) | R.R24seg.Relocs[a].first.second;
-        unsigned newvalue = oldvalue + value;
-
+                space[addr] = newvalue&255;
+                space[addr+1] = (newvalue>>8) & 255;
+                space[addr+2] = (newvalue>>16) & 255;
+                break;
+            }
+            case R24seg:
+            {
+                unsigned oldvalue = (space[addr] << 16) | R.R24seg.Relocs[i->index].first.second;
+                unsigned newvalue = oldvalue + value;
 #if DEBUG_FIXUPS
-        fprintf(stderr, "Replaced $%02X with $%02X for sym %u (value $%X)\n", space[addr],newvalue>>16, symno, newvalue);
+                fprintf(stderr, "Replaced $%02X with $%02X for sym %u (value $%X)\n", space[addr],newvalue>>16, symno, newvalue);
 #endif
-        space[addr] = (newvalue>>16) & 255;
+                space[addr] = (newvalue>>16) & 255;
+                break;
+            }
+        }
     }
 }
 
-const std::vector<unsigned char>& O65::GetSeg(SegmentSelection seg) const
+ByteSpan O65::GetSeg(SegmentSelection seg) const
 {
     if(const Segment*const *s = GetSegRef(seg))
     {
@@ -928,14 +1125,14 @@ unsigned O65::GetSegSize(SegmentSelection seg) const
     return 0;
 }
 
-unsigned O65::GetSymAddress(SegmentSelection seg, const std::string& name) const
+unsigned O65::GetSymAddress(SegmentSelection seg, SymbolId name) const
 {
     if(const Segment*const *s = GetSegRef(seg))
     {
         Segment::publicmap_t::const_iterator i = (*s)->publics.find(name);
-        if(i == code->publics.end())
+        if(i == (*s)->publics.end())
         {
-            fprintf(stderr, "Attempt to find symbol %s which not exists.\n", name.c_str());
+            fprintf(stderr, "Attempt to find symbol %s which not exists.\n", SymbolName(name).c_str());
             return 0;
         }
         return i->second;
@@ -943,7 +1140,7 @@ unsigned O65::GetSymAddress(SegmentSelection seg, const std::string& name) const
     return 0;
 }
 
-bool O65::HasSym(SegmentSelection seg, const std::string& name) const
+bool O65::HasSym(SegmentSelection seg, SymbolId name) const
 {
     if(const Segment*const *s = GetSegRef(seg))
     {
@@ -953,9 +1150,9 @@ bool O65::HasSym(SegmentSelection seg, const std::string& name) const
     return false;
 }
 
-const std::vector<std::string> O65::GetSymbolList(SegmentSelection seg) const
+const std::vector<SymbolId> O65::GetSymbolList(SegmentSelection seg) const
 {
-    std::vector<std::string> result;
+    std::vector<SymbolId> result;
     if(const Segment*const *s = GetSegRef(seg))
     {
         const O65::Segment::publicmap_t& pubs = (*s)->publics;
@@ -967,15 +1164,27 @@ const std::vector<std::string> O65::GetSymbolList(SegmentSelection seg) const
         {
             result.push_back(i->first);
         }
+        std::sort(result.begin(), result.end(), SymbolNameLess());
     }
     return result;
 }
 
-const std::vector<std::string> O65::GetExternList() const
+const std::vector<SymbolId> O65::GetExternList() const
 {
     return defs->GetExternList();
 }
 
+bool O65::IsExtern(SymbolId name) const
+{
+    unsigned symno = defs->GetSymno(name);
+    return symno != ~0U && !defs->IsDefined(symno);
+}
+
+unsigned O65::CountExterns() const
+{
+    return defs->CountUndefined();
+}
+
 void O65::Verify() const
 {
     defs->DumpUndefines();
@@ -1023,11 +1232,11 @@ void O65::Write(SegmentSelection seg, unsigned addr, unsigned char value)
     }
 }
 
-void O65::LoadSegFrom(SegmentSelection seg, const std::vector<unsigned char>& buf)
+void O65::LoadSegFrom(SegmentSelection seg, ByteSpan buf)
 {
     if(Segment**s = GetSegRef(seg))
     {
-        (*s)->space = buf;
+        (*s)->space.assign(buf.begin(), buf.end());
     }
 }
 
@@ -1041,7 +1250,7 @@ void O65::SetError()
     error = true;
 }
 
-void O65::DeclareByteRelocation(SegmentSelection seg, const std::string& name, unsigned addr)
+void O65::DeclareByteRelocation(SegmentSelection seg, SymbolId name, unsigned addr)
 {
     Segment**s = GetSegRef(seg); if(!s) return;
 
@@ -1059,7 +1268,7 @@ void O65::DeclareByteRelocation(SegmentSelection seg, const std::string& name, u
     (*s)->R.R16lo.AddReloc(addr, symno);
 }
 
-void O65::DeclareWordRelocation(SegmentSelection seg, const std::string& name, unsigned addr)
+void O65::DeclareWordRelocation(SegmentSelection seg, SymbolId name, unsigned addr)
 {
     Segment**s = GetSegRef(seg); if(!s) return;
 
@@ -1080,7 +1289,7 @@ void O65::DeclareWordRelocation(SegmentSelection seg, const std::string& name, u
 
 /*
 // This would be used by IPS code only
-void O65::DeclareHiByteRelocation(SegmentSelection seg, const std::string& name, unsigned addr)
+void O65::DeclareHiByteRelocation(SegmentSelection seg, SymbolId name, unsigned addr)
 {
     Segment**s = GetSegRef(seg); if(!s) return;
 
@@ -1099,7 +1308,7 @@ void O65::DeclareHiByteRelocation(SegmentSelection seg, const std::string& name,
 }
 */
 
-void O65::DeclareLongRelocation(SegmentSelection seg, const std::string& name, unsigned addr)
+void O65::DeclareLongRelocation(SegmentSelection seg, SymbolId name, unsigned addr)
 {
     Segment**s = GetSegRef(seg); if(!s) return;
 
@@ -1119,16 +1328,39 @@ void O65::DeclareLongRelocation(SegmentSelection seg, const std::string& name, u
     (*s)->R.R24.AddReloc(addr, symno);
 }
 
-void O65::Segment::LoadRelocations(FILE* fp)
+void O65::Segment::LoadRelocations(Reader& in)
 {
+    // Count the entries of each type first, to allocate the tables once
+    std::size_t fixups[8] = { }, relocs[8] = { };
+    for(Reader scan = in; ; )
+    {
+        int c = scan.Get();
+        if(!c || c == EOF)break;
+        if(c == 255) continue;
+        c = scan.Get();
+        unsigned type = c & 0xE0;
+        unsigned area = c & 0x07;
+
+        std::size_t* counts = area ? fixups : relocs;
+        ++counts[type >> 5];
+        if(!area) scan.Skip(2);
+        if(type == 0x40) scan.Skip(1);
+        if(type == 0xA0) scan.Skip(2);
+    }
+    R.R16lo.Fixups.reserve(fixups[0x20 >> 5]);  R.R16lo.Relocs.reserve(relocs[0x20 >> 5]);
+    R.R16hi.Fixups.reserve(fixups[0x40 >> 5]);  R.R16hi.Relocs.reserve(relocs[0x40 >> 5]);
+    R.R16.Fixups.reserve(fixups[0x80 >> 5]);    R.R16.Relocs.reserve(relocs[0x80 >> 5]);
+    R.R24seg.Fixups.reserve(fixups[0xA0 >> 5]); R.R24seg.Relocs.reserve(relocs[0xA0 >> 5]);
+    R.R24.Fixups.reserve(fixups[0xC0 >> 5]);    R.R24.Relocs.reserve(relocs[0xC0 >> 5]);
+
     int addr = -1;
     for(;;)
     {
-        int c = fgetc(fp);
+        int c = in.Get();
         if(!c || c == EOF)break;
         if(c == 255) { addr += 254; continue; }
         addr += c;
-        c = fgetc(fp);
+        c = in.Get();
         unsigned type = c & 0xE0;
         unsigned area = c & 0x07;
 
@@ -1136,7 +1368,7 @@ void O65::Segment::LoadRelocations(FILE* fp)
         {
             case 0: // external
             {
-                unsigned symno = LoadWord(fp);
+                unsigned symno = LoadWord(in);
                 switch(type)
                 {
                     case 0x20:
@@ -1146,7 +1378,7 @@ void O65::Segment::LoadRelocations(FILE* fp)
                     }
                     case 0x40:
                     {
-                        RT::R16hi_t::Type tmp(addr, fgetc(fp));
+                        RT::R16hi_t::Type tmp(addr, in.Get());
                         R.R16hi.AddReloc(tmp, symno);
                         break;
                     }
@@ -1157,7 +1389,7 @@ void O65::Segment::LoadRelocations(FILE* fp)
                     }
                     case 0xA0:
                     {
-                        RT::R24seg_t::Type tmp(addr, LoadWord(fp));
+                        RT::R24seg_t::Type tmp(addr, LoadWord(in));
                         R.R24seg.AddReloc(tmp, symno);
                         break;
                     }
@@ -1191,7 +1423,7 @@ void O65::Segment::LoadRelocations(FILE* fp)
                     }
                     case 0x40:
                     {
-                        RT::R16hi_t::Type tmp(addr, fgetc(fp));
+                        RT::R16hi_t::Type tmp(addr, in.Get());
                         R.R16hi.AddFixup(seg, tmp);
                         break;
                     }
@@ -1202,7 +1434,7 @@ void O65::Segment::LoadRelocations(FILE* fp)
                     }
                     case 0xA0:
                     {
-                        RT::R24seg_t::Type tmp(addr, LoadWord(fp));
+                        RT::R24seg_t::Type tmp(addr, LoadWord(in));
                         R.R24seg.AddFixup(seg, tmp);
                         break;
                     }
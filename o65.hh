@@ -45,6 +45,8 @@ enum SegmentSelection
 const std::string GetSegmentName(const SegmentSelection seg);
 
 #include "relocdata.hh"
+#include "symbol.hh"
+#include "bytespan.hh"
 
 /**
  * O65 object class.
@@ -55,9 +57,10 @@ public:
     O65();
     ~O65();
 
-    // Copy constructor, assignment operator
-    O65(const O65 &);
-    const O65& operator= (const O65 &);
+    // Move constructor, assignment operator.
+    // A moved-from object may only be destroyed or assigned to.
+    O65(O65 &&) noexcept;
+    O65& operator= (O65 &&) noexcept;
 
     /*! Loads an object file from the specified file */
     void Load(std::FILE *fp);
@@ -65,33 +68,36 @@ public:
     /*! Relocate the given segment to new address */
     void Locate(SegmentSelection seg, unsigned newaddress);
 
+    /*! Relocate all segments at once, visiting each fixup only once */
+    void LocateAll(unsigned codeaddr, unsigned dataaddr, unsigned zeroaddr, unsigned bssaddr);
+
     /*! Returns the base address of the given segment */
     unsigned GetBase(SegmentSelection seg) const;
 
     /*! Defines the value of a symbol. */
     /*! The symbol must have been accessed in order to be defined. */
-    void LinkSym(const std::string& name, unsigned value);
+    void LinkSym(SymbolId name, unsigned value);
 
     /*! Declares a global label in the selected segment */
-    void DeclareGlobal(SegmentSelection seg, const std::string& name, unsigned address);
+    void DeclareGlobal(SegmentSelection seg, SymbolId name, unsigned address);
 
     /*! Declares a 8-bit relocation to given symbol */
-    void DeclareByteRelocation(SegmentSelection seg, const std::string& name, unsigned addr);
-    void DeclareHiByteRelocation(SegmentSelection seg, const std::string& name, unsigned addr);
+    void DeclareByteRelocation(SegmentSelection seg, SymbolId name, unsigned addr);
+    void DeclareHiByteRelocation(SegmentSelection seg, SymbolId name, unsigned addr);
     /*! Declares a 16-bit relocation to given symbol */
-    void DeclareWordRelocation(SegmentSelection seg, const std::string& name, unsigned addr);
+    void DeclareWordRelocation(SegmentSelection seg, SymbolId name, unsigned addr);
     /*! Declares a 24-bit relocation to given symbol */
-    void DeclareLongRelocation(SegmentSelection seg, const std::string& name, unsigned addr);
+    void DeclareLongRelocation(SegmentSelection seg, SymbolId name, unsigned addr);
 
     /*! Returns the contents of a segment */
-    const std::vector<unsigned char>& GetSeg(SegmentSelection seg) const;
+    ByteSpan GetSeg(SegmentSelection seg) const;
     const std::vector<std::pair<unsigned char, std::string> >& GetCustomHeaders() const;
 
     /*! Returns the segment size */
     unsigned GetSegSize(SegmentSelection seg) const;
 
     /*! Returns the address of a global */
-    unsigned GetSymAddress(SegmentSelection seg, const std::string& name) const;
+    unsigned GetSymAddress(SegmentSelection seg, SymbolId name) const;
 
     /*! Resizes a segment */
     void Resize(SegmentSelection seg, unsigned newsize);
@@ -100,12 +106,16 @@ public:
     void Write(SegmentSelection seg, unsigned addr, unsigned char value);
 
     /*! Redefine a segment. Warning: Does not change symbols. */
-    void LoadSegFrom(SegmentSelection seg, const std::vector<unsigned char>& buf);
+    void LoadSegFrom(SegmentSelection seg, ByteSpan buf);
 
-    bool HasSym(SegmentSelection seg, const std::string& name) const;
+    bool HasSym(SegmentSelection seg, SymbolId name) const;
 
-    const std::vector<std::string> GetSymbolList(SegmentSelection seg) const;
-    const std::vector<std::string> GetExternList() const;
+    /*! Returns the globals of a segment, in name order */
+    const std::vector<SymbolId> GetSymbolList(SegmentSelection seg) const;
+    /*! Returns the symbols referred to, but not yet defined */
+    const std::vector<SymbolId> GetExternList() const;
+    bool IsExtern(SymbolId name) const;
+    unsigned CountExterns() const;
 
     /*! Verifies that all symbols have been properly defined */
     void Verify() const;
@@ -132,6 +142,11 @@ private:
     const Segment*const * GetSegRef(SegmentSelection seg) const;
 
     bool error;
+
+private:
+    // Copying prohibited
+    O65(const O65&) = delete;
+    const O65& operator= (const O65&) = delete;
 };
 
 #endif
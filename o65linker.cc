@@ -5,8 +5,6 @@
 #include <utility>
 #include <map>
 
-#include "hash.hh"
-
 class O65linker::Object
 {
 public:
@@ -14,9 +12,6 @@ public:
 private:
     std::string name;
 
-public:
-    std::vector<std::string> extlist;
-
 private:
     LinkageWish linkageCODE;
     LinkageWish linkageDATA;
@@ -24,15 +19,14 @@ private:
     LinkageWish linkageBSS;
 
 public:
-    Object(const O65& obj, const std::string& what,
+    Object(O65&& obj, const std::string& what,
         LinkageWish linkCODE,
         LinkageWish linkDATA,
         LinkageWish linkZERO,
         LinkageWish linkBSS
       )
-    : object(obj),
+    : object(std::move(obj)),
       name(what),
-      extlist(obj.GetExternList()),
       linkageCODE(linkCODE),
       linkageDATA(linkDATA),
       linkageZERO(linkZERO),
@@ -43,7 +37,6 @@ public:
     Object()
     : object(),
       name(),
-      extlist(),
       linkageCODE(),
       linkageDATA(),
       linkageZERO(),
@@ -94,7 +87,7 @@ struct ResolvedSymbol
 };
 struct ClashItem
 {
-    std::string symbol;
+    SymbolId symbol;
     SegmentSelection seg;
     ResolvedSymbol found;
 };
@@ -102,13 +95,21 @@ typedef std::list<ClashItem> clashlist_t;
 
 class O65linker::SymCache
 {
-    typedef hash_map<std::string, ResolvedSymbol> cachetype;
-
-    cachetype sym_cache;
+    /* Indexed by SymbolId, which are small numbers,
+     * so no hashing is needed. Unused entries have objnum NoObject.
+     */
+    static const unsigned NoObject = ~0U;
+    std::vector<ResolvedSymbol> sym_cache;
+
+    // The symbols added by the latest Update(), for Undo()
+    std::vector<SymbolId> added;
 public:
+    SymCache(): sym_cache(), added() { }
+
     void Update(const Object& o, unsigned objnum,
                 clashlist_t& clashlist)
     {
+        added.clear();
         Update(o, objnum, CODE, clashlist);
         Update(o, objnum, DATA, clashlist);
         Update(o, objnum, ZERO, clashlist);
@@ -121,35 +122,45 @@ public:
         res.objnum = objnum;
         res.seg    = seg;
 
-        const std::vector<std::string> symlist = o.object.GetSymbolList(seg);
+        const std::vector<SymbolId> symlist = o.object.GetSymbolList(seg);
         for(unsigned a=0; a<symlist.size(); ++a)
         {
-            cachetype::const_iterator i = sym_cache.find(symlist[a]);
-            if(i != sym_cache.end())
+            const SymbolId sym = symlist[a];
+            if(sym < sym_cache.size() && sym_cache[sym].objnum != NoObject)
             {
                 ClashItem clash;
-                clash.symbol = symlist[a];
+                clash.symbol = sym;
                 clash.seg    = seg;
-                clash.found  = i->second;
+                clash.found  = sym_cache[sym];
                 clashlist.push_back(clash);
                 continue;
             }
-            sym_cache[symlist[a]] = res;
+            if(sym >= sym_cache.size())
+                sym_cache.resize(sym + 1, ResolvedSymbol{NoObject, CODE});
+            sym_cache[sym] = res;
+            added.push_back(sym);
         }
     }
 
-    const std::pair<ResolvedSymbol, bool> Find(const std::string& sym) const
+    /* Forgets the symbols added by the latest Update() */
+    void Undo()
     {
-        cachetype::const_iterator i = sym_cache.find(sym);
-        if(i == sym_cache.end())
+        for(unsigned a=0; a<added.size(); ++a)
+            sym_cache[added[a]].objnum = NoObject;
+        added.clear();
+    }
+
+    const std::pair<ResolvedSymbol, bool> Find(SymbolId sym) const
+    {
+        if(sym >= sym_cache.size() || sym_cache[sym].objnum == NoObject)
         {
             return std::make_pair(ResolvedSymbol(), false);
         }
-        return std::make_pair(i->second, true);
+        return std::make_pair(sym_cache[sym], true);
     }
 };
 
-void O65linker::AddObject(const O65& object, const std::string& what, const std::map<SegmentSelection, LinkageWish>& linkages)
+void O65linker::AddObject(O65&& object, const std::string& what, const std::map<SegmentSelection, LinkageWish>& linkages)
 {
     LinkageWish linkageCODE;
     LinkageWish linkageDATA;
@@ -172,12 +183,11 @@ void O65linker::AddObject(const O65& object, const std::string& what, const std:
         return;
     }
 
-    SymCache backup = *symcache;
-    Object *newobj = new Object(object, what,
+    objects.emplace_back(std::move(object), what,
         linkageCODE, linkageDATA, linkageZERO, linkageBSS);
 
     clashlist_t clashes;
-    symcache->Update(*newobj, objects.size(), clashes);
+    symcache->Update(objects.back(), objects.size()-1, clashes);
     if(!clashes.empty())
     {
         for(clashlist_t::const_iterator i = clashes.begin(); i != clashes.end(); ++i)
@@ -188,26 +198,25 @@ void O65linker::AddObject(const O65& object, const std::string& what, const std:
                 "O65 linker: ERROR:"
                 " Symbol \"%s\", defined by object \"%s\" in %s,"
                 " is already present in object \"%s\"'s %s\n",
-                clash.symbol.c_str(),
+                SymbolName(clash.symbol).c_str(),
                 what.c_str(), GetSegmentName(clash.seg).c_str(),
 
-                objects[clash.found.objnum]->GetName().c_str(),
+                objects[clash.found.objnum].GetName().c_str(),
                 GetSegmentName(clash.found.seg).c_str()
             );
         }
-        *symcache = backup;
-        delete newobj;
+        symcache->Undo();
+        objects.pop_back();
         return;
     }
-    objects.push_back(newobj);
 }
 
 /*
-void O65linker::AddObject(const O65& object, const std::string& what, unsigned address)
+void O65linker::AddObject(O65&& object, const std::string& what, unsigned address)
 {
     LinkageWish wish;
     wish.SetAddress(address);
-    AddObject(object, what, wish);
+    AddObject(std::move(object), what, wish);
 }
 */
 
@@ -217,7 +226,7 @@ const std::vector<unsigned> O65linker::GetSizeList(const SegmentSelection seg) c
     unsigned n = objects.size();
     result.reserve(n);
     for(unsigned a=0; a<n; ++a)
-        result.push_back(objects[a]->object.GetSegSize(seg));
+        result.push_back(objects[a].object.GetSegSize(seg));
     return result;
 }
 
@@ -227,7 +236,7 @@ const std::vector<unsigned> O65linker::GetAddrList(const SegmentSelection seg) c
     unsigned n = objects.size();
     result.reserve(n);
     for(unsigned a=0; a<n; ++a)
-        result.push_back(objects[a]->GetLinkage(seg).GetAddress());
+        result.push_back(objects[a].GetLinkage(seg).GetAddress());
     return result;
 }
 
@@ -237,7 +246,7 @@ const std::vector<LinkageWish> O65linker::GetLinkageList(const SegmentSelection
     unsigned n = objects.size();
     result.reserve(n);
     for(unsigned a=0; a<n; ++a)
-        result.push_back(objects[a]->GetLinkage(seg));
+        result.push_back(objects[a].GetLinkage(seg));
     return result;
 }
 
@@ -252,24 +261,35 @@ void O65linker::PutAddrList(const std::vector<unsigned>& addrs, const SegmentSel
         if(addr >= 0xC08000 && addr <= 0xC0FFFF)
             addr -= 0x400000; // Put them in 0x808000
         */
-        objects[a]->GetLinkage(seg).SetAddress(addr);
-        objects[a]->object.Locate(seg, addrs[a]);
+        objects[a].GetLinkage(seg).SetAddress(addr);
     }
 }
 
-const std::vector<unsigned char>& O65linker::GetSeg(const SegmentSelection seg, unsigned objno) const
+void O65linker::LocateAll()
 {
-    return objects[objno]->object.GetSeg(seg);
+    for(unsigned a=0; a<objects.size(); ++a)
+    {
+        Object& o = objects[a];
+        o.object.LocateAll(o.GetLinkage(CODE).GetAddress(),
+                           o.GetLinkage(DATA).GetAddress(),
+                           o.GetLinkage(ZERO).GetAddress(),
+                           o.GetLinkage(BSS).GetAddress());
+    }
+}
+
+ByteSpan O65linker::GetSeg(const SegmentSelection seg, unsigned objno) const
+{
+    return objects[objno].object.GetSeg(seg);
 }
 
 const std::string& O65linker::GetName(unsigned objno) const
 {
-    return objects[objno]->GetName();
+    return objects[objno].GetName();
 }
 
 void O65linker::Release(unsigned objno)
 {
-    objects[objno]->Release();
+    objects[objno].Release();
 }
 
 void O65linker::DefineSymbol(const std::string& name, unsigned value)
@@ -278,36 +298,38 @@ void O65linker::DefineSymbol(const std::string& name, unsigned value)
     {
         fprintf(stderr, "O65 linker: Attempt to add symbols after linking\n");
     }
-    for(unsigned c=0; c<defines.size(); ++c)
+    const SymbolId id = InternSymbol(name);
+    std::unordered_map<SymbolId, unsigned>::const_iterator i = define_index.find(id);
+    if(i != define_index.end())
     {
-        if(defines[c].first == name)
+        const unsigned c = i->second;
+        if(defines[c].second.first != value)
         {
-            if(defines[c].second.first != value)
-            {
-                fprintf(stderr,
-                    "O65 linker: Error: %s previously defined as %X,"
-                    " can not redefine as %X\n",
-                        name.c_str(), defines[c].second.first, value);
-            }
-            return;
+            fprintf(stderr,
+                "O65 linker: Error: %s previously defined as %X,"
+                " can not redefine as %X\n",
+                    name.c_str(), defines[c].second.first, value);
         }
+        return;
     }
 
-    defines.emplace_back(name, std::make_pair(value, false));
+    define_index[id] = defines.size();
+    defines.emplace_back(id, std::make_pair(value, false));
 }
 
 void O65linker::AddReference(const std::string& name, const ReferMethod& reference)
 {
-    const std::pair<ResolvedSymbol, bool> tmp = symcache->Find(name);
+    const SymbolId id = InternSymbol(name);
+    const std::pair<ResolvedSymbol, bool> tmp = symcache->Find(id);
     if(tmp.second)
     {
-        const Object& o = *objects[tmp.first.objnum];
+        const Object& o = objects[tmp.first.objnum];
 
         if(o.GetLinkage(tmp.first.seg).type == LinkageWish::LinkHere)
         {
-            unsigned value = o.object.GetSymAddress(tmp.first.seg, name);
+            unsigned value = o.object.GetSymAddress(tmp.first.seg, id);
             // resolved referer
-            FinishReference(reference, value, name);
+            FinishReference(reference, value, id);
             return;
         }
     }
@@ -316,38 +338,31 @@ void O65linker::AddReference(const std::string& name, const ReferMethod& referen
     {
         fprintf(stderr, "O65 linker: Attempt to add references after linking\n");
     }
-    referers.emplace_back(reference, name);
+    referers.push_back(Referer{reference, id, true});
 }
 
-void O65linker::LinkSymbol(const std::string& name, unsigned value)
+void O65linker::LinkSymbol(SymbolId name, unsigned value)
 {
     for(unsigned a=0; a<objects.size(); ++a)
     {
-        Object& o = *objects[a];
-        for(unsigned b=0; b<o.extlist.size(); ++b)
-        {
-            /* If this module is referring to this symbol */
-            if(o.extlist[b] == name)
-            {
-                o.extlist.erase(o.extlist.begin() + b);
-                o.object.LinkSym(name, value);
-                --b;
-            }
-        }
+        Object& o = objects[a];
+        /* If this module is referring to this symbol */
+        if(o.object.IsExtern(name))
+            o.object.LinkSym(name, value);
     }
     for(unsigned a=0; a<referers.size(); ++a)
     {
-        if(name == referers[a].second)
+        Referer& r = referers[a];
+        if(r.pending && r.name == name)
         {
             // resolved referer
-            FinishReference(referers[a].first, value, name);
-            referers.erase(referers.begin() + a);
-            --a;
+            r.pending = false;
+            FinishReference(r.method, value, name);
         }
     }
 }
 
-void O65linker::FinishReference(const ReferMethod& reference, unsigned target, const std::string& what)
+void O65linker::FinishReference(const ReferMethod& reference, unsigned target, SymbolId what)
 {
     unsigned pos = reference.GetAddr();
     unsigned value = reference.Evaluate(target);
@@ -355,7 +370,7 @@ void O65linker::FinishReference(const ReferMethod& reference, unsigned target, c
     char Buf[513];
     sprintf(Buf, "%016X", value);
 
-    std::string title = "ref " + what + ": $" + (Buf + 16-reference.GetSize()*2);
+    std::string title = "ref " + SymbolName(what) + ": $" + (Buf + 16-reference.GetSize()*2);
 
     std::vector<unsigned char> bytes;
     for(unsigned n=0; n<reference.GetSize(); ++n)
@@ -367,7 +382,7 @@ void O65linker::FinishReference(const ReferMethod& reference, unsigned target, c
     AddLump(bytes, pos, title);
 }
 
-void O65linker::AddLump(const std::vector<unsigned char>& source,
+void O65linker::AddLump(ByteSpan source,
                         unsigned address,
                         const std::string& what,
                         const std::string& name)
@@ -375,21 +390,21 @@ void O65linker::AddLump(const std::vector<unsigned char>& source,
     O65 tmp;
     tmp.LoadSegFrom(CODE, source);
     tmp.Locate(CODE, address);
-    if(!name.empty()) tmp.DeclareGlobal(CODE, name, address);
+    if(!name.empty()) tmp.DeclareGlobal(CODE, InternSymbol(name), address);
 
     LinkageWish wish;
     wish.SetAddress(address);
-    AddObject(tmp, what, {{CODE,wish}} );
+    AddObject(std::move(tmp), what, {{CODE,wish}} );
 }
 
-void O65linker::AddLump(const std::vector<unsigned char>& source,
+void O65linker::AddLump(ByteSpan source,
                         const std::string& what,
                         const std::string& name)
 {
     O65 tmp;
     tmp.LoadSegFrom(CODE, source);
-    if(!name.empty()) tmp.DeclareGlobal(CODE, name, 0);
-    AddObject(tmp, what);
+    if(!name.empty()) tmp.DeclareGlobal(CODE, InternSymbol(name), 0);
+    AddObject(std::move(tmp), what);
 }
 
 void O65linker::Link()
@@ -406,7 +421,7 @@ void O65linker::Link()
     // For each module, satisfy each of their externs one by one.
     for(unsigned a=0; a<objects.size(); ++a)
     {
-        Object& o = *objects[a];
+        Object& o = objects[a];
 
         bool LinkageIncomplete = false;
 
@@ -441,101 +456,94 @@ void O65linker::Link()
 
         MessageLoadingItem(o.GetName());
 
-        for(unsigned b=0; b<o.extlist.size(); ++b)
+        for(SymbolId ext: o.object.GetExternList())
         {
-            const std::string& ext = o.extlist[b];
-
             unsigned found=0, addr=0, defcount=0;
 
             const std::pair<ResolvedSymbol, bool> tmp = symcache->Find(ext);
             if(tmp.second)
             {
-                addr = objects[tmp.first.objnum]->object.GetSymAddress(tmp.first.seg, ext);
+                addr = objects[tmp.first.objnum].object.GetSymAddress(tmp.first.seg, ext);
                 ++found;
             }
 
             // Or if it was an external definition.
-            for(unsigned c=0; c<defines.size(); ++c)
+            std::unordered_map<SymbolId, unsigned>::const_iterator
+                d = define_index.find(ext);
+            if(d != define_index.end())
             {
-                if(defines[c].first == ext)
-                {
-                    addr = defines[c].second.first;
-                    defines[c].second.second = true;
-                    ++defcount;
-                }
+                addr = defines[d->second].second.first;
+                defines[d->second].second.second = true;
+                ++defcount;
             }
 
             if(found == 0 && !defcount)
             {
-                MessageUndefinedSymbol(ext);
+                MessageUndefinedSymbol(SymbolName(ext));
                 // FIXME: where?
             }
             else if((found+defcount) != 1)
             {
-                MessageDuplicateDefinition(ext, found, defcount);
+                MessageDuplicateDefinition(SymbolName(ext), found, defcount);
             }
 
 /*
             if(found > 0)
-                fprintf(stderr, "Extern %u(%s) was resolved with linking\n", b, ext.c_str());
+                fprintf(stderr, "Extern %s was resolved with linking\n", SymbolName(ext).c_str());
             if(defcount > 0)
-                fprintf(stderr, "Extern %u(%s) was resolved with a define\n", b, ext.c_str());
+                fprintf(stderr, "Extern %s was resolved with a define\n", SymbolName(ext).c_str());
 */
 
             if(found > 0 || defcount > 0)
             {
                 o.object.LinkSym(ext, addr);
-
-                o.extlist.erase(o.extlist.begin() + b);
-                --b;
             }
         }
-        if(!o.extlist.empty())
+        if(o.object.CountExterns())
         {
-            MessageUndefinedSymbols(o.extlist.size());
+            MessageUndefinedSymbols(o.object.CountExterns());
             // FIXME: where?
         }
     }
 
     for(unsigned c=0; c<referers.size(); ++c)
     {
-        const std::string& name = referers[c].second;
+        if(!referers[c].pending) continue;
+
+        const SymbolId name = referers[c].name;
         const std::pair<ResolvedSymbol, bool> tmp = symcache->Find(name);
         if(tmp.second)
         {
-            const Object& o = *objects[tmp.first.objnum];
+            const Object& o = objects[tmp.first.objnum];
             if(o.GetLinkage(tmp.first.seg).type != LinkageWish::LinkHere) continue;
 
             unsigned value = o.object.GetSymAddress(tmp.first.seg, name);
 
             // resolved referer
-            FinishReference(referers[c].first, value, name);
-            referers.erase(referers.begin() + c);
-            --c;
+            referers[c].pending = false;
+            FinishReference(referers[c].method, value, name);
         }
     }
 
     MessageDone();
 
     for(unsigned a=0; a<objects.size(); ++a)
-        objects[a]->object.Verify();
+        objects[a].object.Verify();
 
-    if(!referers.empty())
-    {
-        //fprintf(stderr,
-        //    "O65 linker: Leftover references found.\n");
-        for(unsigned a=0; a<referers.size(); ++a)
+    //fprintf(stderr,
+    //    "O65 linker: Leftover references found.\n");
+    for(unsigned a=0; a<referers.size(); ++a)
+        if(referers[a].pending)
             fprintf(stderr,
                 "O65 linker: Unresolved reference: %s\n",
-                    referers[a].second.c_str());
-    }
+                    SymbolName(referers[a].name).c_str());
 
     for(unsigned c=0; c<defines.size(); ++c)
         if(!defines[c].second.second)
         {
             fprintf(stderr,
                 "O65 linker: Warning: Symbol \"%s\" was defined but never used.\n",
-                defines[c].first.c_str());
+                SymbolName(defines[c].first).c_str());
         }
 }
 
@@ -543,6 +551,7 @@ O65linker::O65linker()
    : symcache(new SymCache),
      objects(),
      defines(),
+     define_index(),
      referers(),
      num_groups_used(0),
      linked(false)
@@ -580,13 +589,13 @@ namespace
 
     struct IPS_global: public IPS_item
     {
-        std::string   name;
+        SymbolId name;
      public:
         IPS_global(): IPS_item(), name() { }
     };
     struct IPS_extern: public IPS_item
     {
-        std::string   name;
+        SymbolId name;
         unsigned size;
      public:
         IPS_extern(): IPS_item(), name(), size() { }
@@ -619,9 +628,21 @@ void O65linker::LoadIPSfile(FILE* fp, const std::string& what,
 
         unsigned length = LoadIPSword(fp);
 
-        std::vector<unsigned char> Buf2(length);
-        int c = fread(&Buf2[0], 1, length, fp);
-        if(c < 0 || c != (int)length) break;
+        std::vector<unsigned char> Buf2;
+        if(!length)
+        {
+            // RLE: the length and the byte to repeat
+            length = LoadIPSword(fp);
+            int byte = fgetc(fp);
+            if(byte == EOF) break;
+            Buf2.assign(length, byte);
+        }
+        else
+        {
+            Buf2.resize(length);
+            int c = fread(&Buf2[0], 1, length, fp);
+            if(c < 0 || c != (int)length) break;
+        }
 
         switch(addr)
         {
@@ -636,7 +657,7 @@ void O65linker::LoadIPSfile(FILE* fp, const std::string& what,
                 if(AddressTransformer) addr = AddressTransformer(addr);
 
                 IPS_global tmp;
-                tmp.name = name;
+                tmp.name = InternSymbol(name);
                 tmp.addr = addr;
 
                 globals.push_back(tmp);
@@ -655,7 +676,7 @@ void O65linker::LoadIPSfile(FILE* fp, const std::string& what,
                 if(AddressTransformer) addr = AddressTransformer(addr);
 
                 IPS_extern tmp;
-                tmp.name = name;
+                tmp.name = InternSymbol(name);
                 tmp.addr = addr;
                 tmp.size = size;
 
@@ -682,6 +703,19 @@ void O65linker::LoadIPSfile(FILE* fp, const std::string& what,
     externs.sort();
     lumps.sort();
 
+    // Records that continue each other make one lump
+    for(std::list<IPS_lump>::iterator next, i = lumps.begin(); i != lumps.end(); )
+    {
+        next = i; ++next;
+        if(next != lumps.end() && next->addr == i->addr + i->data.size())
+        {
+            i->data.insert(i->data.end(), next->data.begin(), next->data.end());
+            lumps.erase(next);
+        }
+        else
+            i = next;
+    }
+
     for(std::list<IPS_lump>::const_iterator next_lump,
         i = lumps.begin(); i != lumps.end(); i=next_lump)
     {
@@ -742,7 +776,7 @@ void O65linker::LoadIPSfile(FILE* fp, const std::string& what,
 
         //fprintf(stderr, "%s\n", Buf);
 
-        AddObject(tmp, Buf + what, {{CODE,wish}});
+        AddObject(std::move(tmp), Buf + what, {{CODE,wish}});
     }
 }
 
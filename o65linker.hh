@@ -6,6 +6,7 @@
 #include <cstdio>
 #include <string>
 #include <map>
+#include <unordered_map>
 
 #include "o65.hh"
 #include "refer.hh"
@@ -53,16 +54,16 @@ public:
     void LoadIPSfile(std::FILE* fp, const std::string& what,
                      unsigned long (*AddressTransformer)(unsigned long) = 0);
 
-    void AddObject(const O65& object, const std::string& what, const std::map<SegmentSelection, LinkageWish>& linkages = {});
+    void AddObject(O65&& object, const std::string& what, const std::map<SegmentSelection, LinkageWish>& linkages = {});
 
     /*
-    void AddObject(const O65& object, const std::string& what, unsigned address);
+    void AddObject(O65&& object, const std::string& what, unsigned address);
     */
 
-    void AddLump(const std::vector<unsigned char>&,
+    void AddLump(ByteSpan,
                  unsigned address,
                  const std::string& what, const std::string& name="");
-    void AddLump(const std::vector<unsigned char>&,
+    void AddLump(ByteSpan,
                  const std::string& what, const std::string& name="");
 
     unsigned CreateLinkageGroup() { return ++num_groups_used; }
@@ -70,9 +71,13 @@ public:
     const std::vector<unsigned> GetSizeList(const SegmentSelection seg=CODE) const;
     const std::vector<unsigned> GetAddrList(const SegmentSelection seg=CODE) const;
     const std::vector<LinkageWish> GetLinkageList(const SegmentSelection seg=CODE) const;
+    /* PutAddrList only records the addresses.
+     * Once all segments are placed, LocateAll moves the objects there.
+     */
     void PutAddrList(const std::vector<unsigned>& addrs, const SegmentSelection seg=CODE);
+    void LocateAll();
 
-    const std::vector<unsigned char>& GetSeg(const SegmentSelection seg, unsigned objno) const;
+    ByteSpan GetSeg(const SegmentSelection seg, unsigned objno) const;
 
     const std::string& GetName(unsigned objno) const;
 
@@ -90,19 +95,27 @@ private:
     const O65linker& operator= (const O65linker&) = delete;
 
 private:
-    void LinkSymbol(const std::string& name, unsigned value);
+    void LinkSymbol(SymbolId name, unsigned value);
 
     void FinishReference(const ReferMethod& reference, unsigned target,
-                         const std::string& what);
+                         SymbolId what);
 
     class SymCache;
     class Object;
 
     SymCache *symcache;
 
-    std::vector<Object* > objects;
-    std::vector<std::pair<std::string, std::pair<unsigned, bool> > > defines;
-    std::vector<std::pair<ReferMethod, std::string> > referers;
+    std::vector<Object> objects;
+    std::vector<std::pair<SymbolId, std::pair<unsigned, bool> > > defines;
+    std::unordered_map<SymbolId, unsigned> define_index; // Into defines
+
+    struct Referer
+    {
+        ReferMethod method;
+        SymbolId    name;
+        bool        pending; // Cleared when resolved
+    };
+    std::vector<Referer> referers;
     unsigned num_groups_used;
     bool linked;
 };
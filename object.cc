@@ -2,8 +2,10 @@
 #include <list>
 #include <map>
 #include <set>
-
-#include <unistd.h> // For ftruncate
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <cstdint>
 
 #include "dataarea.hh"
 #include "assemble.hh"
@@ -11,10 +13,6 @@
 #include "relocdata.hh"
 #include "warning.hh"
 
-bool fix_jumps = false;
-
-extern bool assembly_errors;
-
 #define PROGNAME "nescom"
 
 #if !defined(__cpp_structured_bindings) || (__cpp_structured_bindings < 201606)
@@ -25,9 +23,9 @@ class Object::Segment
 {
     /// RELOCATION DATA (FOR O65 OUTPUT) ///
 public:
-    typedef Relocdata<std::string> RT; RT R;
+    typedef Relocdata<SymbolId> RT; RT R;
 public:
-    void CloseSegment();
+    void CloseSegment(Object& obj);
 
 
     /// COMPILETIME SYMBOLS AND REFERENCES ///
@@ -40,25 +38,27 @@ private:
         char type;        // "prefix"
         long value;       // what's added to it
 
-        std::string ref;
+        SymbolId ref;
         // On which scope level this was created on
         unsigned level;
+        // Creation order within the segment
+        unsigned seq;
 
     public:
-        Extern(unsigned o, char t, long v,
-               const std::string& r)
+        Extern(unsigned o, char t, long v, SymbolId r, unsigned n)
           : pos(o),
-            type(t), value(v), ref(r), level() { }
+            type(t), value(v), ref(r), level(), seq(n) { }
 
         char GetType() const { return type; }
         long GetValue() const { return value; }
 
         unsigned GetPos() const { return pos; }
 
-        const std::string& GetName() const { return ref; }
+        SymbolId GetName() const { return ref; }
 
         void SetScopeLevel(unsigned n) { level = n; }
         unsigned GetLevel() const { return level; }
+        unsigned GetSeq() const { return seq; }
 
         void Dump() const;
     };
@@ -93,10 +93,26 @@ private:
 
     std::list<Extern> Externs;
     std::list<Fixup> Fixups;
+
+    typedef std::list<Extern>::iterator ExternRef;
+    struct ResolvedExtern
+    {
+        ExternRef ext;
+        SegmentSelection targetseg;
+        unsigned targetoffset;
+    };
+    // Unresolved externs by name
+    std::unordered_map<SymbolId, std::vector<ExternRef> > PendingExterns;
+    // Resolved externs, by the scope level whose closing makes them fixups
+    std::map<unsigned, std::vector<ResolvedExtern> > ResolvedExterns;
 public:
-    void CheckExterns(unsigned CurScope, const Object& obj);
-    void AddExtern(char prefix, const std::string& ref,
+    void AddExtern(char prefix, SymbolId ref,
                       long value, unsigned CurScope);
+    // Called when "name" is defined on "level"
+    void ResolveExterns(SymbolId name, unsigned level,
+                        SegmentSelection seg, unsigned value, unsigned CurScope);
+    // Called when the scope "CurScope" closes
+    void MakeFixups(unsigned CurScope);
     void DumpExterns(const char *segname) const;
     void DumpFixups(const char *segname) const;
 
@@ -106,11 +122,11 @@ public:
 private:
     typedef std::set<unsigned> FlipPositionSet;
     FlipPositionSet FlipPositions;
+    // Word operands that point into zero page
+    std::set<unsigned> ZeroPageWords;
 public:
-    void FixFlipPositions();
-
-    bool ShouldFlipHere() const;
-    bool NeedsFlipping() const;
+    bool ShouldFlip(unsigned pos) const;
+    bool IsZeroPage(unsigned pos) const;
 
 
     /// MEMORY ///
@@ -123,7 +139,7 @@ public:
     void AddByte(unsigned char byte);
     void SetByte(unsigned offset, unsigned char byte);
 
-    void AddLump(const std::vector<unsigned char>& lump);
+    void AddLump(ByteSpan lump);
 
     unsigned char GetByte(unsigned offset) const;
     unsigned GetPos() const;
@@ -135,31 +151,34 @@ public:
 
     const std::vector<unsigned char> GetContent() const;
     const std::vector<unsigned char> GetContent(unsigned a,unsigned l) const;
+    ByteSpan GetView(unsigned a, unsigned l) const { return Data.GetView(a, l); }
+    template<typename F>
+    void VisitContent(unsigned a, unsigned l, F&& func) const { Data.VisitContent(a, l, func); }
     unsigned GetUtilization(unsigned begin, unsigned size) const;
 
     /// LABELS ///
 public:
-    typedef std::map<std::string, unsigned> LabelList;
+    typedef std::unordered_map<SymbolId, unsigned> LabelList;
     typedef std::map<unsigned, LabelList> LabelMap;
+    typedef std::vector<std::pair<SymbolId, unsigned> > SortedLabelList;
 private:
     LabelMap labels;
 
-    std::set<std::string> UnusedLabels;
-    void MarkLabelUsed(const std::string& s) { UnusedLabels.erase(s); }
+    std::unordered_set<SymbolId> UnusedLabels;
+    void MarkLabelUsed(SymbolId s) { UnusedLabels.erase(s); }
 public:
     const LabelMap& GetLabels() const { return labels; }
     LabelList& GetLabels(unsigned level) { return labels[level]; }
 
-    void ClearLabels(unsigned level);
+    // The labels of one level in name order, for output
+    static SortedLabelList SortLabels(const LabelList& list);
 
-    void DefineLabel(unsigned level, const std::string& name);
-    void DefineLabel(unsigned level, const std::string& name, unsigned value);
+    void ClearLabels(unsigned level, bool warn);
 
-    bool FindLabel(const std::string& name, unsigned level, unsigned& result) const;
-    bool FindLabel(const std::string& name, unsigned& result) const;
-    bool FindLabel(const std::string& name) const;
+    void DefineLabel(unsigned level, SymbolId name);
+    void DefineLabel(unsigned level, SymbolId name, unsigned value);
 
-    void UndefineLabel(const std::string& name);
+    void UndefineLabel(SymbolId name);
 
     void DumpLabels(const char *segname) const;
 
@@ -173,9 +192,7 @@ private:
 public:
     void ClearMost()
     {
-        FlipPositionSet tmp = FlipPositions;
         *this = Segment();
-        FlipPositions = tmp;
     }
 };
 
@@ -185,7 +202,7 @@ void Object::Segment::AddByte(unsigned char byte)
     Data.WriteByte(Position++, byte);
 }
 
-void Object::Segment::AddLump(const std::vector<unsigned char>& lump)
+void Object::Segment::AddLump(ByteSpan lump)
 {
     Data.WriteLump(Position, lump);
     Position += lump.size();
@@ -231,75 +248,53 @@ unsigned Object::Segment::GetUtilization(unsigned begin, unsigned size) const
     return Data.GetUtilization(begin, size);
 }
 
-void Object::Segment::ClearLabels(unsigned level)
+Object::Segment::SortedLabelList Object::Segment::SortLabels(const LabelList& list)
 {
-    LabelList& level_labels = GetLabels(level);
-
-    for(LabelList::const_iterator
-        i = level_labels.begin(); i !=level_labels.end(); ++i)
-    {
-        if(UnusedLabels.find(i->first) != UnusedLabels.end())
+    SortedLabelList result(list.begin(), list.end());
+    std::sort(result.begin(), result.end(),
+        [](const SortedLabelList::value_type& a, const SortedLabelList::value_type& b)
         {
-            if(MayWarn("unused-label"))
-            {
-                std::fprintf(stderr,
-                    "Warning: Unused label '%s'\n",
-                        i->first.c_str());
-            }
-            UnusedLabels.erase(i->first);
-        }
-    }
-
-    level_labels.clear();
+            return SymbolNameLess() (a.first, b.first);
+        });
+    return result;
 }
 
-bool Object::Segment::FindLabel(const std::string& name, unsigned level,
-                                unsigned& result) const
+void Object::Segment::ClearLabels(unsigned level, bool warn)
 {
-    LabelMap::const_iterator i = labels.find(level);
-    if(i == labels.end()) return false;
-    LabelList::const_iterator j = i->second.find(name);
-    if(j != i->second.end()) { result = j->second; return true; }
-    return false;
-}
+    LabelList& level_labels = GetLabels(level);
 
-bool Object::Segment::FindLabel(const std::string& name) const
-{
-    for(LabelMap::const_iterator
-        i = labels.begin();
-        i != labels.end(); ++i)
+    std::vector<SymbolId> unused;
+    for(LabelList::const_iterator
+        i = level_labels.begin(); i !=level_labels.end(); ++i)
     {
-        LabelList::const_iterator j = i->second.find(name);
-        if(j != i->second.end()) return true;
+        if(UnusedLabels.erase(i->first))
+            unused.push_back(i->first);
     }
-    return false;
-}
 
-bool Object::Segment::FindLabel(const std::string& name,
-                                unsigned& result) const
-{
-    for(LabelMap::const_iterator
-        i = labels.begin();
-        i != labels.end(); ++i)
+    if(!unused.empty() && warn && MayWarn("unused-label"))
     {
-        LabelList::const_iterator j = i->second.find(name);
-        if(j != i->second.end()) { result = j->second; return true; }
+        std::sort(unused.begin(), unused.end(), SymbolNameLess());
+        for(SymbolId id: unused)
+            std::fprintf(stderr,
+                "Warning: Unused label '%s'\n",
+                    SymbolName(id).c_str());
     }
-    return false;
+
+    level_labels.clear();
 }
 
-void Object::Segment::DefineLabel(unsigned level, const std::string& name, unsigned value)
+void Object::Segment::DefineLabel(unsigned level, SymbolId name, unsigned value)
 {
     UnusedLabels.insert(name);
     labels[level][name] = value;
 }
 
-void Object::Segment::DefineLabel(unsigned level, const std::string& name)
+void Object::Segment::DefineLabel(unsigned level, SymbolId name)
 {
     DefineLabel(level, name, GetPos());
 }
 
-void Object::Segment::UndefineLabel(const std::string& label)
+void Object::Segment::UndefineLabel(SymbolId label)
 {
     for(LabelMap::iterator
         i = labels.begin();
@@ -317,10 +312,11 @@ void Object::Segment::DumpLabels(const char *segname) const
         i != labels.end(); ++i)
     {
         // level -> labels
+        const SortedLabelList level_labels = SortLabels(i->second);
 
-        for(LabelList::const_iterator
-            j = i->second.begin();
-            j != i->second.end();
+        for(SortedLabelList::const_iterator
+            j = level_labels.begin();
+            j != level_labels.end();
             ++j)
         {
             // name -> address
@@ -333,14 +329,14 @@ void Object::Segment::DumpLabels(const char *segname) const
 
             std::fprintf(stderr, " %04X ", j->second);
             for(unsigned a=0; a<i->first; ++a) std::fprintf(stderr, "+");
-            std::fprintf(stderr, "%s\n", j->first.c_str());
+            std::fprintf(stderr, "%s\n", SymbolName(j->first).c_str());
         }
     }
 }
 
 void Object::Segment::Extern::Dump() const
 {
-    std::fprintf(stderr, " %04X %c%s", pos, type, ref.c_str());
+    std::fprintf(stderr, " %04X %c%s", pos, type, SymbolName(ref).c_str());
     if(value) std::fprintf(stderr, "%+ld", value);
     std::fprintf(stderr, "\n");
 }
@@ -352,49 +348,70 @@ void Object::Segment::Fixup::Dump() const
     std::fprintf(stderr, " to %d:%04X\n", (int)targetseg, targetoffset);
 }
 
-void Object::Segment::CheckExterns(unsigned CurScope, const Object& obj)
+void Object::Segment::ResolveExterns(SymbolId name, unsigned level,
+                                     SegmentSelection seg, unsigned value,
+                                     unsigned CurScope)
 {
-    // Resolve all externs so far.
-    // It's ok if not all are resolvable.
+    auto i = PendingExterns.find(name);
+    if(i == PendingExterns.end()) return;
 
-    for(std::list<Extern>::iterator
-        j, i=Externs.begin(); i!=Externs.end(); i=j)
+    /* An extern is checked when the scope it was created in closes,
+     * and again at each outer scope closing, against the labels that
+     * are visible outside of the closing scope. A label on this level
+     * stays visible until then only if the extern is from a deeper level.
+     */
+    std::vector<ExternRef>& waiting = i->second;
+    std::size_t kept = 0;
+    for(ExternRef ext: waiting)
     {
-        j=i; ++j;
+        if(ext->GetLevel() <= level)
+        {
+            waiting[kept++] = ext;
+            continue;
+        }
+        MarkLabelUsed(name);
 
-        // Skip it, if it's not its time yet
-        if(i->GetLevel() < CurScope) continue;
+        const unsigned closing = std::min(CurScope, ext->GetLevel());
+        ResolvedExterns[closing].push_back(ResolvedExtern{ext, seg, value});
+    }
+    waiting.resize(kept);
+    if(waiting.empty()) PendingExterns.erase(i);
+}
 
-        const std::string& ref = i->GetName();
+void Object::Segment::MakeFixups(unsigned CurScope)
+{
+    auto i = ResolvedExterns.find(CurScope);
+    if(i == ResolvedExterns.end()) return;
 
-        for(unsigned scope=CurScope; scope-- > 0; )
+    std::vector<ResolvedExtern>& resolved = i->second;
+    std::sort(resolved.begin(), resolved.end(),
+        [](const ResolvedExtern& a, const ResolvedExtern& b)
         {
-            unsigned targetaddr=0;
-            SegmentSelection targetseg;
-            if(obj.FindLabel(ref, scope, targetseg, targetaddr))
-            {
-                MarkLabelUsed(ref);
+            return a.ext->GetSeq() < b.ext->GetSeq();
+        });
 
-                const unsigned pos = i->GetPos();
-                const char prefix = i->GetType();
-                const long value  = i->GetValue();
+    for(const ResolvedExtern& r: resolved)
+    {
+        const unsigned pos = r.ext->GetPos();
+        const char prefix = r.ext->GetType();
+        const long value  = r.ext->GetValue();
 
-                Fixup newref(pos, prefix, value, targetseg, targetaddr);
-                Fixups.push_back(newref);
-                Externs.erase(i);
-                break;
-            }
-        }
+        Fixup newref(pos, prefix, value, r.targetseg, r.targetoffset);
+        Fixups.push_back(newref);
+        Externs.erase(r.ext);
     }
+    ResolvedExterns.erase(i);
 }
 
-void Object::Segment::AddExtern(char prefix, const std::string& ref,
+void Object::Segment::AddExtern(char prefix, SymbolId ref,
                                 long value, unsigned CurScope)
 {
     const unsigned pos = GetPos();
-    Extern newext(pos, prefix, value, ref);
+    // Each extern stays in one of the two lists, so this counts them
+    Extern newext(pos, prefix, value, ref, Externs.size() + Fixups.size());
     newext.SetScopeLevel(CurScope);
     Externs.push_back(newext);
+    PendingExterns[ref].push_back(std::prev(Externs.end()));
 }
 
 void Object::Segment::DumpExterns(const char *segname) const
@@ -417,43 +434,20 @@ void Object::Segment::DumpFixups(const char *segname) const
         i->Dump();
 }
 
-bool Object::Segment::ShouldFlipHere() const
-{
-    return FlipPositions.find(GetPos()) != FlipPositions.end();
-}
-
-bool Object::Segment::NeedsFlipping() const
+bool Object::Segment::ShouldFlip(unsigned pos) const
 {
-    return !FlipPositions.empty();
+    return FlipPositions.find(pos) != FlipPositions.end();
 }
 
-void Object::Segment::FixFlipPositions()
+bool Object::Segment::IsZeroPage(unsigned pos) const
 {
-    // Flipping always grows the code a bit.
-    // Count the amount of flipping needed in each segment.
-
-    unsigned offset_amount = 0;
-
-    FlipPositionSet new_set;
-
-    for(FlipPositionSet::const_iterator
-        i = FlipPositions.begin();
-        i != FlipPositions.end();
-        ++i)
-    {
-        unsigned address = *i;
-        new_set.insert(address + offset_amount);
-
-        offset_amount += 3; // grows by 3 bytes
-    }
-
-    FlipPositions = new_set;
+    return ZeroPageWords.find(pos) != ZeroPageWords.end();
 }
 
-
-void Object::Segment::CloseSegment()
+void Object::Segment::CloseSegment(Object& obj)
 {
     FlipPositions.clear();
+    ZeroPageWords.clear();
 
     for(std::list<Extern>::const_iterator
         i=Externs.begin(); i!=Externs.end(); ++i)
@@ -462,7 +456,7 @@ void Object::Segment::CloseSegment()
 
         const unsigned     address = ref.GetPos();
               long           value = ref.GetValue();
-        const std::string&    name = ref.GetName();
+        const SymbolId        name = ref.GetName();
 
         switch(ref.GetType())
         {
@@ -510,9 +504,9 @@ void Object::Segment::CloseSegment()
             case FORCE_REL8:
             {
                 std::fprintf(stderr,
-                    "Error: Unresolved short relative '%s'\n", name.c_str()
+                    "Error: Unresolved short relative '%s'\n", SymbolName(name).c_str()
                             );
-                assembly_errors = true;
+                obj.SetError();
                 break;
             }
         }
@@ -550,6 +544,9 @@ void Object::Segment::CloseSegment()
                 R.R16.AddFixup(seg, address);
                 SetByte(address,   value & 0xFF);
                 SetByte(address+1, (value >> 8) & 0xFF);
+
+                if(seg == ZERO && value >= 0 && value < 0x100 && obj.GetFixZeroPage())
+                    ZeroPageWords.insert(address);
                 break;
             }
             case FORCE_LONG:
@@ -571,13 +568,9 @@ void Object::Segment::CloseSegment()
             {
                 const long diff = value - (long)address - 1;
 
-                int threshold = 0;
-                extern bool already_reprocessed; /* Ugly hack */
-                if(!already_reprocessed) threshold = 20;
-
-                if(diff < -0x80+threshold || diff >= 0x80-threshold)
+                if(diff < -0x80 || diff >= 0x80)
                 {
-                    if(fix_jumps)
+                    if(obj.GetFixJumps())
                     {
                         if(MayWarn("jumps"))
                         {
@@ -592,7 +585,7 @@ void Object::Segment::CloseSegment()
                     {
                         std::fprintf(stderr,
                             "Error: Short jump out of range (%ld) at $%X\n", diff, address);
-                        assembly_errors = true;
+                        obj.SetError();
                     }
                 }
 
@@ -605,8 +598,6 @@ void Object::Segment::CloseSegment()
 
     //Externs.clear();
     //Fixups.clear();
-
-    FixFlipPositions();
 }
 
 Object::Segment& Object::GetSeg()
@@ -633,32 +624,20 @@ const Object::Segment& Object::GetSeg() const
     return *code;
 }
 
-bool Object::FindLabel(const std::string& s) const
+bool Object::FindLabel(SymbolId s) const
 {
-    return code->FindLabel(s)
-        || data->FindLabel(s)
-        || zero->FindLabel(s)
-        || bss->FindLabel(s);
+    return LabelTable.find(s) != LabelTable.end();
 }
 
-bool Object::FindLabel(const std::string& name, unsigned level,
+bool Object::FindLabel(SymbolId name,
                        SegmentSelection& seg, unsigned& result) const
 {
-    if(code->FindLabel(name, level, result)) { seg=CODE; return true; }
-    if(data->FindLabel(name, level, result)) { seg=DATA; return true; }
-    if(zero->FindLabel(name, level, result)) { seg=ZERO; return true; }
-    if(bss->FindLabel(name, level, result)) { seg=BSS; return true; }
-    return false;
-}
+    auto i = LabelTable.find(name);
+    if(i == LabelTable.end()) return false;
 
-bool Object::FindLabel(const std::string& name,
-                       SegmentSelection& seg, unsigned& result) const
-{
-    if(code->FindLabel(name, result)) { seg=CODE; return true; }
-    if(data->FindLabel(name, result)) { seg=DATA; return true; }
-    if(zero->FindLabel(name, result)) { seg=ZERO; return true; }
-    if(bss->FindLabel(name, result)) { seg=BSS; return true; }
-    return false;
+    seg    = i->second.back().seg;
+    result = i->second.back().value;
+    return true;
 }
 
 void Object::StartScope()
@@ -668,10 +647,10 @@ void Object::StartScope()
 
 void Object::EndScope()
 {
-    code->CheckExterns(CurScope, *this);
-    data->CheckExterns(CurScope, *this);
-    zero->CheckExterns(CurScope, *this);
-    bss->CheckExterns(CurScope, *this);
+    code->MakeFixups(CurScope);
+    data->MakeFixups(CurScope);
+    zero->MakeFixups(CurScope);
+    bss->MakeFixups(CurScope);
 
     if(CurScope > 0)
     {
@@ -681,18 +660,46 @@ void Object::EndScope()
         // because they are to become public.
         if(CurScope > 1)
         {
-            code->ClearLabels(CurScope-1);
-            data->ClearLabels(CurScope-1);
-            zero->ClearLabels(CurScope-1);
-            bss->ClearLabels(CurScope-1);
+            ClearLabels(*code, CurScope-1);
+            ClearLabels(*data, CurScope-1);
+            ClearLabels(*zero, CurScope-1);
+            ClearLabels( *bss, CurScope-1);
         }
     }
     --CurScope;
 }
 
-void Object::AddExtern(char prefix, const std::string& ref, long value)
+void Object::ClearLabels(Segment& seg, unsigned level)
+{
+    const Segment::LabelList& level_labels = seg.GetLabels(level);
+    for(Segment::LabelList::const_iterator
+        i = level_labels.begin(); i != level_labels.end(); ++i)
+    {
+        auto j = LabelTable.find(i->first);
+        if(j == LabelTable.end()) continue;
+
+        std::vector<LabelDef>& defs = j->second;
+        for(std::size_t k = defs.size(); k-- > 0; )
+            if(defs[k].level == level)
+            {
+                defs.erase(defs.begin() + k);
+                break;
+            }
+        if(defs.empty()) LabelTable.erase(j);
+    }
+    seg.ClearLabels(level, !already_reprocessed);
+}
+
+void Object::AddExtern(char prefix, SymbolId ref, long value)
 {
     GetSeg().AddExtern(prefix, ref, value, CurScope);
+
+    auto i = LabelTable.find(ref);
+    if(i != LabelTable.end())
+    {
+        const LabelDef& def = i->second.back();
+        GetSeg().ResolveExterns(ref, def.level, def.seg, def.value, CurScope);
+    }
 }
 
 void Object::DefineLabel(const std::string& label)
@@ -700,6 +707,11 @@ void Object::DefineLabel(const std::string& label)
     DefineLabel(label, GetPos());
 }
 
+void Object::DefineLabel(SymbolId label)
+{
+    DefineLabel(label, GetPos());
+}
+
 unsigned Object::GetPos() const
 {
     return GetSeg().GetPos();
@@ -725,36 +737,61 @@ std::vector<unsigned char> Object::GetContent(unsigned begin, unsigned size) con
     return GetSeg().GetContent(begin, size);
 }
 
+ByteSpan Object::GetView(unsigned begin, unsigned size) const
+{
+    return GetSeg().GetView(begin, size);
+}
+
 unsigned Object::GetUtilization(unsigned begin, unsigned size) const
 {
     return GetSeg().GetUtilization(begin, size);
 }
 
-void Object::DefineLabel(const std::string& label, unsigned value)
+SymbolId Object::LabelScope(std::string_view s, unsigned& scopenum) const
 {
-    std::string s = label;
-    // Find out which scope to define it in
-    unsigned scopenum = CurScope-1;
-    if(s[0] == '+')
+    scopenum = CurScope-1;
+    if(!s.empty() && s[0] == '+')
     {
         // global label
-        s = s.substr(1);
+        s.remove_prefix(1);
         scopenum = 0;
     }
-    while(s[0] == '&' && CurScope > 0)
+    while(!s.empty() && s[0] == '&' && CurScope > 0)
     {
-        s = s.substr(1);
+        s.remove_prefix(1);
         --scopenum;
     }
+    return InternSymbol(s);
+}
 
-    if(FindLabel(s))
+void Object::DefineLabel(const std::string& label, unsigned value)
+{
+    unsigned scopenum;
+    const SymbolId name = LabelScope(label, scopenum);
+    DefineLabel(scopenum, name, value);
+}
+
+void Object::DefineLabel(SymbolId label, unsigned value)
+{
+    DefineLabel(CurScope-1, label, value);
+}
+
+void Object::DefineLabel(unsigned scopenum, SymbolId label, unsigned value)
+{
+    if(FindLabel(label))
     {
-        std::fprintf(stderr, "Error: Label '%s' already defined\n", s.c_str());
-        assembly_errors = true;
+        std::fprintf(stderr, "Error: Label '%s' already defined\n", SymbolName(label).c_str());
+        SetError();
         return;
     }
 
-    GetSeg().DefineLabel(scopenum, s, value);
+    GetSeg().DefineLabel(scopenum, label, value);
+    LabelTable[label].push_back(LabelDef{scopenum, CurSegment, value});
+
+    code->ResolveExterns(label, scopenum, CurSegment, value, CurScope);
+    data->ResolveExterns(label, scopenum, CurSegment, value, CurScope);
+    zero->ResolveExterns(label, scopenum, CurSegment, value, CurScope);
+    bss->ResolveExterns(label, scopenum, CurSegment, value, CurScope);
 }
 
 void Object::SetPos(unsigned newpos)
@@ -762,8 +799,9 @@ void Object::SetPos(unsigned newpos)
     GetSeg().SetPos(newpos);
 }
 
-void Object::UndefineLabel(const std::string& label)
+void Object::UndefineLabel(SymbolId label)
 {
+    LabelTable.erase(label);
     code->UndefineLabel(label);
     data->UndefineLabel(label);
     zero->UndefineLabel(label);
@@ -772,89 +810,90 @@ void Object::UndefineLabel(const std::string& label)
 
 void Object::CloseSegments()
 {
-    code->CloseSegment();
-    data->CloseSegment();
-    zero->CloseSegment();
-    bss->CloseSegment();
+    code->CloseSegment(*this);
+    data->CloseSegment(*this);
+    zero->CloseSegment(*this);
+    bss->CloseSegment(*this);
 }
 
 namespace
 {
-    void PutC(unsigned char c, std::FILE* fp)
+    void PutC(unsigned char c, OutputBuffer& out)
     {
         // 8-bit output.
-        std::fputc(c, fp);
+        out.PutC(c);
     }
-    void PutS(const void* s, unsigned n, std::FILE* fp)
+    void PutS(const void* s, unsigned n, OutputBuffer& out)
     {
-        std::fwrite(s, n, 1, fp);
-        //for(unsigned a=0; a<n; ++a) PutC(s[a], fp);
+        out.PutS(s, n);
     }
-    void PutW(unsigned short w, std::FILE* fp)
+    void PutW(unsigned short w, OutputBuffer& out)
     {
         // 16-bit lsb-first O65 output.
-        PutC(w & 0xFF, fp);
-        PutC(w >> 8,  fp);
+        PutC(w & 0xFF, out);
+        PutC(w >> 8,  out);
     }
-    void PutMW(unsigned short w, std::FILE* fp)
+    void PutMW(unsigned short w, OutputBuffer& out)
     {
         // 16-bit msb-first IPS output.
-        PutC(w >> 8,  fp);
-        PutC(w & 0xFF, fp);
+        PutC(w >> 8,  out);
+        PutC(w & 0xFF, out);
     }
-    void PutD(unsigned int w, std::FILE* fp)
+    void PutD(unsigned int w, OutputBuffer& out)
     {
         // 32-bit lsb-first O65 output.
-        PutW(w & 0xFFFF, fp);
-        PutW(w >> 16,    fp);
+        PutW(w & 0xFFFF, out);
+        PutW(w >> 16,    out);
     }
-    void PutL(unsigned int w, std::FILE* fp)
+    void PutL(unsigned int w, OutputBuffer& out)
     {
         // 24-bit msb-first IPS output.
-        PutC((w >> 16) & 0xFF, fp);
-        PutC((w >> 8) & 0xFF, fp);
-        PutC(w & 0xFF, fp);
+        PutC((w >> 16) & 0xFF, out);
+        PutC((w >> 8) & 0xFF, out);
+        PutC(w & 0xFF, out);
     }
-    void PutWD(unsigned int w, std::FILE* fp, bool Use32)
+    void PutWD(unsigned int w, OutputBuffer& out, bool Use32)
     {
         // 16 or 32-bit lsb-first O65 output.
-        if(Use32) PutD(w, fp); else PutW(w, fp);
+        if(Use32) PutD(w, out); else PutW(w, out);
     }
-    void PutCustomHeader(std::FILE* fp, int type, int param1, int param2)
+    void PutCustomHeader(OutputBuffer& out, int type, int param1, int param2)
     {
-        PutC(7,      fp); // length: 1+1 + 1 + 4
-        PutC(type,   fp);
-        PutC(param1, fp);
-        PutD(param2, fp);
+        PutC(7,      out); // length: 1+1 + 1 + 4
+        PutC(type,   out);
+        PutC(param1, out);
+        PutD(param2, out);
     }
-    void PutCustomHeader(std::FILE* fp, int type, const std::string& s)
+    void PutCustomHeader(OutputBuffer& out, int type, const std::string& s)
     {
-        PutC(s.size()+3, fp); // length: 1+1+string+1
-        PutC(type,       fp);
-        PutS(s.c_str(),  s.size()+1, fp);
+        PutC(s.size()+3, out); // length: 1+1+string+1
+        PutC(type,       out);
+        PutS(s.c_str(),  s.size()+1, out);
     }
 
     struct Unresolved
     {
-        std::map<std::string, unsigned> str2num;
-        std::vector<std::string> num2str;
+        std::unordered_map<SymbolId, unsigned> str2num;
+        std::vector<SymbolId> num2str;
         unsigned size() const { return num2str.size(); }
 
-        void Add(const std::string& name)
+        void Add(SymbolId name)
         {
-            if(str2num.find(name) != str2num.end()) return;
-            str2num[name] = num2str.size();
-            num2str.push_back(name);
+            if(str2num.emplace(name, num2str.size()).second)
+                num2str.push_back(name);
         }
 
-        void Put(std::FILE* fp, bool use32)
+        void Put(OutputBuffer& out, bool use32)
         {
-            PutWD(size(), fp, use32);
+            PutWD(size(), out, use32);
             for(unsigned a=0; a<size(); ++a)
-                PutS(num2str[a].c_str(), num2str[a].size()+1, fp);
+            {
+                const std::string& name = SymbolName(num2str[a]);
+                PutS(name.c_str(), name.size()+1, out);
+            }
         }
 
-        unsigned Find(const std::string& s) const
+        unsigned Find(SymbolId s) const
         {
             return str2num.find(s)->second;
         }
@@ -887,7 +926,7 @@ namespace
 
     void PutReloc(const Object::Segment& seg,
                   struct Unresolved& syms,
-                  std::FILE* fp)
+                  OutputBuffer& out)
     {
         // Address-sorted table of relocs in binary format.
         RelocMap relocs;
@@ -1000,19 +1039,19 @@ namespace
             }
             while(diff > 254)
             {
-                PutC(255, fp);
+                PutC(255, out);
                 diff -= 254;
             }
-            PutC(diff, fp);
+            PutC(diff, out);
             addr = new_addr;
-            PutS(i->second.data(), i->second.size(), fp);
+            PutS(i->second.data(), i->second.size(), out);
         }
-        PutC(0, fp);
+        PutC(0, out);
     }
 
     unsigned PutLabels(const Object::Segment& seg,
                        SegmentSelection segtype,
-                       std::FILE* fp,
+                       OutputBuffer& out,
                        bool use32)
     {
         const unsigned char segid = GetSegmentID(segtype);
@@ -1026,22 +1065,24 @@ namespace
         {
             count += i->second.size();
         }
-        //PutWD(count, fp, use32);
+        //PutWD(count, out, use32);
 
         // Put labels
         for(LabelMap::const_iterator i = labels.begin(); i != labels.end(); ++i)
         {
-            for(Object::Segment::LabelList::const_iterator
-                j = i->second.begin();
-                j != i->second.end();
+            const Object::Segment::SortedLabelList level_labels
+                = Object::Segment::SortLabels(i->second);
+            for(Object::Segment::SortedLabelList::const_iterator
+                j = level_labels.begin();
+                j != level_labels.end();
                 ++j)
             {
                 unsigned addr           = j->second;
-                const std::string& name = j->first;
+                const std::string& name = SymbolName(j->first);
 
-                PutS(name.c_str(), name.size()+1, fp);
-                PutC(segid, fp);
-                PutWD(addr, fp, use32);
+                PutS(name.c_str(), name.size()+1, out);
+                PutC(segid, out);
+                PutWD(addr, out, use32);
             }
         }
 
@@ -1073,7 +1114,137 @@ namespace
         return make_pair(IPS_ADDRESS_EXTERN, patch);
     }
 
-    void IPSwriteSeg(const Object::Segment& seg, std::FILE* fp)
+    bool IPSreserved(unsigned addr)
+    {
+        return addr == IPS_EOF_MARKER
+            || addr == IPS_ADDRESS_EXTERN
+            || addr == IPS_ADDRESS_GLOBAL;
+    }
+
+    void IPScheckAddress(unsigned addr, bool& errors)
+    {
+        if(addr == IPS_EOF_MARKER)
+        {
+            fprintf(stderr,
+                "Error: IPS doesn't allow patches that go to $%X\n", addr);
+            errors = true;
+        }
+        else if(addr == IPS_ADDRESS_EXTERN)
+        {
+            fprintf(stderr,
+                "Error: Address $%X is reserved for IPS_ADDRESS_EXTERN\n", addr);
+            errors = true;
+        }
+        else if(addr == IPS_ADDRESS_GLOBAL)
+        {
+            fprintf(stderr,
+                "Error: Address $%X is reserved for IPS_ADDRESS_GLOBAL\n", addr);
+            errors = true;
+        }
+        else if(addr > 0xFFFFFF)
+        {
+            fprintf(stderr,
+                "Error: Address $%X is too big for IPS format\n", addr);
+            errors = true;
+        }
+    }
+
+    /* Writes "size" bytes of the segment from "addr" on, as records
+     * of at most "limit" bytes. RLE records repeat the byte at "addr".
+     * The records don't begin at reserved addresses, unless the first one must.
+     */
+    void IPSwriteRecords(const Object::Segment& seg, unsigned addr, unsigned size,
+                         bool rle, unsigned limit,
+                         OutputBuffer& out, bool& errors)
+    {
+        const unsigned char fill = rle ? seg.GetView(addr, 1)[0] : 0;
+        while(size > 0)
+        {
+            unsigned count = std::min(size, limit);
+            if(count < size && IPSreserved(addr + count)) --count;
+
+            IPScheckAddress(addr, errors);
+            PutL(addr, out);
+            if(rle)
+            {
+                PutMW(0, out);
+                PutMW(count, out);
+                PutC(fill, out);
+            }
+            else
+            {
+                PutMW(count, out);
+                seg.VisitContent(addr, count, [&](unsigned, ByteSpan view)
+                {
+                    PutS(view.data(), view.size(), out);
+                });
+            }
+            addr += count;
+            size -= count;
+        }
+    }
+
+    /* Writes a blob of the segment as literal and RLE records, whichever
+     * make it shorter. A literal record costs 5 bytes plus the data; an RLE
+     * record costs 8. Literal stretches longer than 20000 bytes are split
+     * into several records, whose extra headers are not counted here, so
+     * the choice is not always the best one for such long stretches.
+     */
+    void IPSwriteBlob(const Object::Segment& seg, unsigned addr, unsigned size,
+                      OutputBuffer& out, bool& errors)
+    {
+        // Where each run of identical bytes begins
+        std::vector<unsigned> runs;
+        unsigned char prev = 0;
+        seg.VisitContent(addr, size, [&](unsigned where, ByteSpan view)
+        {
+            for(unsigned a=0; a<view.size(); ++a)
+            {
+                if((where == addr && !a) || view[a] != prev)
+                    runs.push_back(where - addr + a);
+                prev = view[a];
+            }
+        });
+        const unsigned nruns = runs.size();
+        runs.push_back(size);
+
+        /* From each run to the end, the least bytes needed
+         * when a record begins at the run (fresh),
+         * or when the run continues a literal record (literal).
+         * A record can't begin at a reserved address.
+         */
+        const std::uint64_t Never = std::uint64_t(1) << 62;
+        std::vector<std::uint64_t> fresh(nruns+1, 0), literal(nruns+1, 0);
+        std::vector<bool> use_rle(nruns), close_literal(nruns);
+        for(unsigned j = nruns; j-- > 0; )
+        {
+            const unsigned length = runs[j+1] - runs[j];
+
+            close_literal[j] = fresh[j+1] < literal[j+1];
+            literal[j] = length + std::min(fresh[j+1], literal[j+1]);
+
+            const std::uint64_t rle = 8 * ((length + 0xFFFEu) / 0xFFFFu) + fresh[j+1];
+            use_rle[j] = rle <= 5 + literal[j];
+            fresh[j]   = use_rle[j] ? rle : 5 + literal[j];
+
+            if(j > 0 && IPSreserved(addr + runs[j])) fresh[j] = Never;
+        }
+
+        for(unsigned j = 0; j < nruns; )
+        {
+            const unsigned begin = runs[j];
+            unsigned next = j+1;
+            if(!use_rle[j])
+                while(next < nruns && !close_literal[next-1]) ++next;
+
+            IPSwriteRecords(seg, addr + begin, runs[next] - begin,
+                            use_rle[j], use_rle[j] ? 0xFFFFu : 20000u,
+                            out, errors);
+            j = next;
+        }
+    }
+
+    void IPSwriteSeg(const Object::Segment& seg, OutputBuffer& out, bool& errors)
     {
         typedef Object::Segment::LabelMap LabelMap;
         const LabelMap& labels = seg.GetLabels();
@@ -1083,12 +1254,14 @@ namespace
         // Put labels (this is DarkForce's extension)
         for(LabelMap::const_iterator i = labels.begin(); i != labels.end(); ++i)
         {
-            for(Object::Segment::LabelList::const_iterator
-                j = i->second.begin();
-                j != i->second.end();
+            const Object::Segment::SortedLabelList level_labels
+                = Object::Segment::SortLabels(i->second);
+            for(Object::Segment::SortedLabelList::const_iterator
+                j = level_labels.begin();
+                j != level_labels.end();
                 ++j)
             {
-                patches.push_back(BuildGlobalPatch(j->first, (j->second)));
+                patches.push_back(BuildGlobalPatch(SymbolName(j->first), (j->second)));
             }
         }
 
@@ -1103,28 +1276,28 @@ namespace
 
         WalkList(R16lo, Reloc)
         {
-            patches.push_back(BuildExternPatch((i->first), i->second, 1));
+            patches.push_back(BuildExternPatch((i->first), SymbolName(i->second), 1));
         }
 
         WalkList(R16, Reloc)
         {
-            patches.push_back(BuildExternPatch((i->first), i->second, 2));
+            patches.push_back(BuildExternPatch((i->first), SymbolName(i->second), 2));
         }
 
         WalkList(R24, Reloc)
         {
-            patches.push_back(BuildExternPatch((i->first), i->second, 3));
+            patches.push_back(BuildExternPatch((i->first), SymbolName(i->second), 3));
         }
 
         if(!seg.R.R16hi.Relocs.empty())
         {
             fprintf(stderr, "Error: Hi-byte-type externs aren't supported in IPS format.\n");
-            assembly_errors = true;
+            errors = true;
         }
         if(!seg.R.R24seg.Relocs.empty())
         {
             fprintf(stderr, "Error: Segment-type externs aren't supported in IPS format.\n");
-            assembly_errors = true;
+            errors = true;
         }
 
         for(std::list<std::pair<unsigned, std::string> >::const_iterator
@@ -1132,9 +1305,9 @@ namespace
             i != patches.end();
             ++i)
         {
-            PutL(i->first, fp);
-            PutMW(i->second.size(), fp);
-            PutS(i->second.data(), i->second.size(), fp);
+            PutL(i->first, out);
+            PutMW(i->second.size(), out);
+            PutS(i->second.data(), i->second.size(), out);
         }
 
         unsigned addr = 0;
@@ -1144,52 +1317,13 @@ namespace
             addr = seg.FindNextBlob(addr, size);
             if(!size) break;
 
-            for(unsigned left = size; left > 0; )
-            {
-                unsigned count = std::min(left, 20000u);
-
-                //fprintf(stderr, "Writing %u @ %06X\n", count, addr);
-
-                if(addr == IPS_EOF_MARKER)
-                {
-                    fprintf(stderr,
-                        "Error: IPS doesn't allow patches that go to $%X\n", addr);
-                    assembly_errors = true;
-                }
-                else if(addr == IPS_ADDRESS_EXTERN)
-                {
-                    fprintf(stderr,
-                        "Error: Address $%X is reserved for IPS_ADDRESS_EXTERN\n", addr);
-                    assembly_errors = true;
-                }
-                else if(addr == IPS_ADDRESS_GLOBAL)
-                {
-                    fprintf(stderr,
-                        "Error: Address $%X is reserved for IPS_ADDRESS_GLOBAL\n", addr);
-                    assembly_errors = true;
-                }
-                else if(addr > 0xFFFFFF)
-                {
-                    fprintf(stderr,
-                        "Error: Address $%X is too big for IPS format\n", addr);
-                    assembly_errors = true;
-                }
-
-                PutL(addr, fp);
-                PutMW(count, fp);
-
-                std::vector<unsigned char> data = seg.GetContent(addr, count);
-
-                PutS(&data[0], count, fp);
-
-                left -= count;
-                addr += count;
-            }
+            IPSwriteBlob(seg, addr, size, out, errors);
+            addr += size;
         }
     }
 
-    void RAWwriteSeg(const Object::Segment& seg, std::FILE* fp, unsigned offset,
-                     unsigned skip=0, unsigned limit=0)
+    void RAWwriteSeg(const Object::Segment& seg, OutputBuffer& out, bool& errors,
+                     unsigned offset, unsigned skip=0, unsigned limit=0)
     {
         if(!limit)
         {
@@ -1218,40 +1352,43 @@ namespace
                 /*fprintf(stderr, "fileoffs=$%X, skip=$%X limit=$%X\n",
                     b.first, b.second.first, b.second.second
                 );*/
-                RAWwriteSeg(seg, fp, offset, b.second.first, b.second.second);
+                RAWwriteSeg(seg, out, errors, offset, b.second.first, b.second.second);
             }
             return;
         }
 
-        std::vector<unsigned char> lump = seg.GetContent(skip,
-            std::min(limit, seg.GetSize() - skip)
-        );
-        if(std::any_of(lump.begin(), lump.end(), [&](unsigned n){return n!=0;}))
+        const unsigned size = std::min(limit, seg.GetSize() - skip);
+        bool nonzero = false;
+        seg.VisitContent(skip, size, [&](unsigned, ByteSpan view)
+        {
+            nonzero = nonzero || std::any_of(view.begin(), view.end(), [&](unsigned n){return n!=0;});
+        });
+        if(nonzero)
         {
             if(!seg.R.R16.Relocs.empty())
             {
                 fprintf(stderr, "Error: 16-bit externs aren't supported in RAW format.\n");
-                assembly_errors = true;
+                errors = true;
             }
             if(!seg.R.R16lo.Relocs.empty())
             {
                 fprintf(stderr, "Error: Lo-byte-type externs aren't supported in RAW format.\n");
-                assembly_errors = true;
+                errors = true;
             }
             if(!seg.R.R16hi.Relocs.empty())
             {
                 fprintf(stderr, "Error: Hi-byte-type externs aren't supported in RAW format.\n");
-                assembly_errors = true;
+                errors = true;
             }
             if(!seg.R.R24.Relocs.empty())
             {
                 fprintf(stderr, "Error: 24-bit externs aren't supported in RAW format.\n");
-                assembly_errors = true;
+                errors = true;
             }
             if(!seg.R.R24seg.Relocs.empty())
             {
                 fprintf(stderr, "Error: Segment-type externs aren't supported in RAW format.\n");
-                assembly_errors = true;
+                errors = true;
             }
 
             /*if(!seg.GetLabels().empty())
@@ -1260,8 +1397,8 @@ namespace
             }*/
 
             unsigned base = offset + NES2ROMaddr(skip);
-            fprintf(stderr, "Writing a seg with base=$%X, size=$%zX to offset $%X\n",
-                skip, lump.size(), base);
+            fprintf(stderr, "Writing a seg with base=$%X, size=$%X to offset $%X\n",
+                skip, size, base);
 
             /*if(base > offset)
             {
@@ -1271,9 +1408,11 @@ namespace
                     base-offset);
             }*/
 
-            std::fseek(fp, base, SEEK_SET);
-            PutS(&lump[0], lump.size(), fp);
-            std::fflush(fp);
+            out.Seek(base);
+            seg.VisitContent(skip, size, [&](unsigned, ByteSpan view)
+            {
+                PutS(view.data(), view.size(), out);
+            });
         }
         /*else
             fprintf(stderr, "- skipped, all %zu zero\n", lump.size());*/
@@ -1287,7 +1426,7 @@ namespace
     }
 };
 
-void Object::WriteO65(std::FILE* fp)
+void Object::WriteO65(OutputBuffer& out)
 {
     /* Building the map now so it can be used in the use32 test */
     Unresolved externs;
@@ -1323,26 +1462,26 @@ void Object::WriteO65(std::FILE* fp)
     if(use32) Mode |= 0x2000; // Use 32-bit addresses
 
     // Put O65 headerl
-    PutS("\1\0o65\0", 6, fp);
+    PutS("\1\0o65\0", 6, out);
 
     // Put Mode
-    PutW(Mode, fp);
+    PutW(Mode, out);
 
     //text
-    PutWD(code->GetBase(), fp, use32);
-    PutWD(code->GetSize(), fp, use32);
+    PutWD(code->GetBase(), out, use32);
+    PutWD(code->GetSize(), out, use32);
     //data
-    PutWD(data->GetBase(), fp, use32);
-    PutWD(data->GetSize(), fp, use32);
+    PutWD(data->GetBase(), out, use32);
+    PutWD(data->GetSize(), out, use32);
     //bss
-    PutWD(bss->GetBase(), fp, use32);
-    PutWD(bss->GetSize(), fp, use32);
+    PutWD(bss->GetBase(), out, use32);
+    PutWD(bss->GetSize(), out, use32);
     //zero
-    PutWD(zero->GetBase(), fp, use32);
-    PutWD(zero->GetSize(), fp, use32);
+    PutWD(zero->GetBase(), out, use32);
+    PutWD(zero->GetSize(), out, use32);
 
     // stack size - 0 = undefined
-    PutWD(0x0000, fp, use32);
+    PutWD(0x0000, out, use32);
 
     for(auto [segtype,segptr]: std::initializer_list<std::pair<SegmentSelection,Segment*>>
                                {{CODE,code},{DATA,data},{BSS,bss},{ZERO,zero}})
@@ -1350,44 +1489,47 @@ void Object::WriteO65(std::FILE* fp)
         switch(segptr->Linkage.type)
         {
             case LinkageWish::LinkInGroup:
-                PutCustomHeader(fp, 10, segtype*8+1, segptr->Linkage.GetGroup());
+                PutCustomHeader(out, 10, segtype*8+1, segptr->Linkage.GetGroup());
                 break;
             case LinkageWish::LinkThisPage:
-                PutCustomHeader(fp, 10, segtype*8+2, segptr->Linkage.GetPage());
+                PutCustomHeader(out, 10, segtype*8+2, segptr->Linkage.GetPage());
                 break;
 
             default: /* ignore */ break;
         }
     }
 
-    PutCustomHeader(fp, 2, PROGNAME " " VERSION);
+    PutCustomHeader(out, 2, PROGNAME " " VERSION);
 
     // end custom headers
-    PutC(0, fp);
+    PutC(0, out);
 
-    std::fwrite(&code->GetContent()[0], code->GetSize(), 1, fp);
-    std::fwrite(&data->GetContent()[0], data->GetSize(), 1, fp);
+    for(const Segment* seg: {code, data})
+        seg->VisitContent(seg->GetBase(), seg->GetSize(), [&](unsigned, ByteSpan view)
+        {
+            out.PutS(view);
+        });
 
-    externs.Put(fp, use32);
+    externs.Put(out, use32);
 
-    PutReloc(*code, externs, fp);
-    PutReloc(*data, externs, fp);
+    PutReloc(*code, externs, out);
+    PutReloc(*data, externs, out);
 
     unsigned n_labels = 0;
-    long labels_pos = std::ftell(fp);
-    std::fseek(fp, use32?4:2, SEEK_CUR);
+    unsigned labels_pos = out.Tell();
+    PutWD(0, out, use32); // Patched below
 
-    n_labels += PutLabels(*code, CODE, fp, use32);
-    n_labels += PutLabels(*data, DATA, fp, use32);
-    n_labels += PutLabels(*zero, ZERO, fp, use32);
-    n_labels += PutLabels( *bss, BSS,  fp, use32);
+    n_labels += PutLabels(*code, CODE, out, use32);
+    n_labels += PutLabels(*data, DATA, out, use32);
+    n_labels += PutLabels(*zero, ZERO, out, use32);
+    n_labels += PutLabels( *bss, BSS,  out, use32);
 
-    std::fseek(fp, labels_pos, SEEK_SET);
-    PutWD(n_labels, fp, use32);
-    std::fseek(fp, 0, SEEK_END);
+    out.Seek(labels_pos);
+    PutWD(n_labels, out, use32);
+    out.SeekEnd();
 }
 
-void Object::WriteIPS(std::FILE* fp)
+void Object::WriteIPS(OutputBuffer& out)
 {
     if(code->Linkage.type != LinkageWish::LinkAnywhere
     || data->Linkage.type != LinkageWish::LinkAnywhere)
@@ -1395,17 +1537,17 @@ void Object::WriteIPS(std::FILE* fp)
         fprintf(stderr, "Warning: IPS file is never relocated - .link statement(s) ignored.\n");
     }
 
-    PutS("PATCH", 5, fp);
+    PutS("PATCH", 5, out);
 
-    IPSwriteSeg(*code, fp);
-    IPSwriteSeg(*data, fp);
+    IPSwriteSeg(*code, out, errors);
+    IPSwriteSeg(*data, out, errors);
     NotWritingSeg(*bss);
     NotWritingSeg(*zero);
 
-    PutS("EOF", 3, fp);
+    PutS("EOF", 3, out);
 }
 
-void Object::WriteRAW(std::FILE* fp, unsigned size, unsigned offset)
+void Object::WriteRAW(OutputBuffer& out, unsigned size, unsigned offset)
 {
     if(code->Linkage.type != LinkageWish::LinkAnywhere
     || data->Linkage.type != LinkageWish::LinkAnywhere)
@@ -1413,18 +1555,14 @@ void Object::WriteRAW(std::FILE* fp, unsigned size, unsigned offset)
         fprintf(stderr, "Warning: RAW file is never relocated - .link statement(s) ignored.\n");
     }
 
-    RAWwriteSeg(*code, fp, offset);
-    RAWwriteSeg(*data, fp, offset);
+    RAWwriteSeg(*code, out, errors, offset);
+    RAWwriteSeg(*data, out, errors, offset);
     NotWritingSeg(*bss);
     NotWritingSeg(*zero);
 
-    if(fp)
+    if(out.GetSize() < size)
     {
-        std::fseek(fp, 0, SEEK_END);
-        if(std::ftell(fp) < size)
-        {
-            ftruncate(fileno(fp), size);
-        }
+        out.Resize(size);
     }
 }
 
@@ -1435,17 +1573,28 @@ void Object::Dump()
     //DumpFixups();
 }
 
-bool Object::ShouldFlipHere() const
+bool Object::ShouldFlip(SegmentSelection seg, unsigned pos) const
 {
-    return GetSeg().ShouldFlipHere();
+    switch(seg)
+    {
+        case CODE: return code->ShouldFlip(pos);
+        case DATA: return data->ShouldFlip(pos);
+        case ZERO: return zero->ShouldFlip(pos);
+        case BSS: return bss->ShouldFlip(pos);
+    }
+    return false;
 }
 
-bool Object::NeedsFlipping() const
+bool Object::IsZeroPage(SegmentSelection seg, unsigned pos) const
 {
-   return code->NeedsFlipping()
-        || data->NeedsFlipping()
-        || zero->NeedsFlipping()
-        || bss->NeedsFlipping();
+    switch(seg)
+    {
+        case CODE: return code->IsZeroPage(pos);
+        case DATA: return data->IsZeroPage(pos);
+        case ZERO: return zero->IsZeroPage(pos);
+        case BSS: return bss->IsZeroPage(pos);
+    }
+    return false;
 }
 
 void Object::GenerateByte(unsigned char byte)
@@ -1453,7 +1602,7 @@ void Object::GenerateByte(unsigned char byte)
     Segment& seg = GetSeg();
     seg.AddByte(byte);
 }
-void Object::AddLump(const std::vector<unsigned char>& lump)
+void Object::AddLump(ByteSpan lump)
 {
     Segment& seg = GetSeg();
     seg.AddLump(lump);
@@ -1475,6 +1624,58 @@ void Object::SetLinkagePage(unsigned page)
     seg.Linkage.SetLinkagePage(page);
 }
 
+SymbolId Object::GetPrevBranchLabel(unsigned length)
+{
+    SymbolId& l = PrevBranchLabel[length];
+    if(!l) CreateNewPrevBranch(length);
+    return l;
+}
+
+SymbolId Object::GetNextBranchLabel(unsigned length)
+{
+    SymbolId& l = NextBranchLabel[length];
+    if(!l) CreateNewNextBranch(length);
+    return l;
+}
+
+void Object::CreateNewPrevBranch(unsigned length)
+{
+    char Buf[128];
+    std::sprintf(Buf, "$PrevBranch%u$%u", length,++PrevBranchNumber);
+
+    DefinedBranchLabels.push_back(PrevBranchLabel[length] = InternSymbol(Buf));
+}
+
+void Object::CreateNewNextBranch(unsigned length)
+{
+    char Buf[128];
+    std::sprintf(Buf, "$NextBranch%u$%u", length,++NextBranchNumber);
+
+    DefinedBranchLabels.push_back(NextBranchLabel[length] = InternSymbol(Buf));
+}
+
+SymbolId Object::CreateNopLabel()
+{
+    char Buf[128];
+    std::sprintf(Buf, "$NopLabel$%u", ++NopLabelNumber);
+
+    SymbolId label = InternSymbol(Buf);
+    DefinedBranchLabels.push_back(label);
+    return label;
+}
+
+void Object::UndefineBranchLabels()
+{
+    for(std::list<SymbolId>::const_iterator
+        i = DefinedBranchLabels.begin();
+        i != DefinedBranchLabels.end();
+        ++i)
+    {
+        UndefineLabel(*i);
+    }
+    DefinedBranchLabels.clear();
+}
+
 
 void Object::DumpLabels() const
 {
@@ -1504,6 +1705,7 @@ void Object::ClearMost()
 {
     CurScope = 0;
     CurSegment = CODE;
+    LabelTable.clear();
 
     code->ClearMost();
     data->ClearMost();
@@ -1516,7 +1718,11 @@ Object::Object()
       data(new Segment),
       zero(new Segment),
       bss(new Segment),
-      CurScope(0), CurSegment(CODE)
+      CurScope(0), CurSegment(CODE), LabelTable(),
+      PrevBranchLabel(), NextBranchLabel(), DefinedBranchLabels(),
+      PrevBranchNumber(0), NextBranchNumber(0), NopLabelNumber(0),
+      fix_jumps(false), fix_zeropage(false), already_reprocessed(false), errors(false),
+      listing()
 {
 }
 
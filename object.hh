@@ -2,8 +2,16 @@
 #define bqt65asmObjectHH
 
 #include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <unordered_map>
 
 #include "o65linker.hh"
+#include "symbol.hh"
+#include "listing.hh"
+#include "bytespan.hh"
+#include "outbuf.hh"
 
 class Object
 {
@@ -11,20 +19,31 @@ public:
     Object();
     ~Object();
 
-    // Clears everything else but flip-positions
+    // Clears everything else but the listing
     void ClearMost();
 
     void StartScope();
     void EndScope();
 
     void GenerateByte(unsigned char byte);
-    void AddLump(const std::vector<unsigned char>& lump);
+    void AddLump(ByteSpan lump);
 
-    void AddExtern(char prefix, const std::string& ref, long value);
+    void AddExtern(char prefix, SymbolId ref, long value);
 
+    // These accept the "+" and "&" scope prefixes
     void DefineLabel(const std::string& label);
     void DefineLabel(const std::string& label, unsigned value);
-    void UndefineLabel(const std::string& label);
+    // These define it in the current scope
+    void DefineLabel(SymbolId label);
+    void DefineLabel(SymbolId label, unsigned value);
+    // This defines it in the given scope
+    void DefineLabel(unsigned scopenum, SymbolId label, unsigned value);
+
+    /* Strips the "+" and "&" scope prefixes from the label,
+     * and tells which scope they select.
+     */
+    SymbolId LabelScope(std::string_view label, unsigned& scopenum) const;
+    void UndefineLabel(SymbolId label);
 
     void SetPos(unsigned newpos);
     unsigned GetPos() const;
@@ -33,11 +52,14 @@ public:
     void SelectDATA() { CurSegment = DATA; }
     void SelectZERO() { CurSegment = ZERO; }
     void SelectBSS()  { CurSegment = BSS; }
+    SegmentSelection GetSegment() const { return CurSegment; }
 
     unsigned GetSegmentBase() const;
     unsigned GetSegmentSize() const;
     std::vector<unsigned char> GetContent() const;
     std::vector<unsigned char> GetContent(unsigned begin, unsigned size) const;
+    // Without copying; see DataArea::GetView
+    ByteSpan GetView(unsigned begin, unsigned size) const;
 
     unsigned GetUtilization(unsigned begin, unsigned size) const;
 
@@ -45,27 +67,53 @@ public:
 
     void Dump();
 
-    void WriteO65(std::FILE* fp);
-    void WriteIPS(std::FILE* fp);
-    void WriteRAW(std::FILE* fp, unsigned size=0, unsigned offset=0);
+    void WriteO65(OutputBuffer& out);
+    void WriteIPS(OutputBuffer& out);
+    void WriteRAW(OutputBuffer& out, unsigned size=0, unsigned offset=0);
 
-    // If a REL8 should be flipped at this position
-    bool ShouldFlipHere() const;
+    // If the REL8 at this position was found out of range
+    bool ShouldFlip(SegmentSelection seg, unsigned pos) const;
+    // If the word operand at this position was found to point into zero page
+    bool IsZeroPage(SegmentSelection seg, unsigned pos) const;
 
-    bool NeedsFlipping() const;
+    bool FindLabel(SymbolId name) const;
 
-    bool FindLabel(const std::string& s) const;
-
-    bool FindLabel(const std::string& name,
-                   SegmentSelection& seg, unsigned& result) const;
-
-    bool FindLabel(const std::string& name, unsigned level,
+    bool FindLabel(SymbolId name,
                    SegmentSelection& seg, unsigned& result) const;
 
     void SetLinkageAddress(unsigned addr);
     void SetLinkageGroup(unsigned num);
     void SetLinkagePage(unsigned page);
 
+    // What "-" and "+" mean, for each length of "-" and "+"
+    SymbolId GetPrevBranchLabel(unsigned length);
+    SymbolId GetNextBranchLabel(unsigned length);
+    void CreateNewPrevBranch(unsigned length);
+    void CreateNewNextBranch(unsigned length);
+    SymbolId CreateNopLabel();
+    // Undefines the labels created by the above
+    void UndefineBranchLabels();
+    const std::list<SymbolId>& GetBranchLabels() const { return DefinedBranchLabels; }
+
+    // Automatically correct short jumps
+    void SetFixJumps(bool value) { fix_jumps = value; }
+    bool GetFixJumps() const { return fix_jumps; }
+    // Use zero page addressing for operands that turn out to be there
+    void SetFixZeroPage(bool value) { fix_zeropage = value; }
+    bool GetFixZeroPage() const { return fix_zeropage; }
+    bool KeepsListing() const { return fix_jumps || fix_zeropage; }
+    // Set when the listing is being assembled again
+    void SetReprocessed(bool value) { already_reprocessed = value; }
+    bool GetReprocessed() const { return already_reprocessed; }
+
+    // The statements assembled so far, if KeepsListing()
+    Listing& GetListing() { return listing; }
+
+    /*! Has an error been found? */
+    bool Error() const { return errors; }
+    /*! Set error flag */
+    void SetError() { errors = true; }
+
 public:
     class Segment;
 
@@ -76,6 +124,27 @@ private:
     unsigned CurScope;
     SegmentSelection CurSegment;
 
+    struct LabelDef
+    {
+        unsigned level;
+        SegmentSelection seg;
+        unsigned value;
+    };
+    // The definitions of each label, the most recent last
+    std::unordered_map<SymbolId, std::vector<LabelDef> > LabelTable;
+
+    std::map<unsigned, SymbolId> PrevBranchLabel;
+    std::map<unsigned, SymbolId> NextBranchLabel;
+    std::list<SymbolId> DefinedBranchLabels;
+    unsigned PrevBranchNumber, NextBranchNumber, NopLabelNumber;
+
+    bool fix_jumps;
+    bool fix_zeropage;
+    bool already_reprocessed; // The diagnostics have been given once
+    bool errors;
+
+    Listing listing;
+
 public:
     //LinkageWish Linkage;
 
@@ -85,6 +154,8 @@ private:
     Segment& GetSeg();
     const Segment& GetSeg() const;
 
+    void ClearLabels(Segment& seg, unsigned level);
+
     void DumpLabels() const;
     void DumpExterns() const;
     void DumpFixups() const;
@@ -95,6 +166,4 @@ private:
     void operator=(const Object&) = delete;
 };
 
-extern bool fix_jumps;
-
 #endif
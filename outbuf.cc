@@ -0,0 +1,117 @@
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <atomic>
+#ifndef WIN32
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "outbuf.hh"
+
+void OutputBuffer::PutC(unsigned char c)
+{
+    if(pos >= bytes.size()) bytes.resize(pos + 1);
+    bytes[pos++] = c;
+}
+
+void OutputBuffer::PutS(ByteSpan s)
+{
+    if(s.empty()) return;
+    if(pos + s.size() > bytes.size()) bytes.resize(pos + s.size());
+    std::memcpy(&bytes[pos], s.data(), s.size());
+    pos += s.size();
+}
+
+void OutputBuffer::PutS(const void* s, unsigned n)
+{
+    PutS(ByteSpan(static_cast<const unsigned char*>(s), n));
+}
+
+bool OutputBuffer::WriteTo(std::FILE* fp) const
+{
+    if(!bytes.empty() && std::fwrite(&bytes[0], bytes.size(), 1, fp) != 1)
+        return false;
+    return std::fflush(fp) == 0;
+}
+
+namespace
+{
+    // Writes the buffer into the file or device as it is.
+    bool WriteThrough(const OutputBuffer& buf, const std::string& filename)
+    {
+        std::FILE* fp = std::fopen(filename.c_str(), "wb");
+        if(!fp)
+        {
+            std::perror(filename.c_str());
+            return false;
+        }
+        bool ok = buf.WriteTo(fp);
+        if(std::fclose(fp) != 0) ok = false;
+        if(!ok) std::perror(filename.c_str());
+        return ok;
+    }
+
+#ifndef WIN32
+    // Creates a new file next to "filename", with a name no one else uses.
+    std::FILE* CreateTemp(const std::string& filename, std::string& tempfn)
+    {
+        static std::atomic<unsigned> counter(0);
+        for(;;)
+        {
+            char Buf[64];
+            std::sprintf(Buf, ".%ld-%u.tmp", (long)getpid(), counter++);
+            tempfn = filename + Buf;
+
+            // Unlike mkstemp(), this gives the permissions a new file would get.
+            int fd = open(tempfn.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+            if(fd < 0)
+            {
+                if(errno == EEXIST) continue;
+                return nullptr;
+            }
+            std::FILE* fp = fdopen(fd, "wb");
+            if(!fp) { close(fd); std::remove(tempfn.c_str()); }
+            return fp;
+        }
+    }
+#endif
+}
+
+bool OutputBuffer::WriteFile(const std::string& filename) const
+{
+#ifdef WIN32
+    return WriteThrough(*this, filename);
+#else
+    // Only a regular file is replaced. Devices, pipes and symlinks
+    // are written through, so that they stay what they are.
+    struct stat st;
+    if(lstat(filename.c_str(), &st) == 0 && !S_ISREG(st.st_mode))
+        return WriteThrough(*this, filename);
+
+    std::string tempfn;
+    std::FILE* fp = CreateTemp(filename, tempfn);
+    if(!fp)
+    {
+        std::perror(tempfn.c_str());
+        return false;
+    }
+    bool ok = WriteTo(fp);
+    if(std::fclose(fp) != 0) ok = false;
+
+    if(!ok)
+    {
+        std::perror(tempfn.c_str());
+        std::remove(tempfn.c_str());
+        return false;
+    }
+    if(std::rename(tempfn.c_str(), filename.c_str()) != 0)
+    {
+        std::perror(filename.c_str());
+        std::remove(tempfn.c_str());
+        return false;
+    }
+    return true;
+#endif
+}
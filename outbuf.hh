@@ -0,0 +1,49 @@
+#ifndef bqt65asmOutBufHH
+#define bqt65asmOutBufHH
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "bytespan.hh"
+
+/* An output file that is built in memory and written out at once.
+ * Writing starts at the current position; seeking past the end
+ * and writing there leaves zeros in between, like in a file.
+ */
+class OutputBuffer
+{
+public:
+    OutputBuffer(): bytes(), pos(0) { }
+
+    void PutC(unsigned char c);
+    void PutS(ByteSpan s);
+    void PutS(const void* s, unsigned n);
+
+    unsigned Tell() const { return pos; }
+    void Seek(unsigned newpos) { pos = newpos; }
+    void SeekEnd() { pos = bytes.size(); }
+
+    unsigned GetSize() const { return bytes.size(); }
+    void Resize(unsigned size) { bytes.resize(size); }
+
+    /* Writes everything to the stream. Returns false on error. */
+    bool WriteTo(std::FILE* fp) const;
+
+    /* Writes everything into a temporary file, which then replaces
+     * the named file. Either way, no partial file is left behind.
+     * Returns false (after telling why) on error.
+     */
+    bool WriteFile(const std::string& filename) const;
+
+private:
+    std::vector<unsigned char> bytes;
+    unsigned pos;
+
+private:
+    // Copying prohibited
+    OutputBuffer(const OutputBuffer&) = delete;
+    const OutputBuffer& operator= (const OutputBuffer&) = delete;
+};
+
+#endif
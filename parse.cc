@@ -1,4 +1,5 @@
 #include <cctype>
+#include <cstring>
 
 #include "parse.hh"
 #include "expr.hh"
@@ -7,15 +8,25 @@
 
 namespace
 {
-    const std::string ParseToken(ParseData& data)
+    /* Returns the next number or symbol as a view into the text.
+     * Hexadecimal numbers written as 0x.. are returned as $..,
+     * which is assembled into "buffer".
+     */
+    std::string_view ParseToken(ParseData& data, std::string& buffer)
     {
-        std::string token;
         data.SkipSpace();
+
+        // The token is prefix + the text from "from" onwards
+        const ParseData::StateType start = data.SaveState();
+        ParseData::StateType from = start;
+        const char* prefix = "";
+        auto length = [&]() { return std::strlen(prefix) + (data.SaveState() - from); };
+
         char c = data.PeekC();
         if(c == '$')
         {
         Hex:
-            token += data.GetC();
+            data.GetC();
         Hex2:
             for(;;)
             {
@@ -23,9 +34,9 @@ namespace
                 if( (c >= '0' && c <= '9')
                  || (c >= 'A' && c <= 'F')
                  || (c >= 'a' && c <= 'f')
-                 || (c == '-' && token.size()==1)
+                 || (c == '-' && length()==1)
                   )
-                    token += data.GetC();
+                    data.GetC();
                 else
                     break;
             }
@@ -40,23 +51,24 @@ namespace
                 data.LoadState(state);
                 if(c == '$')
                 {
-                    token += c;
+                    prefix = "$";
                     goto Hex;
                 }
                 bool ok = c >= '0' && c <= '9';
-                if(!ok) return token;
+                if(!ok) return std::string_view();
             }
             for(;;)
             {
-                token += data.GetC();
+                data.GetC();
 
                 if(data.EOF()) break;
                 c = data.PeekC();
 
                 if(c == 'x' || c == 'X')
                 {
-                    if(token == "0")  { data.GetC(); token = "$"; goto Hex2; }
-                    if(token == "-0") { data.GetC(); token = "-$"; goto Hex2; }
+                    const std::string_view token = data.GetText(start, data.SaveState());
+                    if(token == "0")  { data.GetC(); prefix = "$";  from = data.SaveState(); goto Hex2; }
+                    if(token == "-0") { data.GetC(); prefix = "-$"; from = data.SaveState(); goto Hex2; }
                 }
                 if(c < '0' || c > '9') break;
             }
@@ -65,31 +77,30 @@ namespace
         {
             for(;;)
             {
-                token += data.GetC();
+                data.GetC();
                 if(data.EOF()) break;
                 c = data.PeekC();
                 if(c != '_' && !isalnum(c)) break;
             }
         }
-        return token;
-    }
 
-    std::unique_ptr<expression> CreatePlusExpr(std::unique_ptr<expression>&& left, std::unique_ptr<expression>&& right)
-    {
-        return std::unique_ptr<expression>( new sum_group(std::move(left), std::move(right), false) );
+        const std::string_view text = data.GetText(from, data.SaveState());
+        if(!*prefix) return text;
+        buffer.assign(prefix);
+        buffer.append(text);
+        return buffer;
     }
 
-    std::unique_ptr<expression> CreateMinusExpr(std::unique_ptr<expression>&& left, std::unique_ptr<expression>&& right)
+    /* Appends the expression to e in postfix order.
+     * Returns false and leaves e as it was if there was none.
+     */
+    bool RealParseExpression(ParseData& data, Object& obj, expression& e, int prio=0,
+                             char disallow_local_label=0)
     {
-        return std::unique_ptr<expression>( new sum_group(std::move(left), std::move(right), true) );
-    }
+        const std::size_t begin = e.nodes.size();
 
-    std::unique_ptr<expression> RealParseExpression(ParseData& data, int prio=0,
-                                                    char disallow_local_label=0)
-    {
-        std::string s = ParseToken(data);
-
-        std::unique_ptr<expression> left; // NULL
+        std::string buffer;
+        const std::string_view s = ParseToken(data, buffer);
 
         if(s.empty()) /* If no number or symbol */
         {
@@ -115,47 +126,44 @@ namespace
                 ParseData::StateType state = data.SaveState();
                 data.GetC(); // eat
                 data.SkipSpace();
-                const std::string RestBefore = data.GetRest();
+                const ParseData::StateType before = data.SaveState();
+                bool ok = false;
                 if(data.PeekC() != '+')
                 {
-                    left = RealParseExpression(data, prio_negate, c);
+                    ok = RealParseExpression(data, obj, e, prio_negate, c);
                 }
-                if(!left)
+                if(!ok)
                 {
-                    const std::string RestAfter = data.GetRest();
+                    const ParseData::StateType after = data.SaveState();
                     data.LoadState(state);
 
-                    if(RestBefore != RestAfter)
+                    if(before != after)
                     {
                         // If the error happened later, return an error.
-                        return std::move(left);
+                        return false;
                     }
 
                     // If it ate *nothing*, we've got PrevBranchLabel here.
                     goto GotLocalLabel;
                 }
-                else
-                {
-                    left = std::unique_ptr<expression>( new expr_negate(std::move(left)) );
-                }
+                e.Push(expression::Negate);
             }
             else if(c == '~')
             {
                 ParseData::StateType state = data.SaveState();
                 data.GetC(); // eat
-                left = RealParseExpression(data, prio_bitnot);
-                if(!left) { data.LoadState(state); return std::move(left); }
-                left = std::unique_ptr<expression>( new expr_bitnot(std::move(left)) );
+                if(!RealParseExpression(data, obj, e, prio_bitnot)) { data.LoadState(state); return false; }
+                e.Push(expression::BitNot);
             }
             else if(c == '(')
             {
                 ParseData::StateType state = data.SaveState();
                 data.GetC(); // eat
-                left = RealParseExpression(data, 0);
+                bool ok = RealParseExpression(data, obj, e, 0);
                 data.SkipSpace();
                 if(data.PeekC() == ')') data.GetC();
-                else if(left) { left.reset(); } // set NULL
-                if(!left) { data.LoadState(state); return std::move(left); }
+                else if(ok) { e.nodes.resize(begin); ok = false; }
+                if(!ok) { data.LoadState(state); return false; }
             }
             else
             {
@@ -163,16 +171,16 @@ namespace
                 switch(local_label)
                 {
                     case '-':
-                        left = std::unique_ptr<expression>( new expr_label(GetPrevBranchLabel(local_length)) );
+                        e.PushLabel(obj.GetPrevBranchLabel(local_length));
                         for(unsigned a=0; a<local_length; ++a) data.GetC();
-                        break;
+                        return true;
                     case '+':
-                        left = std::unique_ptr<expression>( new expr_label(GetNextBranchLabel(local_length)) );
+                        e.PushLabel(obj.GetNextBranchLabel(local_length));
                         for(unsigned a=0; a<local_length; ++a) data.GetC();
-                        break;
+                        return true;
                 }
                 // default
-                return std::move(left);
+                return false;
             }
         }
         else if(s[0] == '-' || s[0] == '$' || (s[0] >= '0' && s[0] <= '9'))
@@ -183,7 +191,7 @@ namespace
             if(s[0] == '$')
             {
                 unsigned pos = 1;
-                if(s[1] == '-') { ++pos; negative = true; }
+                if(s.size() > 1 && s[1] == '-') { ++pos; negative = true; }
 
                 for(; pos < s.size(); ++pos)
                 {
@@ -202,26 +210,26 @@ namespace
             }
 
             if(negative) value = -value;
-            left = std::unique_ptr<expression>( new expr_number(value) );
+            e.PushNumber(value);
         }
         else
         {
             if(IsReservedWord(s))
             {
                 /* Attempt to use a reserved as variable name */
-                return std::move(left);
+                return false;
             }
 
-            left = std::unique_ptr<expression>( new expr_label(std::move(s)) );
+            e.PushLabel(InternSymbol(s));
         }
 
         data.SkipSpace();
-        if(!left) return std::move(left);
 
     Reop:
         if(!data.EOF())
         {
-            #define op2(reqprio, c1,c2, create_binaryexpr) \
+            /* For + and -, the left operand becomes the first term of a sum. */
+            #define op2(reqprio, c1,c2, tag, negative) \
                 if(prio < reqprio && data.PeekC() == c1) \
                 { \
                     ParseData::StateType state = data.SaveState(); \
@@ -236,35 +244,41 @@ namespace
                     if(ok) \
                     { \
                         data.GetC(); \
-                        std::unique_ptr<expression> right = RealParseExpression(data, reqprio); \
-                        if(!right) \
+                        const std::size_t mid = e.nodes.size(); \
+                        if(tag == expression::Sum) e.Push(expression::Term, 0); \
+                        if(!RealParseExpression(data, obj, e, reqprio)) \
                         { \
+                            e.nodes.resize(mid); \
                             data.LoadState(state); \
-                            return std::move(left); \
+                            return true; \
                         } \
-                        left = std::unique_ptr<expression>( create_binaryexpr(std::move(left), std::move(right)) ); \
-                        if(left->IsConst()) \
+                        if(tag == expression::Sum) \
                         { \
-                            left = std::unique_ptr<expression>( new expr_number(left->GetConst()) ); \
+                            e.Push(expression::Term, negative); \
+                            e.Push(expression::Sum, 2); \
                         } \
+                        else \
+                            e.Push(tag); \
+                        e.FoldConst(begin); \
                         goto Reop; \
                 }   }
 
-            op2(prio_addsub, '+',   0, CreatePlusExpr);
-            op2(prio_addsub, '-',   0, CreateMinusExpr);
-            op2(prio_divmul, '*',   0, new expr_mul);
-            op2(prio_divmul, '/',   0, new expr_div);
-            op2(prio_shifts, '<', '<', new expr_shl);
-            op2(prio_shifts, '>', '>', new expr_shr);
-            op2(prio_bitand, '&',   0, new expr_bitand);
-            op2(prio_bitor,  '|',   0, new expr_bitor);
-            op2(prio_bitxor, '^',   0, new expr_bitxor);
+            op2(prio_addsub, '+',   0, expression::Sum, false);
+            op2(prio_addsub, '-',   0, expression::Sum, true);
+            op2(prio_divmul, '*',   0, expression::Mul, false);
+            op2(prio_divmul, '/',   0, expression::Div, false);
+            op2(prio_shifts, '<', '<', expression::Shl, false);
+            op2(prio_shifts, '>', '>', expression::Shr, false);
+            op2(prio_bitand, '&',   0, expression::BitAnd, false);
+            op2(prio_bitor,  '|',   0, expression::BitOr, false);
+            op2(prio_bitxor, '^',   0, expression::BitXor, false);
+            #undef op2
         }
-        return std::move(left);
+        return true;
     }
 }
 
-bool ParseExpression(ParseData& data, ins_parameter& result)
+bool ParseExpression(ParseData& data, ins_parameter& result, Object& obj)
 {
     data.SkipSpace();
 
@@ -287,17 +301,15 @@ bool ParseExpression(ParseData& data, ins_parameter& result)
         prefix = 0;
     }
 
-    std::unique_ptr<expression> e = RealParseExpression(data);
-    if(e)
+    result.prefix = prefix;
+    result.exp.clear();
+    if(RealParseExpression(data, obj, result.exp))
     {
-        e->Optimize(e);
+        result.exp.Optimize();
     }
 
-    result.prefix = prefix;
-    result.exp    = std::move(e);
-
     //std::fprintf(stderr, "ParseExpression returned: '%s'\n", result.Dump().c_str());
-    return result.exp.get() != nullptr;
+    return !result.exp.empty();
 }
 
 static bool CompareChar(char c1, char c2)
@@ -307,9 +319,12 @@ static bool CompareChar(char c1, char c2)
     return c1 == c2;
 }
 
-tristate ParseAddrMode(ParseData& data, unsigned modenum,
-                       ins_parameter& p1, ins_parameter& p2,
-                       const Object& obj)
+OperandParser::OperandParser(ParseData& d, Object& o)
+    : data(d), obj(o), start(d.SaveState()), shapes(), num_shapes(0)
+{
+}
+
+tristate OperandParser::Match(unsigned modenum, ins_parameter*& p1, ins_parameter*& p2)
 {
     #define ParseReq(s) \
         for(const char *q = s; *q; ++q, data.GetC()) { \
@@ -319,40 +334,70 @@ tristate ParseAddrMode(ParseData& data, unsigned modenum,
     #define ParseOptional(c) \
         data.SkipSpace(); if(CompareChar(data.PeekC(), c)) data.GetC()
     #define ParseExpr(p) \
-        if(!ParseExpression(data, p)) return false
+        if(!ParseExpression(data, p, obj)) return false
 
     if(modenum >= AddrModeCount) return false;
 
     const AddrMode& modedata = AddrModes[modenum];
 
+    data.LoadState(start);
     if(modedata.forbid) { ParseNotAllow(modedata.forbid); }
-    ParseReq(modedata.prereq);
-    if(modedata.p1 != AddrMode::tNone) { ParseExpr(p1); }
-    if(modedata.p2 != AddrMode::tNone) { ParseOptional(','); ParseExpr(p2); }
+
+    const bool has_p1 = modedata.p1 != AddrMode::tNone;
+    const bool has_p2 = modedata.p2 != AddrMode::tNone;
+
+    unsigned shapenum = 0;
+    while(shapenum < num_shapes
+      && (shapes[shapenum].has_p1 != has_p1
+       || shapes[shapenum].has_p2 != has_p2
+       || std::strcmp(shapes[shapenum].prereq, modedata.prereq))) ++shapenum;
+
+    Shape& shape = shapes[shapenum];
+    if(shapenum == num_shapes)
+    {
+        ++num_shapes;
+        shape.prereq = modedata.prereq;
+        shape.has_p1 = has_p1;
+        shape.has_p2 = has_p2;
+        shape.ok     = [&]()
+        {
+            data.LoadState(start);
+            ParseReq(modedata.prereq);
+            if(has_p1) { ParseExpr(shape.p1); }
+            if(has_p2) { ParseOptional(','); ParseExpr(shape.p2); }
+            return true;
+        }();
+        shape.tail = data.SaveState();
+    }
+    if(!shape.ok) return false;
+
+    data.LoadState(shape.tail);
     ParseReq(modedata.postreq);
 
     data.SkipSpace();
     tristate result = data.EOF();
     switch(modedata.p1)
     {
-        case AddrMode::tByte: result=result && p1.is_byte(obj); break;
-        case AddrMode::tWord: result=result && p1.is_word(obj); break;
+        case AddrMode::tByte: result=result && shape.p1.is_byte(obj); break;
+        case AddrMode::tWord: result=result && shape.p1.is_word(obj); break;
         case AddrMode::tRel8: ;
         case AddrMode::tNone: ;
     }
     switch(modedata.p2)
     {
-        case AddrMode::tByte: result=result && p2.is_byte(obj); break;
-        case AddrMode::tWord: result=result && p2.is_word(obj); break;
+        case AddrMode::tByte: result=result && shape.p2.is_byte(obj); break;
+        case AddrMode::tWord: result=result && shape.p2.is_word(obj); break;
         case AddrMode::tRel8: ;
         case AddrMode::tNone: ;
     }
 
 /*
     std::fprintf(stderr, "Parsed: p1=\"%s\", p2=\"%s\"\n",
-        p1.Dump().c_str(),p2.Dump().c_str());
+        shape.p1.Dump().c_str(),shape.p2.Dump().c_str());
 */
 
+    p1 = &shape.p1;
+    p2 = &shape.p2;
     return result;
 }
 
@@ -368,7 +413,7 @@ tristate ins_parameter::is_byte(const Object& obj) const
         return prefix == FORCE_LOBYTE || prefix == FORCE_HIBYTE || prefix == FORCE_SEGBYTE;
     }
 
-    if(!exp->IsConst())
+    if(!exp.IsConst())
     {
         auto p = IsLabelSumExpression(exp);
         if(p.second < -0x80 || p.second >= 0x100) return false;
@@ -376,7 +421,7 @@ tristate ins_parameter::is_byte(const Object& obj) const
         // check if the label is in .zero segment (ZERO)
         // and the offset is smaller than 256.
         // If so, this is a byte param.
-        if(!p.first.empty())
+        if(p.first)
         {
             SegmentSelection seg;
             unsigned         value=0;
@@ -391,7 +436,7 @@ tristate ins_parameter::is_byte(const Object& obj) const
     }
     else
     {
-        long value = exp->GetConst();
+        long value = exp.GetConst();
         return value >= -0x80 && value < 0x100;
     }
 }
@@ -403,7 +448,7 @@ tristate ins_parameter::is_word(const Object& obj) const
         return prefix == FORCE_ABSWORD;
     }
 
-    if(!exp->IsConst())
+    if(!exp.IsConst())
     {
         auto p = IsLabelSumExpression(exp);
         if(p.second < -0x8000 || p.second >= 0x10000) return false;
@@ -412,7 +457,7 @@ tristate ins_parameter::is_word(const Object& obj) const
     }
     else
     {
-        long value = exp->GetConst();
+        long value = exp.GetConst();
         return value >= -0x8000 && value < 0x10000;
     }
 }
@@ -424,13 +469,13 @@ tristate ins_parameter::is_long(const Object& obj) const
         return prefix == FORCE_LONG;
     }
 
-    if(!exp->IsConst())
+    if(!exp.IsConst())
     {
         return maybe;
     }
     else
     {
-        long value = exp->GetConst();
+        long value = exp.GetConst();
         return value >= -0x800000 && value < 0x1000000;
     }
 }
@@ -2,25 +2,28 @@
 #define bqt65asmParseHH
 
 #include <string>
-#include <memory>
+#include <string_view>
 
 #include "expr.hh"
 #include "assemble.hh"
+#include "insdata.hh"
 #include "tristate"
 
 #undef EOF
 
+/* A view of one statement. The text is not copied;
+ * it must stay alive as long as the ParseData does.
+ */
 struct ParseData
 {
 private:
-    std::string data;
-    unsigned pos, eofpos;
+    const char* data;
+    std::size_t pos, eofpos;
 public:
-    typedef unsigned StateType;
+    typedef std::size_t StateType;
 
-    ParseData() : data(), pos(0), eofpos(0) { }
-    ParseData(const std::string& s) : data(s), pos(0), eofpos(data.size()) { }
-    ParseData(const char *s) : data(s), pos(0), eofpos(data.size()) { }
+    ParseData() : data(""), pos(0), eofpos(0) { }
+    ParseData(std::string_view s) : data(s.data()), pos(0), eofpos(s.size()) { }
 
     bool EOF() const { return pos >= eofpos; }
     void SkipSpace() { while(!EOF() && (data[pos] == ' ' || data[pos] == '\t'))++pos; }
@@ -29,22 +32,27 @@ public:
     char GetC() { return EOF() ? 0 : data[pos++]; }
     char PeekC() const { return EOF() ? 0 : data[pos]; }
 
-    const std::string GetRest() const { return data.substr(pos); }
+    /* The text between two states. */
+    std::string_view GetText(StateType begin, StateType end) const
+        { return std::string_view(data + begin, end - begin); }
+
+    const std::string GetRest() const { return std::string(data + pos, eofpos - pos); }
 };
 
 class Object;
 struct ins_parameter
 {
     char prefix;
-    std::unique_ptr<expression> exp;
+    expression exp; // Empty if none
 
-    ins_parameter(): prefix(0), exp(/*NULL*/)
+    ins_parameter(): prefix(0), exp()
     {
     }
 
     ins_parameter(unsigned char num)
-    : prefix(FORCE_LOBYTE), exp(new expr_number(num))
+    : prefix(FORCE_LOBYTE), exp()
     {
+        exp.PushNumber(num);
     }
 
     tristate is_byte(const Object& obj) const;
@@ -55,16 +63,50 @@ struct ins_parameter
     {
         std::string result;
         if(prefix) result += prefix;
-        if(exp) result += exp->Dump(); else result += "(nil)";
+        if(!exp.empty()) result += exp.Dump(); else result += "(nil)";
         return result;
     }
 };
 
-bool ParseExpression(ParseData& data, ins_parameter& result);
+bool ParseExpression(ParseData& data, ins_parameter& result, Object& obj);
+
+/* Parses the operand of an instruction for each addressing mode in turn.
+ * The modes that begin with the same text share the parsed expressions;
+ * only the text that follows them is compared for each mode.
+ */
+class OperandParser
+{
+public:
+    OperandParser(ParseData& data, Object& obj);
 
-tristate ParseAddrMode(ParseData& data, unsigned modenum,
-                       ins_parameter& p1, ins_parameter& p2,
-                       const Object& obj);
+    /* If the operand may be in this mode, p1 and p2 are pointed to
+     * the parameters. They are shared by the modes of the same shape.
+     */
+    tristate Match(unsigned modenum, ins_parameter*& p1, ins_parameter*& p2);
+
+private:
+    struct Shape
+    {
+        const char *prereq;
+        bool has_p1, has_p2;
+
+        bool ok;
+        ins_parameter p1, p2;
+        ParseData::StateType tail; // Where the expressions end
+    };
+
+    ParseData& data;
+    Object& obj;
+    ParseData::StateType start;
+
+    Shape shapes[MaxAddrModes];
+    unsigned num_shapes;
+
+private:
+    // Copying prohibited
+    OperandParser(const OperandParser&) = delete;
+    const OperandParser& operator= (const OperandParser&) = delete;
+};
 
 bool IsDelimiter(char c);
 
@@ -1,4 +1,4 @@
-#define SUPPORT_THREADS 0
+#define SUPPORT_THREADS 1
 #define SUPPORT_FORK 1
 
 #ifdef WIN32
@@ -22,13 +22,21 @@
 
 
 #if SUPPORT_THREADS
-#include <pthread.h>
+#include <thread>
+#include "ringbuffer.hh"
 #endif
 
 #include "precompile.hh"
+#include "preprocess.hh"
 #include "assemble.hh"
+#include "mapfile.hh"
 
 /*
+  Builtin and Thread use the built-in preprocessor (preprocess.cc).
+  Thread runs it as a pipeline of three threads:
+    split into logical lines -> preprocess -> assemble
+  The Fork and TempFile methods run "gcc -E", with the following arrangements.
+
   Prior preprocessing:
    constants:
     # -> something else
@@ -50,6 +58,7 @@ namespace
 
     enum Methods
     {
+        Builtin,
 #if SUPPORT_THREADS
         Thread,
 #endif
@@ -59,10 +68,10 @@ namespace
         TempFile
     };
 
-#if SUPPORT_THREADS
+#if SUPPORT_THREADS && defined(__linux__)
     Methods DefaultMethod = Thread;
 #else
-    Methods DefaultMethod = TempFile;
+    Methods DefaultMethod = Builtin;
 #endif
 
     Methods AsmMethod = DefaultMethod;
@@ -149,87 +158,102 @@ namespace
     }
 
 #if SUPPORT_THREADS
-    struct thread_param
-    {
-        std::FILE *read_cpp;
-        std::FILE *write_file;
-        pthread_t task;
-    };
+    typedef RingBuffer<std::string, 8> LineBlocks;
+    const std::size_t BlockSize = 0x10000;
 
-    void *Postprocessor(void *param)
+    /* Stage 1: Reads the input and splits it into logical lines.
+     * A line that was continued is followed by the extra newlines.
+     */
+    void SplitLines(std::FILE *fp, LineBlocks& out)
     {
-        // Takes a void* parameter because run as a thread.
+        const MappedFile text(fp);
+        Preprocessor::LineReader reader(text.data(), text.size());
 
-        struct thread_param* postpo = (struct thread_param*) param;
-
-        std::FILE *fp = postpo->read_cpp;
-        std::FILE *fo = postpo->write_file;
-
-        PostProcess(fp, fo);
-
-        return NULL;
+        std::string block, line;
+        unsigned nlines;
+        while(reader.GetLine(line, nlines))
+        {
+            block += line;
+            block.append(nlines, '\n');
+            if(block.size() >= BlockSize)
+            {
+                out.Push(std::move(block));
+                block.clear();
+            }
+        }
+        if(!block.empty()) out.Push(std::move(block));
+        out.Close();
     }
 
-    void *Preprocessor(void *param)
+    /* Stage 2: Preprocesses the logical lines. */
+    void PreprocessLines(Preprocessor& preprocessor, LineBlocks& in, LineBlocks& out)
     {
-        // Takes a void* parameter because run as a thread.
-
-        struct thread_param* postpo = (struct thread_param*) param;
+        std::string block, line, result;
+        while(in.Pop(block))
+        {
+            for(std::size_t a = 0; a < block.size(); )
+            {
+                std::size_t b = block.find('\n', a);
+                line.assign(block, a, b-a);
+                preprocessor.ProcessLine(line, 1, result);
+                a = b+1;
+            }
+            if(result.size() >= BlockSize)
+            {
+                out.Push(std::move(result));
+                result.clear();
+            }
+        }
+        preprocessor.Finish();
+        if(!result.empty()) out.Push(std::move(result));
+        out.Close();
+    }
 
-        std::FILE *fp = postpo->read_cpp;
-        std::FILE *fo = postpo->write_file;
+    /* Runs stages 1 and 2 in their own threads, and gives
+     * the preprocessed text to the consumer block by block.
+     * Returns false if the preprocessor reported errors.
+     */
+    template<typename Consumer>
+    bool RunPipeline(std::FILE *fp, const std::string& filename, Consumer&& consume)
+    {
+        Preprocessor preprocessor(filename);
+        LineBlocks lines, result;
 
-        Precompile(fp, fo);
+        std::thread splitter(SplitLines, fp, std::ref(lines));
+        std::thread cpp(PreprocessLines, std::ref(preprocessor), std::ref(lines), std::ref(result));
 
-        std::fclose(fo);
+        std::string block;
+        while(result.Pop(block))
+            consume(block);
 
-        return NULL;
+        splitter.join();
+        cpp.join();
+        return !preprocessor.Error();
     }
 #endif
 }
 
-void Precompile(std::FILE *fp, std::FILE *fo)
+void Precompile(std::FILE *fp, std::FILE *fo, const std::string& filename)
 {
     if(!fp || !fo) return;
 
     switch(GccMethod)
     {
+        case Builtin:
+        {
+            Preprocessor preprocessor(filename);
+            std::string result;
+            preprocessor.Process(fp, result);
+            std::fwrite(result.data(), 1, result.size(), fo);
+            break;
+        }
 #if SUPPORT_THREADS
         case Thread:
         {
-            int to_cpp[2];   pipe(to_cpp);
-            int from_cpp[2]; pipe(from_cpp);
-            int cpp_pid = fork();
-
-            if(cpp_pid == 0)
+            RunPipeline(fp, filename, [fo](const std::string& block)
             {
-                dup2(to_cpp[0],   0); // input: FeedGcc()
-                dup2(from_cpp[1], 1); //output: Postprocessor()
-                close(to_cpp[1]);
-                close(from_cpp[0]);
-                execlp("gcc", "gcc", "-E", "-", NULL);
-                _exit(-1);
-            }
-            close(to_cpp[0]);
-            close(from_cpp[1]);
-
-            FILE *cpp    = fdopen(to_cpp[1], "wt");
-            FILE *result = fdopen(from_cpp[0], "rt");
-
-            // Create a thread for reading the pipe.
-            struct thread_param postpo;
-            postpo.read_cpp   = result; // input: gcc
-            postpo.write_file = fo;     //output: outputfile
-            pthread_create(&postpo.task, NULL, Postprocessor, (void *)&postpo);
-
-            FeedGcc(fp, cpp);           // input: inputfile
-            std::fclose(cpp);           //output: gcc
-
-            pthread_join(postpo.task, NULL);
-
-            std::fclose(result);
-
-            wait(NULL);
+                std::fwrite(block.data(), 1, block.size(), fo);
+            });
             break;
         }
 #endif
@@ -271,8 +295,8 @@ void Precompile(std::FILE *fp, std::FILE *fo)
             PostProcess(result, fo);    // input: gcc
             std::fclose(result);        //output: outputfile
 
-            wait(NULL); // wait for gcc    to die
-            wait(NULL); // wait for feeder to die
+            waitpid(cpp_pid, NULL, 0);  // wait for gcc    to die
+            waitpid(feed_pid, NULL, 0); // wait for feeder to die
 
             break;
         }
@@ -292,13 +316,13 @@ void Precompile(std::FILE *fp, std::FILE *fo)
             {
                 dup2(fileno(temp),  0); // input: tmp1
                 dup2(fileno(temp2), 1); //output: tmp2
-                std::fclose(temp);
-                std::fclose(temp2);
+                close(fileno(temp));
+                close(fileno(temp2));
                 execlp("gcc", "gcc", "-E", "-", NULL);
                 _exit(-1);
             }
             std::fclose(temp);
-            wait(NULL);
+            waitpid(cpp_pid, NULL, 0);
 #else
             int org_stdin = dup(0);  dup2(fileno(temp), 0);
             int org_stdout = dup(1); dup2(fileno(temp2), 1);
@@ -323,30 +347,30 @@ void Precompile(std::FILE *fp, std::FILE *fo)
     }
 }
 
-void PrecompileAndAssemble(std::FILE *fp, Object& obj)
+void PrecompileAndAssemble(std::FILE *fp, Object& obj, const std::string& filename)
 {
     switch(AsmMethod)
     {
-#if SUPPORT_THREADS
-        case Thread:
+        case Builtin:
         {
-            /* THREAD VERSION */
-            int pip[2]; pipe(pip); // For communication.
-
-            struct thread_param prepo;
-
-            prepo.read_cpp   = fp;
-            prepo.write_file = fdopen(pip[1], "wt");
-
-            pthread_create(&prepo.task, NULL, Preprocessor, (void*)&prepo);
-
-            std::FILE *result = fdopen(pip[0], "rt");
+            Preprocessor preprocessor(filename);
+            std::string result;
+            preprocessor.Process(fp, result);
+            if(preprocessor.Error()) obj.SetError();
 
             AssemblePrecompiled(result, obj);
-
-            fclose(result);
-
-            pthread_join(prepo.task, NULL);
+            break;
+        }
+#if SUPPORT_THREADS
+        case Thread:
+        {
+            BeginAssembly(obj);
+            bool ok = RunPipeline(fp, filename, [&obj](const std::string& block)
+            {
+                AssembleLines(block, obj);
+            });
+            EndAssembly(obj);
+            if(!ok) obj.SetError();
             break;
         }
 #endif
@@ -360,13 +384,13 @@ void PrecompileAndAssemble(std::FILE *fp, Object& obj)
             int pid = fork();
             if(!pid)
             {
-                std::fclose(stdin);  // not used
-                std::fclose(stdout); // not used
+                // stdin and stdout are left open, because Precompile()
+                // creates pipes of its own, and those must not get fds 0 and 1.
 
                 /* Start a precompiler as a child process */
                 close(pip[0]);
                 std::FILE *result = fdopen(pip[1], "wt");
-                Precompile(fp, result);
+                Precompile(fp, result, filename);
                 std::fclose(result);
                 _exit(0);
             }
@@ -377,7 +401,7 @@ void PrecompileAndAssemble(std::FILE *fp, Object& obj)
             AssemblePrecompiled(result, obj);
 
             fclose(result);
-            wait(NULL);
+            waitpid(pid, NULL, 0);
             break;
         }
 #endif
@@ -390,7 +414,7 @@ void PrecompileAndAssemble(std::FILE *fp, Object& obj)
                 return;
             }
 
-            Precompile(fp, temp);
+            Precompile(fp, temp, filename);
 
             rewind(temp);
 
@@ -403,6 +427,12 @@ void PrecompileAndAssemble(std::FILE *fp, Object& obj)
     }
 }
 
+void UseBuiltin()
+{
+    AsmMethod = Builtin;
+    GccMethod = Builtin;
+}
+
 void UseTemps()
 {
     AsmMethod = TempFile;
@@ -415,8 +445,8 @@ void UseThreads()
     AsmMethod = Thread;
     GccMethod = Thread;
 #else
-    std::fprintf(stderr, "Warning: Thread support not built in, using forks instead\n");
-    UseFork();
+    std::fprintf(stderr, "Warning: Thread support not built in, using the builtin method instead\n");
+    UseBuiltin();
 #endif
 }
 
@@ -1,10 +1,13 @@
 #include <cstdio>
+#include <string>
 
 #include "object.hh"
 
-void Precompile(std::FILE *fp, std::FILE *fo);
-void PrecompileAndAssemble(std::FILE *fp, Object& obj);
+/* filename names the input in diagnostics; it is not opened here. */
+void Precompile(std::FILE *fp, std::FILE *fo, const std::string& filename);
+void PrecompileAndAssemble(std::FILE *fp, Object& obj, const std::string& filename);
 
+void UseBuiltin();
 void UseTemps();
 void UseThreads();
 void UseFork();
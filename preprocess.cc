@@ -0,0 +1,894 @@
+#include <cctype>
+#include <climits>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+
+#include "preprocess.hh"
+#include "mapfile.hh"
+
+namespace
+{
+    struct Token
+    {
+        enum Type { Space, Ident, Number, String, Other, Param, Paste, Placemarker };
+
+        Type type;
+        std::string text;
+        unsigned param;                       // Parameter index, when type=Param
+        std::vector<const std::string*> hide; // Macros that must not be expanded from this token
+        bool expanded;                        // Produced by a macro expansion
+
+    public:
+        Token(Type t, const std::string& s): type(t), text(s), param(0), hide(), expanded(false) { }
+    };
+    typedef std::vector<Token> TokenList;
+
+    inline bool IsSpace(char c)      { return c == ' ' || c == '\t' || c == '\v' || c == '\f'; }
+    inline bool IsIdentBegin(char c) { return std::isalpha((unsigned char)c) || c == '_' || c == '$'; }
+    inline bool IsIdentChar(char c)  { return std::isalnum((unsigned char)c) || c == '_' || c == '$'; }
+
+    std::size_t SkipSpace(const std::string& s, std::size_t pos)
+    {
+        while(pos < s.size() && IsSpace(s[pos])) ++pos;
+        return pos;
+    }
+    std::size_t IdentEnd(const std::string& s, std::size_t pos)
+    {
+        while(pos < s.size() && IsIdentChar(s[pos])) ++pos;
+        return pos;
+    }
+    std::size_t NumberEnd(const std::string& s, std::size_t pos)
+    {
+        while(pos < s.size() && (IsIdentChar(s[pos]) || s[pos] == '.')) ++pos;
+        return pos;
+    }
+    std::size_t StringEnd(const std::string& s, std::size_t pos)
+    {
+        // pos points to the character after the opening quote
+        while(pos < s.size() && s[pos] != '"')
+            pos += (s[pos] == '\\' && pos+1 < s.size()) ? 2 : 1;
+        return pos < s.size() ? pos+1 : pos;
+    }
+
+    void Tokenize(const std::string& s, std::size_t pos, TokenList& result)
+    {
+        static const char punctuators[][3] =
+            { "##", "<<", ">>", "++", "--", "&&", "||", "==", "!=", "<=", ">=", "->" };
+
+        while(pos < s.size())
+        {
+            std::size_t end = pos+1;
+            Token::Type type = Token::Other;
+            const char c = s[pos];
+            if(IsSpace(c))
+            {
+                while(end < s.size() && IsSpace(s[end])) ++end;
+                type = Token::Space;
+            }
+            else if(IsIdentBegin(c))
+                { end = IdentEnd(s, end); type = Token::Ident; }
+            else if(std::isdigit((unsigned char)c))
+                { end = NumberEnd(s, end); type = Token::Number; }
+            else if(c == '"')
+                { end = StringEnd(s, end); type = Token::String; }
+            else if(end < s.size())
+            {
+                for(const char* p: punctuators)
+                    if(c == p[0] && s[end] == p[1]) { ++end; break; }
+            }
+            result.emplace_back(type, s.substr(pos, end-pos));
+            pos = end;
+        }
+    }
+
+    void TrimSpace(TokenList& t)
+    {
+        while(!t.empty() && t.back().type == Token::Space) t.pop_back();
+        std::size_t n = 0;
+        while(n < t.size() && t[n].type == Token::Space) ++n;
+        t.erase(t.begin(), t.begin() + (long)n);
+    }
+
+    bool Hidden(const Token& t, const std::string* name)
+    {
+        return std::find(t.hide.begin(), t.hide.end(), name) != t.hide.end();
+    }
+
+    /* Would these characters lex differently if printed next to each other */
+    bool WouldPaste(char a, char b)
+    {
+        if(IsIdentChar(a) && IsIdentChar(b)) return true;
+        if(a == '.' && std::isdigit((unsigned char)b)) return true;
+        if(a == b && std::strchr("+-<>&|=#", a)) return true;
+        return (b == '=' && std::strchr("<>!", a)) || (a == '-' && b == '>');
+    }
+
+    /* Evaluates the expression of an #if directive */
+    class Evaluator
+    {
+        std::vector<const Token*> tokens;
+        std::size_t pos;
+    public:
+        std::string error;
+
+        explicit Evaluator(const TokenList& t): tokens(), pos(0), error()
+        {
+            for(const auto& tok: t)
+                if(tok.type != Token::Space)
+                    tokens.push_back(&tok);
+        }
+
+        long Run()
+        {
+            long result = Conditional();
+            if(pos < tokens.size())
+                Fail("Unexpected '" + tokens[pos]->text + "'");
+            return result;
+        }
+
+    private:
+        void Fail(const std::string& s)
+        {
+            if(error.empty()) error = s;
+            pos = tokens.size();
+        }
+        bool Accept(const char* op)
+        {
+            if(pos < tokens.size()
+            && tokens[pos]->type == Token::Other
+            && tokens[pos]->text == op) { ++pos; return true; }
+            return false;
+        }
+
+        long Conditional()
+        {
+            long c = Binary(1);
+            if(!Accept("?")) return c;
+            long a = Conditional();
+            if(!Accept(":")) Fail("Expected ':'");
+            long b = Conditional();
+            return c ? a : b;
+        }
+
+        static int Priority(const std::string& op)
+        {
+            static const struct { const char* op; int prio; } ops[] =
+            {
+                {"||",1}, {"&&",2}, {"|",3}, {"^",4}, {"&",5},
+                {"==",6}, {"!=",6}, {"<",7}, {">",7}, {"<=",7}, {">=",7},
+                {"<<",8}, {">>",8}, {"+",9}, {"-",9}, {"*",10}, {"/",10}, {"%",10}
+            };
+            for(const auto& o: ops)
+                if(op == o.op) return o.prio;
+            return 0;
+        }
+
+        long Binary(int minprio)
+        {
+            long left = Unary();
+            while(pos < tokens.size() && tokens[pos]->type == Token::Other)
+            {
+                const std::string& op = tokens[pos]->text;
+                int prio = Priority(op);
+                if(!prio || prio < minprio) break;
+                ++pos;
+                long right = Binary(prio+1);
+
+                if(op == "||") left = left || right;
+                else if(op == "&&") left = left && right;
+                else if(op == "|")  left |= right;
+                else if(op == "^")  left ^= right;
+                else if(op == "&")  left &= right;
+                else if(op == "==") left = left == right;
+                else if(op == "!=") left = left != right;
+                else if(op == "<")  left = left < right;
+                else if(op == ">")  left = left > right;
+                else if(op == "<=") left = left <= right;
+                else if(op == ">=") left = left >= right;
+                else if(op == "<<" || op == ">>")
+                {
+                    if(right < 0 || right >= long(sizeof(long) * CHAR_BIT))
+                        Fail("Shift count out of range");
+                    else if(op == "<<") left = long((unsigned long)left << right);
+                    else                left >>= right;
+                }
+                // These wrap around on overflow instead of trapping
+                else if(op == "+")  left = long((unsigned long)left + (unsigned long)right);
+                else if(op == "-")  left = long((unsigned long)left - (unsigned long)right);
+                else if(op == "*")  left = long((unsigned long)left * (unsigned long)right);
+                else if(!right) Fail("Division by zero");
+                else if(right == -1) left = op == "/" ? long(0ul - (unsigned long)left) : 0;
+                else if(op == "/")  left /= right;
+                else                left %= right;
+            }
+            return left;
+        }
+
+        long Unary()
+        {
+            if(Accept("!")) return !Unary();
+            if(Accept("~")) return ~Unary();
+            if(Accept("-")) return long(0ul - (unsigned long)Unary());
+            if(Accept("+")) return Unary();
+            return Primary();
+        }
+
+        long Primary()
+        {
+            if(pos >= tokens.size())
+            {
+                Fail("Unexpected end of expression");
+                return 0;
+            }
+            const Token& t = *tokens[pos++];
+            switch(t.type)
+            {
+                case Token::Number:
+                    return std::strtol(t.text.c_str(), NULL, 0);
+                case Token::Ident:
+                    // Identifiers that are not macros evaluate to 0
+                    return 0;
+                default:
+                    if(t.text == "(")
+                    {
+                        long result = Conditional();
+                        if(!Accept(")")) Fail("Expected ')'");
+                        return result;
+                    }
+                    Fail("Unexpected '" + t.text + "'");
+                    return 0;
+            }
+        }
+    };
+}
+
+class Preprocessor::Macros
+{
+public:
+    struct Macro
+    {
+        bool function_like;
+        bool variadic;
+        std::vector<std::string> params;
+        TokenList body;
+    };
+    std::unordered_map<std::string, Macro> table;
+
+public:
+    explicit Macros(Preprocessor& p): table(), pp(p) { }
+
+    bool Define(const std::string& s, std::size_t pos);
+    bool NeedsExpansion(const std::string& s) const;
+    void Expand(TokenList& tokens);
+
+private:
+    TokenList Substitute(const Macro& m, const std::vector<TokenList>& args);
+    static void Paste(TokenList& tokens);
+
+    Preprocessor& pp;
+};
+
+bool Preprocessor::Macros::Define(const std::string& s, std::size_t pos)
+{
+    pos = SkipSpace(s, pos);
+    std::size_t end = IdentEnd(s, pos);
+    if(end == pos || !IsIdentBegin(s[pos])) return false;
+
+    const std::string name = s.substr(pos, end-pos);
+    Macro m;
+    m.function_like = false;
+    m.variadic      = false;
+
+    pos = end;
+    if(pos < s.size() && s[pos] == '(')
+    {
+        m.function_like = true;
+        for(++pos; ; ++pos)
+        {
+            pos = SkipSpace(s, pos);
+            if(pos < s.size() && s[pos] == ')' && m.params.empty()) break;
+            if(s.compare(pos, 3, "...") == 0)
+            {
+                m.params.push_back("__VA_ARGS__");
+                m.variadic = true;
+                pos += 3;
+            }
+            else
+            {
+                end = IdentEnd(s, pos);
+                if(end == pos) return false;
+                m.params.push_back(s.substr(pos, end-pos));
+                pos = end;
+            }
+            pos = SkipSpace(s, pos);
+            if(pos < s.size() && s[pos] == ')') break;
+            if(pos >= s.size() || s[pos] != ',' || m.variadic) return false;
+        }
+        ++pos;
+    }
+
+    TokenList tokens;
+    Tokenize(s, pos, tokens);
+    TrimSpace(tokens);
+
+    // Find the parameters and the ## operators
+    for(auto& t: tokens)
+    {
+        if(t.type == Token::Other && t.text == "##")
+        {
+            while(!m.body.empty() && m.body.back().type == Token::Space) m.body.pop_back();
+            t.type = Token::Paste;
+        }
+        else if(t.type == Token::Space && !m.body.empty() && m.body.back().type == Token::Paste)
+            continue;
+        else if(t.type == Token::Ident)
+        {
+            auto p = std::find(m.params.begin(), m.params.end(), t.text);
+            if(p != m.params.end())
+            {
+                t.type  = Token::Param;
+                t.param = (unsigned)(p - m.params.begin());
+            }
+        }
+        m.body.push_back(std::move(t));
+    }
+
+    table[name] = std::move(m);
+    return true;
+}
+
+bool Preprocessor::Macros::NeedsExpansion(const std::string& s) const
+{
+    std::string word;
+    for(std::size_t a = 0; a < s.size(); )
+    {
+        const char c = s[a];
+        if(c == '"')
+            a = StringEnd(s, a+1);
+        else if(IsIdentBegin(c))
+        {
+            std::size_t end = IdentEnd(s, a+1);
+            word.assign(s, a, end-a);
+            if(table.find(word) != table.end()) return true;
+            a = end;
+        }
+        else if(std::isdigit((unsigned char)c))
+            a = NumberEnd(s, a+1);
+        else
+            ++a;
+    }
+    return false;
+}
+
+void Preprocessor::Macros::Expand(TokenList& tokens)
+{
+    for(std::size_t a = 0; a < tokens.size(); )
+    {
+        if(tokens[a].type != Token::Ident) { ++a; continue; }
+
+        auto i = table.find(tokens[a].text);
+        if(i == table.end() || Hidden(tokens[a], &i->first)) { ++a; continue; }
+
+        const Macro& m = i->second;
+        std::vector<const std::string*> hide = tokens[a].hide;
+        std::size_t end = a+1;
+        TokenList replacement;
+
+        if(!m.function_like)
+            replacement = m.body;
+        else
+        {
+            std::size_t b = a+1;
+            while(b < tokens.size() && tokens[b].type == Token::Space) ++b;
+            if(b >= tokens.size() || tokens[b].text != "(")
+            {
+                // Name of a function-like macro without parameters: not a call.
+                ++a;
+                continue;
+            }
+
+            std::vector<TokenList> args(1);
+            unsigned depth = 0;
+            for(++b; b < tokens.size(); ++b)
+            {
+                const Token& t = tokens[b];
+                if(t.type == Token::Other)
+                {
+                    if(t.text == "(")
+                        ++depth;
+                    else if(t.text == ")")
+                    {
+                        if(!depth) break;
+                        --depth;
+                    }
+                    else if(t.text == "," && !depth
+                         && !(m.variadic && args.size() == m.params.size()))
+                    {
+                        args.emplace_back();
+                        continue;
+                    }
+                }
+                args.back().push_back(t);
+            }
+            if(b >= tokens.size())
+            {
+                pp.ErrorMessage("Unterminated call to macro '%s'", i->first.c_str());
+                ++a;
+                continue;
+            }
+
+            for(auto& arg: args) TrimSpace(arg);
+            if(m.params.empty() && args.size() == 1 && args[0].empty())
+                args.clear();
+            if(m.variadic && args.size()+1 == m.params.size())
+                args.emplace_back();
+            if(args.size() != m.params.size())
+            {
+                pp.ErrorMessage("Macro '%s' requires %u arguments, but %u given",
+                    i->first.c_str(), (unsigned)m.params.size(), (unsigned)args.size());
+                ++a;
+                continue;
+            }
+
+            // The expansion is hidden by what hides both the name and the ")".
+            std::vector<const std::string*> common;
+            for(auto h: hide)
+                if(Hidden(tokens[b], h))
+                    common.push_back(h);
+            hide.swap(common);
+
+            end = b+1;
+            replacement = Substitute(m, args);
+        }
+
+        Paste(replacement);
+
+        hide.push_back(&i->first);
+        for(auto& t: replacement)
+        {
+            for(auto h: hide)
+                if(!Hidden(t, h))
+                    t.hide.push_back(h);
+            t.expanded = true;
+        }
+
+        // Replace the invocation and rescan.
+        tokens.erase(tokens.begin() + (long)a, tokens.begin() + (long)end);
+        tokens.insert(tokens.begin() + (long)a, replacement.begin(), replacement.end());
+    }
+}
+
+TokenList Preprocessor::Macros::Substitute(const Macro& m, const std::vector<TokenList>& args)
+{
+    std::vector<TokenList> expanded(args.size());
+    std::vector<bool> done(args.size());
+
+    TokenList result;
+    for(std::size_t k = 0; k < m.body.size(); ++k)
+    {
+        const Token& t = m.body[k];
+        if(t.type != Token::Param)
+        {
+            result.push_back(t);
+            continue;
+        }
+
+        // Operands of ## are not macro-expanded
+        bool pasted = (k > 0             && m.body[k-1].type == Token::Paste)
+                   || (k+1 < m.body.size() && m.body[k+1].type == Token::Paste);
+
+        const TokenList* arg = &args[t.param];
+        if(pasted)
+        {
+            if(arg->empty()) result.emplace_back(Token::Placemarker, "");
+        }
+        else
+        {
+            if(!done[t.param])
+            {
+                expanded[t.param] = *arg;
+                Expand(expanded[t.param]);
+                done[t.param] = true;
+            }
+            arg = &expanded[t.param];
+        }
+        result.insert(result.end(), arg->begin(), arg->end());
+    }
+    return result;
+}
+
+void Preprocessor::Macros::Paste(TokenList& tokens)
+{
+    if(std::none_of(tokens.begin(), tokens.end(), [](const Token& t)
+        { return t.type == Token::Paste || t.type == Token::Placemarker; }))
+        return;
+
+    TokenList result;
+    for(std::size_t k = 0; k < tokens.size(); ++k)
+    {
+        if(tokens[k].type != Token::Paste)
+        {
+            result.push_back(std::move(tokens[k]));
+            continue;
+        }
+        std::size_t n = k+1;
+        while(n < tokens.size() && tokens[n].type == Token::Space) ++n;
+        while(!result.empty() && result.back().type == Token::Space) result.pop_back();
+        if(n >= tokens.size() || result.empty() || tokens[n].type == Token::Paste)
+            continue;
+
+        Token left = std::move(result.back());
+        result.pop_back();
+
+        TokenList joined;
+        Tokenize(left.text + tokens[n].text, 0, joined);
+        for(auto& t: joined)
+            t.hide = left.hide;
+        result.insert(result.end(), joined.begin(), joined.end());
+        k = n;
+    }
+    result.erase(std::remove_if(result.begin(), result.end(), [](const Token& t)
+        { return t.type == Token::Placemarker; }), result.end());
+    tokens.swap(result);
+}
+
+Preprocessor::Preprocessor(const std::string& filename)
+    : macros(new Macros(*this)), conditions(), sources(), errors(false)
+{
+    sources.push_back(Source{filename, 0, 1, 0});
+
+    macros->Define("shl <<", 0);
+    macros->Define("shr >>", 0);
+//  macros->Define("and &", 0);     - problems!
+    macros->Define("or |", 0);
+    macros->Define("xor ^", 0);
+    macros->Define("not ~", 0);
+}
+
+Preprocessor::~Preprocessor()
+{
+    delete macros;
+}
+
+void Preprocessor::Process(const char* text, std::size_t length, std::string& output)
+{
+    Run(text, length, output);
+    Finish();
+}
+
+void Preprocessor::Process(std::FILE* fp, std::string& output)
+{
+    const MappedFile text(fp);
+    Process(text.data(), text.size(), output);
+}
+
+void Preprocessor::Run(const char* text, std::size_t length, std::string& output)
+{
+    LineReader reader(text, length);
+    std::string line;
+    unsigned nlines;
+    while(reader.GetLine(line, nlines))
+        ProcessLine(line, nlines, output);
+}
+
+void Preprocessor::Finish()
+{
+    if(conditions.size() > sources.back().num_conditions)
+    {
+        ErrorMessage("Unterminated #if");
+        conditions.resize(sources.back().num_conditions);
+    }
+}
+
+Preprocessor::LineReader::LineReader(const char* t, std::size_t l)
+    : text(t), length(l), pos(0)
+{
+}
+
+bool Preprocessor::LineReader::GetLine(std::string& line, unsigned& nlines)
+{
+    if(pos >= length) return false;
+
+    line.clear();
+    nlines = 1;
+
+    bool quote = false, comment = false, blockcomment = false;
+    while(pos < length)
+    {
+        const char c = text[pos++];
+        const char next = pos < length ? text[pos] : '\0';
+
+        if(c == '\\' && (next == '\n' || (next == '\r' && pos+1 < length && text[pos+1] == '\n')))
+        {
+            // Continued line
+            pos += (next == '\r') ? 2 : 1;
+            ++nlines;
+            continue;
+        }
+        if(c == '\n' || (c == '\r' && next == '\n'))
+        {
+            if(c == '\r') ++pos;
+            if(!blockcomment) break;
+            ++nlines;
+            continue;
+        }
+        if(blockcomment)
+        {
+            if(c == '*' && next == '/')
+            {
+                ++pos;
+                blockcomment = false;
+                line += ' ';
+            }
+            continue;
+        }
+        if(comment) continue;
+        if(quote)
+        {
+            line += c;
+            if(c == '\\' && pos < length && next != '\n')
+                line += text[pos++];
+            else if(c == '"')
+                quote = false;
+            continue;
+        }
+        if(c == '"')
+            quote = true;
+        else if(c == ';' || (c == '/' && next == '/'))
+        {
+            comment = true;
+            continue;
+        }
+        else if(c == '/' && next == '*')
+        {
+            ++pos;
+            blockcomment = true;
+            continue;
+        }
+        line += c;
+    }
+    return true;
+}
+
+void Preprocessor::ProcessLine(const std::string& line, unsigned nlines, std::string& output)
+{
+    Source& src = sources.back();
+    src.line = src.next_line;
+    src.next_line += nlines;
+
+    std::size_t pos = SkipSpace(line, 0);
+    if(pos < line.size() && line[pos] == '#')
+    {
+        std::size_t begin = SkipSpace(line, pos+1);
+        std::size_t end   = IdentEnd(line, begin);
+        if(Directive(line.substr(begin, end-begin), line, end, output))
+        {
+            output.append(nlines, '\n');
+            return;
+        }
+    }
+    if(Active())
+        ExpandLine(line, output);
+    output.append(nlines, '\n');
+}
+
+bool Preprocessor::Active() const
+{
+    return conditions.empty() || conditions.back().taking;
+}
+
+bool Preprocessor::Directive(const std::string& word, const std::string& line, std::size_t pos,
+                             std::string& output)
+{
+    if(word == "ifdef" || word == "ifndef")
+    {
+        const bool parent = Active();
+        bool taking = false;
+        if(parent)
+        {
+            pos = SkipSpace(line, pos);
+            std::size_t end = IdentEnd(line, pos);
+            if(end == pos)
+                ErrorMessage("#%s requires an identifier", word.c_str());
+            else
+            {
+                bool defined = macros->table.find(line.substr(pos, end-pos)) != macros->table.end();
+                taking = defined == (word == "ifdef");
+            }
+        }
+        conditions.push_back(Condition{parent, taking, taking, false});
+    }
+    else if(word == "if")
+    {
+        const bool parent = Active();
+        const bool taking = parent && Evaluate(line, pos);
+        conditions.push_back(Condition{parent, taking, taking, false});
+    }
+    else if(word == "elif" || word == "else" || word == "endif")
+    {
+        if(conditions.size() <= sources.back().num_conditions)
+        {
+            ErrorMessage("#%s without #if", word.c_str());
+            return true;
+        }
+        Condition& c = conditions.back();
+        if(word == "endif")
+            conditions.pop_back();
+        else if(c.had_else)
+            ErrorMessage("#%s after #else", word.c_str());
+        else if(word == "else")
+        {
+            c.taking   = c.parent_active && !c.taken;
+            c.taken    = true;
+            c.had_else = true;
+        }
+        else
+        {
+            c.taking = c.parent_active && !c.taken && Evaluate(line, pos);
+            c.taken  = c.taken || c.taking;
+        }
+    }
+    else if(!Active())
+    {
+        // Skipped
+    }
+    else if(word == "define")
+    {
+        if(!macros->Define(line, pos))
+            ErrorMessage("Invalid #define");
+    }
+    else if(word == "undef")
+    {
+        pos = SkipSpace(line, pos);
+        macros->table.erase(line.substr(pos, IdentEnd(line, pos)-pos));
+    }
+    else if(word == "include")
+        Include(line, pos, output);
+    else if(word == "error")
+        ErrorMessage("#error%s", line.c_str() + pos);
+    else
+        return false;
+    return true;
+}
+
+void Preprocessor::Include(const std::string& s, std::size_t pos, std::string& output)
+{
+    pos = SkipSpace(s, pos);
+    std::size_t end = std::string::npos;
+    if(pos < s.size() && s[pos] == '"') end = s.find('"', pos+1);
+    if(pos < s.size() && s[pos] == '<') end = s.find('>', pos+1);
+    if(end == std::string::npos)
+    {
+        ErrorMessage("#include expects \"FILENAME\"");
+        return;
+    }
+    if(sources.size() >= 200)
+    {
+        ErrorMessage("#include nested too deeply");
+        return;
+    }
+
+    const std::string name = s.substr(pos+1, end-pos-1);
+    std::string path = name;
+    std::FILE* fp = NULL;
+
+    // Look first in the directory of the including file
+    const std::string& current = sources.back().name;
+    std::size_t slash = current.rfind('/');
+    if(!name.empty() && name[0] != '/' && slash != std::string::npos)
+    {
+        path = current.substr(0, slash+1) + name;
+        fp = std::fopen(path.c_str(), "rb");
+    }
+    if(!fp)
+    {
+        path = name;
+        fp = std::fopen(path.c_str(), "rb");
+    }
+    if(!fp)
+    {
+        ErrorMessage("%s: %s", name.c_str(), std::strerror(errno));
+        return;
+    }
+    const MappedFile text(fp); // Stays valid after the fclose
+    std::fclose(fp);
+
+    sources.push_back(Source{path, 0, 1, conditions.size()});
+    Run(text.data(), text.size(), output);
+    Finish();
+    sources.pop_back();
+}
+
+bool Preprocessor::Evaluate(const std::string& s, std::size_t pos)
+{
+    TokenList source, tokens;
+    Tokenize(s, pos, source);
+
+    // "defined" must be handled before macros are expanded
+    for(std::size_t a = 0; a < source.size(); ++a)
+    {
+        if(source[a].type != Token::Ident || source[a].text != "defined")
+        {
+            tokens.push_back(source[a]);
+            continue;
+        }
+        std::size_t b = a+1;
+        while(b < source.size() && source[b].type == Token::Space) ++b;
+        const bool paren = b < source.size() && source[b].text == "(";
+        if(paren)
+            for(++b; b < source.size() && source[b].type == Token::Space; ) ++b;
+        if(b >= source.size() || source[b].type != Token::Ident)
+        {
+            ErrorMessage("Operator 'defined' requires an identifier");
+            return false;
+        }
+        const bool defined = macros->table.find(source[b].text) != macros->table.end();
+        if(paren)
+        {
+            for(++b; b < source.size() && source[b].type == Token::Space; ) ++b;
+            if(b >= source.size() || source[b].text != ")")
+            {
+                ErrorMessage("Missing ')' after 'defined'");
+                return false;
+            }
+        }
+        tokens.emplace_back(Token::Number, defined ? "1" : "0");
+        a = b;
+    }
+
+    macros->Expand(tokens);
+
+    Evaluator eval(tokens);
+    const long result = eval.Run();
+    if(!eval.error.empty())
+    {
+        ErrorMessage("#if: %s", eval.error.c_str());
+        return false;
+    }
+    return result != 0;
+}
+
+void Preprocessor::ExpandLine(const std::string& line, std::string& output)
+{
+    if(!macros->NeedsExpansion(line))
+    {
+        output += line;
+        return;
+    }
+
+    TokenList tokens;
+    Tokenize(line, 0, tokens);
+    macros->Expand(tokens);
+
+    // Print the tokens. Where a macro expansion begins or ends,
+    // add a space if the neighbours would otherwise lex differently.
+    char last = '\0';
+    bool last_expanded = false;
+    for(const auto& t: tokens)
+    {
+        if(t.text.empty()) continue;
+        if((t.expanded || last_expanded) && last && WouldPaste(last, t.text[0]))
+            output += ' ';
+        output += t.text;
+        last = t.text.back();
+        last_expanded = t.expanded;
+    }
+}
+
+void Preprocessor::ErrorMessage(const char* fmt, ...)
+{
+    const Source& src = sources.back();
+    std::fprintf(stderr, "Error: %s:%u: ", src.name.c_str(), src.line);
+
+    std::va_list ap;
+    va_start(ap, fmt);
+    std::vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    std::fputc('\n', stderr);
+    errors = true;
+}
@@ -0,0 +1,103 @@
+#ifndef bqt65asmPreprocessHH
+#define bqt65asmPreprocessHH
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/* The built-in preprocessor. Does the job "gcc -E" used to do.
+ *
+ * Supported:
+ *   Comments: ; // and / * * /
+ *   Lines continued with a backslash
+ *   #define (with or without parameters; ## concatenates), #undef
+ *   #if, #ifdef, #ifndef, #elif, #else, #endif
+ *   #include "file"
+ *   #error
+ *
+ * A # that does not begin one of these directives is left as is,
+ * so immediate operands need no escaping.
+ * shl, shr, or, xor and not are predefined as << >> | ^ ~.
+ */
+class Preprocessor
+{
+public:
+    /* filename is the name of the top-level source, used in
+     * messages and as the base for relative #includes.
+     */
+    explicit Preprocessor(const std::string& filename);
+    ~Preprocessor();
+
+    /* Preprocesses source text, appending the result into output. */
+    void Process(const char* text, std::size_t length, std::string& output);
+    void Process(std::FILE* fp, std::string& output);
+
+    /* Splits source text into logical lines:
+     * Comments are removed and continued lines are joined.
+     */
+    class LineReader
+    {
+    public:
+        LineReader(const char* text, std::size_t length);
+
+        /* nlines = number of physical lines consumed. */
+        bool GetLine(std::string& line, unsigned& nlines);
+    private:
+        const char* text;
+        std::size_t length, pos;
+    };
+
+    /* Handles one logical line, appending the result into output.
+     * nlines newlines are appended, to keep the line count.
+     */
+    void ProcessLine(const std::string& line, unsigned nlines, std::string& output);
+
+    /* Reports conditionals that were left open. */
+    void Finish();
+
+    bool Error() const { return errors; }
+
+private:
+    class Macros;
+
+    struct Condition
+    {
+        bool parent_active; // Was the enclosing block active
+        bool taking;        // Is this branch being taken
+        bool taken;         // Has a branch of this conditional been taken
+        bool had_else;
+    };
+
+    struct Source
+    {
+        std::string name;
+        unsigned line, next_line;
+        std::size_t num_conditions; // Conditionals open when the file began
+    };
+
+    void Run(const char* text, std::size_t length, std::string& output);
+    bool Active() const;
+    bool Directive(const std::string& word, const std::string& line, std::size_t pos,
+                   std::string& output);
+    void Include(const std::string& s, std::size_t pos, std::string& output);
+    bool Evaluate(const std::string& s, std::size_t pos);
+    void ExpandLine(const std::string& line, std::string& output);
+
+    void ErrorMessage(const char* fmt, ...)
+#ifdef __GNUC__
+        __attribute__((format(printf,2,3)))
+#endif
+        ;
+
+    Macros* macros;
+    std::vector<Condition> conditions;
+    std::vector<Source> sources;
+    bool errors;
+
+private:
+    // Copying prohibited
+    Preprocessor(const Preprocessor&) = delete;
+    const Preprocessor& operator= (const Preprocessor&) = delete;
+};
+
+#endif
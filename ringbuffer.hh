@@ -0,0 +1,84 @@
+#ifndef bqt65asmRingBufferHH
+#define bqt65asmRingBufferHH
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+/* A bounded queue between one producer thread and one consumer thread.
+ * Push() blocks while the queue is full and Pop() while it is empty.
+ * The waiting side spins briefly before it goes to sleep.
+ */
+template<typename T, unsigned Capacity>
+class RingBuffer
+{
+public:
+    RingBuffer(): slots(), head(0), tail(0), closed(false), sleepers(0), mutex(), cond() { }
+
+    void Push(T&& item)
+    {
+        const unsigned t = tail.load(std::memory_order_relaxed);
+        Wait([&] { return t - head.load() < Capacity; });
+        slots[t % Capacity] = std::move(item);
+        tail.store(t+1);
+        Wake();
+    }
+
+    /* Returns false once the queue is closed and empty. */
+    bool Pop(T& item)
+    {
+        const unsigned h = head.load(std::memory_order_relaxed);
+        Wait([&] { return tail.load() != h || closed.load(); });
+        if(tail.load() == h) return false;
+        item = std::move(slots[h % Capacity]);
+        head.store(h+1);
+        Wake();
+        return true;
+    }
+
+    /* Called by the producer when it has nothing more to push. */
+    void Close()
+    {
+        closed.store(true);
+        Wake();
+    }
+
+private:
+    template<typename Pred>
+    void Wait(Pred ready)
+    {
+        for(unsigned n=0; n<64; ++n)
+        {
+            if(ready()) return;
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        ++sleepers;
+        cond.wait(lock, ready);
+        --sleepers;
+    }
+
+    void Wake()
+    {
+        if(sleepers.load())
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cond.notify_all();
+        }
+    }
+
+    T slots[Capacity];
+    std::atomic<unsigned> head, tail;
+    std::atomic<bool> closed;
+    std::atomic<unsigned> sleepers;
+    std::mutex mutex;
+    std::condition_variable cond;
+
+private:
+    // Copying prohibited
+    RingBuffer(const RingBuffer&) = delete;
+    const RingBuffer& operator= (const RingBuffer&) = delete;
+};
+
+#endif
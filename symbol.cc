@@ -0,0 +1,78 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+
+#include "symbol.hh"
+
+namespace
+{
+    /* The names are kept in chunks that never move or get freed,
+     * so SymbolName() can read them without locking. A name is in
+     * place before "count" is raised past its id, and an id is only
+     * handed out after that.
+     */
+    const unsigned ChunkBits = 12;
+    const unsigned ChunkSize = 1u << ChunkBits;
+    const unsigned MaxChunks = 1u << 16;
+
+    struct SymbolTable
+    {
+        std::mutex lock; // Taken when adding names
+        std::unordered_map<std::string_view, SymbolId> ids;
+        std::string* chunks[MaxChunks]; // ChunkSize names each
+        std::atomic<SymbolId> count;
+
+        SymbolTable(): lock(), ids(), chunks(), count(0)
+        {
+            Add(std::string_view());
+        }
+
+        // Call with the lock held
+        SymbolId Add(std::string_view name)
+        {
+            const SymbolId id = count.load(std::memory_order_relaxed);
+            if((id >> ChunkBits) >= MaxChunks)
+            {
+                std::fprintf(stderr, "Error: Too many different symbol names\n");
+                std::abort();
+            }
+            std::string*& chunk = chunks[id >> ChunkBits];
+            if(!chunk) chunk = new std::string[ChunkSize];
+
+            std::string& slot = chunk[id & (ChunkSize-1)];
+            slot.assign(name);
+            ids.emplace(slot, id);
+
+            count.store(id + 1, std::memory_order_release);
+            return id;
+        }
+    };
+
+    SymbolTable& GetTable()
+    {
+        static SymbolTable table;
+        return table;
+    }
+}
+
+SymbolId InternSymbol(std::string_view name)
+{
+    SymbolTable& t = GetTable();
+    std::lock_guard<std::mutex> lock(t.lock);
+
+    auto i = t.ids.find(name);
+    if(i != t.ids.end()) return i->second;
+
+    return t.Add(name);
+}
+
+const std::string& SymbolName(SymbolId id)
+{
+    SymbolTable& t = GetTable();
+    // Pairs with the release in Add(), making the name visible.
+    t.count.load(std::memory_order_acquire);
+    return t.chunks[id >> ChunkBits][id & (ChunkSize-1)];
+}
@@ -0,0 +1,22 @@
+#ifndef bqt65asmSymbolHH
+#define bqt65asmSymbolHH
+
+#include <string>
+#include <string_view>
+
+/* Label names are interned: each distinct name gets a small number,
+ * which stays valid for the rest of the process.
+ * The table is shared by all threads; only adding names takes a lock.
+ */
+typedef unsigned SymbolId;
+
+SymbolId InternSymbol(std::string_view name);
+const std::string& SymbolName(SymbolId id);
+
+/* For output that is sorted by name. */
+struct SymbolNameLess
+{
+    bool operator() (SymbolId a, SymbolId b) const { return SymbolName(a) < SymbolName(b); }
+};
+
+#endif